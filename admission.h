@@ -0,0 +1,412 @@
+/*
+Admission control and load shedding for the master server.
+
+The master forks one child per client session, so limits that span
+sessions live in one shared memory block mapped before the first fork,
+guarded by a process-shared (robust) mutex:
+
+	-S sessions	concurrent client sessions; the parent answers BUSY
+			and closes the connection when all are taken
+	-F inflight	chain steps dispatched to microservers at the same
+			time across all sessions; further steps wait
+	-Q queue	steps allowed to wait per service (transform code);
+			a step that finds its service's queue full makes the
+			whole request fail fast with BUSY
+	-r rate -b burst
+			token bucket per client IP address: requests per
+			second and bucket size; an empty bucket means BUSY
+
+0 means no limit. With no -F/-Q/-r the hot path takes no lock at all.
+
+Scheduling: each request has a priority class (0 interactive, 1 normal,
+2 bulk) and optionally a deadline. When a slot frees up, the waiting
+step with the best class gets it, earliest deadline first within the
+class, arrival order after that (admission_pick()). A step arriving
+at a full service queue displaces the worst waiter of that queue if it
+is more urgent, so bulk work cannot keep interactive work out. A step
+whose deadline passes while it waits is dropped before it reaches a
+microserver.
+*/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/* Manifest constants */
+#define ADMISSION_MAX_SESSIONS 1024		/* size of the session table, also the default -S */
+#define ADMISSION_BUCKETS 1024			/* client token buckets, power of two */
+#define ADMISSION_SERVICES 10			/* indexed by transform code '0'..'9' */
+#define BUSY_MESSAGE "BUSY\n"			/* answer instead of a result when shedding load */
+#define EXPIRED_MESSAGE "EXPIRED\n"		/* answer when the request's deadline passed before it ran */
+
+/* Priority classes; lower runs first */
+#define PRIO_INTERACTIVE 0
+#define PRIO_NORMAL 1					/* option 2 requests, which carry no class */
+#define PRIO_BULK 2
+
+/* admission_acquire() results */
+#define ADMIT_OK 0
+#define ADMIT_BUSY -1
+#define ADMIT_EXPIRED -2
+
+/* One client session (forked child) as seen by the admission state */
+struct admission_session
+{
+	pid_t pid;							//0: free slot
+	int holding;						//has a step in flight
+	int waiting;						//is waiting for an in-flight slot
+	int service;						//transform code it waits for
+	int priority;						//class of the waiting request
+	uint64_t deadline;					//absolute, CLOCK_MONOTONIC ns; 0: none
+	uint64_t seq;						//arrival order while waiting
+	int shed;							//displaced from a full queue by a more urgent step
+};
+
+/* Token bucket of one client address */
+struct admission_bucket
+{
+	uint32_t ip;						//network order, 0: free
+	double tokens;
+	uint64_t last_ns;					//last refill
+};
+
+struct admission
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;				//broadcast whenever a slot frees up
+
+	/* limits */
+	int max_sessions, max_inflight, max_queue;
+	double rate, burst;
+
+	/* current state */
+	int sessions;
+	int inflight;
+	int nwaiting;						//sum of queued[]
+	int queued[ADMISSION_SERVICES];
+	uint64_t seq;
+
+	/* counters */
+	uint64_t admitted, rejected_sessions, rejected_queue, rejected_rate, expired;
+
+	struct admission_session slot[ADMISSION_MAX_SESSIONS];
+	struct admission_bucket bucket[ADMISSION_BUCKETS];
+};
+
+static struct admission *adm;		//shared by the parent and every session child
+static int adm_slot = -1;			//this session's slot in adm->slot[]
+
+static inline uint64_t admission_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Lock the shared state; a session that died holding the lock leaves it consistent enough to continue */
+static inline void admission_lock(void)
+{
+	if (pthread_mutex_lock(&adm->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&adm->lock);
+}
+
+static inline void admission_unlock(void)
+{
+	pthread_mutex_unlock(&adm->lock);
+}
+
+/* Map and initialize the shared state; call once in the parent before forking */
+static inline int admission_init(int max_sessions, int max_inflight, int max_queue, double rate, double burst)
+{
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+
+	adm = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (adm == MAP_FAILED)
+	{
+		adm = NULL;
+		return -1;
+	}
+	memset(adm, 0, sizeof(*adm));
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&adm->lock, &ma);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&adm->cond, &ca);
+
+	if (max_sessions <= 0 || max_sessions > ADMISSION_MAX_SESSIONS)
+		max_sessions = ADMISSION_MAX_SESSIONS;
+	adm->max_sessions = max_sessions;
+	adm->max_inflight = max_inflight;
+	adm->max_queue = max_queue;
+	adm->rate = rate;
+	adm->burst = burst > 0 ? burst : (rate > 0 ? rate : 1);
+	return 0;
+}
+
+/* Parent: reserve a session slot before forking; -1 means the session cap is reached */
+static inline int admission_session_start(void)
+{
+	int i, found = -1;
+
+	admission_lock();
+	if (adm->sessions < adm->max_sessions)
+		for (i = 0; i < ADMISSION_MAX_SESSIONS; i++)
+			if (adm->slot[i].pid == 0)
+			{
+				memset(&adm->slot[i], 0, sizeof(adm->slot[i]));
+				adm->slot[i].pid = -1;		//taken; the real pid is set after fork
+				adm->sessions++;
+				found = i;
+				break;
+			}
+	if (found == -1)
+		adm->rejected_sessions++;
+	admission_unlock();
+	return found;
+}
+
+static inline void admission_session_pid(int slot, pid_t pid)
+{
+	admission_lock();
+	adm->slot[slot].pid = pid;
+	admission_unlock();
+}
+
+/* Parent: a session child was reaped; give back its slot and anything it held */
+static inline void admission_session_end(pid_t pid)
+{
+	int i;
+
+	admission_lock();
+	for (i = 0; i < ADMISSION_MAX_SESSIONS; i++)
+		if (adm->slot[i].pid == pid)
+		{
+			if (adm->slot[i].holding)
+				adm->inflight--;
+			if (adm->slot[i].waiting && !adm->slot[i].shed)
+			{
+				adm->queued[adm->slot[i].service]--;
+				adm->nwaiting--;
+			}
+			adm->slot[i].pid = 0;
+			adm->sessions--;
+			pthread_cond_broadcast(&adm->cond);
+			break;
+		}
+	admission_unlock();
+}
+
+/* Session: take one token from the client's bucket; -1 means rate limited */
+static inline int admission_take_token(uint32_t ip)
+{
+	uint32_t h = (ip * 2654435761u) & (ADMISSION_BUCKETS - 1);
+	struct admission_bucket *b = NULL;
+	uint64_t now = admission_now();
+	int i, ok;
+
+	if (adm == NULL || adm->rate <= 0)
+		return 0;
+
+	admission_lock();
+	/* open addressing, never emptied again, so the probe ends at the first free bucket;
+	a bucket idle long enough to be full again can be reused for another address */
+	for (i = 0; i < ADMISSION_BUCKETS; i++)
+	{
+		struct admission_bucket *c = &adm->bucket[(h + i) & (ADMISSION_BUCKETS - 1)];
+		if (c->ip == ip)
+		{
+			b = c;
+			break;
+		}
+		if (c->ip == 0)
+		{
+			if (b == NULL)
+				b = c;
+			break;
+		}
+		if (b == NULL && (now - c->last_ns) / 1e9 * adm->rate >= adm->burst)
+			b = c;
+	}
+	if (b != NULL && b->ip != ip)
+	{
+		b->ip = ip;
+		b->tokens = adm->burst;
+		b->last_ns = now;
+	}
+	if (b == NULL)
+		ok = 1;						//table full of active clients; don't punish the new one
+	else
+	{
+		b->tokens += (now - b->last_ns) / 1e9 * adm->rate;
+		if (b->tokens > adm->burst)
+			b->tokens = adm->burst;
+		b->last_ns = now;
+		ok = b->tokens >= 1;
+		if (ok)
+			b->tokens -= 1;
+	}
+	if (!ok)
+		adm->rejected_rate++;
+	admission_unlock();
+	return ok ? 0 : -1;
+}
+
+/* Is waiter a more urgent than waiter b: class, then earliest deadline, then arrival */
+static inline int admission_before(const struct admission_session *a, const struct admission_session *b)
+{
+	uint64_t da = a->deadline ? a->deadline : UINT64_MAX;
+	uint64_t db = b->deadline ? b->deadline : UINT64_MAX;
+
+	if (a->priority != b->priority)
+		return a->priority < b->priority;
+	if (da != db)
+		return da < db;
+	return a->seq < b->seq;
+}
+
+/* The waiting session that gets the next free in-flight slot (service < 0: any service),
+or the least urgent one of a service when worst is set */
+static inline int admission_pick_in(int service, int worst)
+{
+	int i, pick = -1;
+
+	if (adm->nwaiting == 0)
+		return -1;
+	for (i = 0; i < ADMISSION_MAX_SESSIONS; i++)
+	{
+		struct admission_session *w = &adm->slot[i];
+		if (w->pid == 0 || !w->waiting || w->shed || (service >= 0 && w->service != service))
+			continue;
+		if (pick == -1 || (worst ? admission_before(&adm->slot[pick], w) : admission_before(w, &adm->slot[pick])))
+			pick = i;
+	}
+	return pick;
+}
+
+static inline int admission_pick(void)
+{
+	return admission_pick_in(-1, 0);
+}
+
+/* Leave the wait queue (lock held) */
+static inline void admission_dequeue(struct admission_session *me)
+{
+	me->waiting = 0;
+	me->shed = 0;
+	adm->queued[me->service]--;
+	adm->nwaiting--;
+}
+
+/* Session: get an in-flight slot for one chain step on a service.
+priority is the request's class, deadline its absolute deadline (0: none).
+Returns ADMIT_OK when the step may be dispatched, ADMIT_BUSY when it was
+shed from a full queue (answer BUSY), ADMIT_EXPIRED when the deadline
+passed while waiting (answer EXPIRED; nothing reached a microserver). */
+static inline int admission_acquire(int service, int priority, uint64_t deadline)
+{
+	struct admission_session *me;
+	struct timespec until;
+	int victim, rc;
+
+	if (adm == NULL || adm_slot < 0 || adm->max_inflight <= 0)
+		return ADMIT_OK;
+	me = &adm->slot[adm_slot];
+
+	admission_lock();
+	if (adm->inflight < adm->max_inflight && admission_pick() == -1)
+	{
+		adm->inflight++;
+		me->holding = 1;
+		adm->admitted++;
+		admission_unlock();
+		return ADMIT_OK;
+	}
+
+	me->service = service;
+	me->priority = priority;
+	me->deadline = deadline;
+	me->seq = adm->seq++;
+	me->shed = 0;
+	if (adm->max_queue > 0 && adm->queued[service] >= adm->max_queue)
+	{
+		/* full queue: the least urgent waiter makes room for us, or we are shed ourselves */
+		victim = admission_pick_in(service, 1);
+		if (victim == -1 || !admission_before(me, &adm->slot[victim]))
+		{
+			adm->rejected_queue++;
+			admission_unlock();
+			return ADMIT_BUSY;
+		}
+		adm->slot[victim].shed = 1;
+		adm->queued[service]--;			//its place is ours now
+		adm->nwaiting--;
+		adm->rejected_queue++;
+		pthread_cond_broadcast(&adm->cond);
+	}
+
+	/* wait in the service's queue until it is our turn and a slot is free */
+	me->waiting = 1;
+	adm->queued[service]++;
+	adm->nwaiting++;
+	if (deadline)
+	{
+		until.tv_sec = deadline / 1000000000ULL;
+		until.tv_nsec = deadline % 1000000000ULL;
+	}
+	while (!me->shed && !(adm->inflight < adm->max_inflight && admission_pick() == adm_slot))
+	{
+		if (deadline && admission_now() >= deadline)
+		{
+			admission_dequeue(me);
+			adm->expired++;
+			pthread_cond_broadcast(&adm->cond);		//our turn may have been someone's
+			admission_unlock();
+			return ADMIT_EXPIRED;
+		}
+		rc = deadline ? pthread_cond_timedwait(&adm->cond, &adm->lock, &until)
+					  : pthread_cond_wait(&adm->cond, &adm->lock);
+		if (rc == EOWNERDEAD)
+			pthread_mutex_consistent(&adm->lock);
+	}
+	if (me->shed)
+	{
+		/* the displacing step already took over our place in the counts */
+		me->waiting = 0;
+		me->shed = 0;
+		admission_unlock();
+		return ADMIT_BUSY;
+	}
+	admission_dequeue(me);
+	adm->inflight++;
+	me->holding = 1;
+	adm->admitted++;
+	/* more slots may be free for the next waiter */
+	pthread_cond_broadcast(&adm->cond);
+	admission_unlock();
+	return ADMIT_OK;
+}
+
+/* Session: the step's answer is back */
+static inline void admission_release(void)
+{
+	if (adm == NULL || adm_slot < 0 || adm->max_inflight <= 0 || !adm->slot[adm_slot].holding)
+		return;
+	admission_lock();
+	adm->slot[adm_slot].holding = 0;
+	adm->inflight--;
+	pthread_cond_broadcast(&adm->cond);
+	admission_unlock();
+}
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,169 @@
+/*
+Asynchronous client.
+Sends every line of its input through one chain with the client library
+(transformclient.h) and prints the results in input order: an example of
+the library's API, and a load generator for the master at the same time.
+
+The lines are submitted from one or more threads without waiting for any
+answer; the library spreads them over its pool of connections and sends
+what queues up for the chain as batches. When everything is answered the
+tool prints the rate and what the pool did to stderr.
+
+Usage:
+	./asyncclient.out [-p tcpport] [-a host] [-c connections] [-b batchmax] [-l linger_us]
+			[-t threads] [-n repeat] [-q] chain < file
+		-p tcpport		port of the master (default 8080)
+		-a host			host of the master (default 127.0.0.1)
+		-c connections	pool size (default 4)
+		-b batchmax		documents per batch; 1 sends every line on its own (default 64)
+		-l linger_us	a lone line waits this long for others to batch with (default 0)
+		-t threads		submitting threads (default 1)
+		-n repeat		send the whole input this many times (default 1)
+		-q				print only the summary
+*/
+
+/* Include files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "transformclient.h"
+
+/* Manifest constants */
+#define MAX_LINES 1000000
+
+/* One input line and its answer */
+struct line
+{
+	char text[TC_FRAME];
+	char result[TC_FRAME];
+	int status;
+};
+
+struct line *lines;
+long nlines, total;
+int nthreads = 1;
+char *chain;
+struct tc_pool *pool;
+
+/* Callback: keep the answer next to its line */
+void done(void *arg, int status, const char *result)
+{
+	struct line *l = arg;
+
+	l->status = status;
+	strcpy(l->result, result);
+}
+
+/* Submitter thread k: lines k, k + nthreads, ... of every repetition */
+void *submit(void *arg)
+{
+	long k = (long)arg, i;
+
+	for (i = k; i < total; i += nthreads)
+		while (tc_transform(pool, lines[i % nlines].text, chain, PRIO_NORMAL, 0, done, &lines[i % nlines]) == -1)
+		{
+			if (errno != EAGAIN)
+			{
+				fprintf(stderr, "asyncclient: line %ld cannot be sent\n", i % nlines + 1);
+				break;
+			}
+			usleep(100);		//queue full: let the pool catch up
+		}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tc_options o = {0};
+	struct tc_stats st;
+	struct timespec t0, t1;
+	pthread_t threads[64];
+	char *host = "127.0.0.1", buf[4096];
+	int opt, port = 8080, repeat = 1, quiet = 0, count[TC_ERROR + 1] = {0};
+	long i;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "p:a:c:b:l:t:n:q")) != -1)
+	{
+		if (opt == 'p')
+			port = atoi(optarg);
+		else if (opt == 'a')
+			host = optarg;
+		else if (opt == 'c')
+			o.connections = atoi(optarg);
+		else if (opt == 'b')
+			o.batchmax = atoi(optarg);
+		else if (opt == 'l')
+			o.linger_us = atoi(optarg);
+		else if (opt == 't')
+			nthreads = atoi(optarg);
+		else if (opt == 'n')
+			repeat = atoi(optarg);
+		else if (opt == 'q')
+			quiet = 1;
+		else
+			optind = argc + 1;
+	}
+	if (optind != argc - 1 || nthreads < 1 || nthreads > 64 || repeat < 1)
+	{
+		fprintf(stderr, "usage: %s [-p tcpport] [-a host] [-c connections] [-b batchmax] [-l linger_us]\n"
+						"\t[-t threads] [-n repeat] [-q] chain < file\n", argv[0]);
+		exit(1);
+	}
+	chain = argv[optind];
+
+	/* the input, one sentence per line */
+	if ((lines = calloc(MAX_LINES, sizeof(struct line))) == NULL)
+		exit(1);
+	while (nlines < MAX_LINES && fgets(buf, sizeof(buf), stdin) != NULL)
+	{
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (strlen(buf) > TC_MAX_TEXT)
+		{
+			fprintf(stderr, "asyncclient: line %ld is longer than %d bytes, cut\n", nlines + 1, TC_MAX_TEXT);
+			buf[TC_MAX_TEXT] = '\0';
+		}
+		strcpy(lines[nlines++].text, buf);
+	}
+	if (nlines == 0)
+		exit(0);
+	total = nlines * repeat;
+
+	if ((pool = tc_open(host, port, &o)) == NULL)
+	{
+		fprintf(stderr, "asyncclient: cannot reach %s port %d\n", host, port);
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, submit, (void *)i);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	tc_flush(pool);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	tc_get_stats(pool, &st);
+	tc_close(pool);
+
+	for (i = 0; i < nlines; i++)
+	{
+		count[lines[i].status]++;
+		if (quiet)
+			continue;
+		if (lines[i].status == TC_OK)
+			printf("%s\n", lines[i].result);
+		else
+			printf("%s\n", lines[i].status == TC_BUSY ? "BUSY" : lines[i].status == TC_EXPIRED ? "EXPIRED" : "ERROR");
+	}
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "%ld requests in %.3f s (%.0f/s): %llu exchanges, %llu requests batched, %llu connects, "
+					"%llu retried, %llu failed\n", total, secs, total / secs, (unsigned long long)st.exchanges,
+			(unsigned long long)st.batched, (unsigned long long)st.connects, (unsigned long long)st.retried,
+			(unsigned long long)st.failed);
+	if (count[TC_BUSY] + count[TC_EXPIRED] + count[TC_ERROR] > 0)
+		fprintf(stderr, "last answers: %d ok, %d busy, %d expired, %d error\n", count[TC_OK], count[TC_BUSY],
+				count[TC_EXPIRED], count[TC_ERROR]);
+	free(lines);
+	return 0;
+}
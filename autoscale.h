@@ -0,0 +1,502 @@
+/*
+Elastic pools of microserver replicas (mainserver -A code=min:max[:latency_us[:depth]]).
+
+Forking a microserver for every step costs a fork, an execvp and the
+master's sleep(1), and a fixed -s microserver cannot follow the load. For
+a code given with -A the master keeps a pool of long-running replicas of
+its microserver and resizes it between min and max as the load moves:
+
+	zygote		one per code: the microserver executable, started once
+			and initialized, that forks replicas on request
+			(see zygote.h); a replica is serving microseconds
+			after it is asked for
+	controller	one process forked by the master before the first
+			session. Every AUTOSCALE_TICK_NS it looks at each pool:
+			the steps in the system (by Little's law, the time steps
+			spent from arrival, admission wait included, to answer,
+			per unit of time), their mean latency and whether any
+			were shed, smoothed over a few ticks. Past depth steps
+			per replica (default 1), past the latency target, or
+			when steps were shed, it grows the pool to what the
+			load needs in one go. When one replica less would still
+			run under half of depth steps each (and under half the
+			latency target) for AUTOSCALE_DOWN_NS, it retires one
+	sessions	send each step to the replica with the fewest steps
+			outstanding, from the pool table in shared memory
+			(mapped before any fork, like admission.h), and add the
+			step's time to the pool's counters with atomic adds;
+			no lock on the path
+
+A retired replica leaves the table first and is killed AUTOSCALE_DRAIN_NS
+later, so the steps already sent to it are answered. A replica or zygote
+that dies is replaced, the pool never stays under min. The controller and
+everything below it end with the master (PR_SET_PDEATHSIG). Every change
+of a pool's size is logged (EV_SCALE).
+
+-s code=port and the node ring (-N) take precedence over a pool; a code
+with a pool does not run in-process.
+
+Usage:
+	autoscale_parse(spec, maxcode);				//-A; 0 or -1
+	autoscale_start(names, logfile);			//parent, before the first session; 0 or -1
+	t = autoscale_now();						//session: a step of code arrives
+	if ((r = autoscale_pick(code, &to, &gen)) != -1) { send; autoscale_done(code, r, gen, t); }
+	autoscale_shed(code, t);					//or: admission refused it
+*/
+
+#ifndef AUTOSCALE_H
+#define AUTOSCALE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "binlog.h"
+#include "zygote.h"
+
+/* Manifest constants */
+#define AUTOSCALE_CODES 10					/* indexed by transform code '0'..'9' */
+#define AUTOSCALE_MAX_REPLICAS 64			/* per pool, upper bound of max */
+#define AUTOSCALE_DEFAULT_DEPTH 1.0			/* steps in the system per replica before growing */
+#define AUTOSCALE_TICK_NS 100000000ULL		/* the controller measures and decides this often */
+#define AUTOSCALE_SMOOTHING 0.3				/* weight of the newest tick in the averages */
+#define AUTOSCALE_DOWN_NS 5000000000ULL		/* load must stay low this long before a retirement */
+#define AUTOSCALE_DRAIN_NS 2000000000ULL		/* retired replica: no new steps, killed after this */
+#define AUTOSCALE_RESTART_NS 1000000000ULL	/* a zygote that died is started again after this */
+#define AUTOSCALE_START_NS 5000000000ULL		/* the master waits this long for the min replicas */
+
+/* Replica slot states */
+#define REPLICA_FREE 0
+#define REPLICA_ACTIVE 1					//gets new steps
+#define REPLICA_DRAINING 2					//retired: answers what it has, then killed
+
+struct autoscale_replica
+{
+	int state;
+	int port;
+	pid_t pid;
+	int outstanding;						//steps sent and not yet answered
+	uint32_t gen;							//bumped each time the slot takes a new replica
+	uint64_t steps;							//answered
+	uint64_t retire_ns;						//draining: when it is killed
+};
+
+struct autoscale_pool
+{
+	int on;
+	int min, max;
+	double depth;							//steps in the system per replica
+	uint64_t latency_ns;					//mean step latency target, 0: none
+	int nactive;
+
+	/* added to by the sessions */
+	uint64_t busy_ns;						//arrival to answer (or refusal), all steps
+	uint64_t steps, shed;
+
+	struct autoscale_replica replica[AUTOSCALE_MAX_REPLICAS];
+};
+
+struct autoscale
+{
+	uint64_t spawned, retired, lost;
+	struct autoscale_pool pool[AUTOSCALE_CODES];
+};
+
+static struct autoscale *asc;				//shared by the parent, the controller and every session; NULL: off
+
+/* Controller's own view of a pool */
+struct autoscale_ctl
+{
+	const char *path;						//microserver executable
+	const char *logfile;					//its -g
+	int fd;									//socketpair to the zygote, -1: none
+	pid_t zygote;
+	uint64_t restart_ns;					//start the zygote again at this time
+	int pending;							//spawns asked for and not answered
+	uint64_t busy_ns, steps, shed, last_ns;	//counters at the last tick
+	double load, latency;					//smoothed steps in the system, mean step ns
+	uint64_t low_since;						//load low since, 0: it is not
+};
+
+static inline uint64_t autoscale_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* "3=1:8:2000:2": pool of 1 to 8 replicas for code 3, 2 ms latency target,
+2 steps per replica; 0 or -1 (a bad spec, or no room for the table) */
+static inline int autoscale_parse(const char *spec, int maxcode)
+{
+	struct autoscale_pool *p;
+	int code, min, max, n;
+	long latency_us = 0;
+	double depth = AUTOSCALE_DEFAULT_DEPTH;
+
+	if (spec[0] < '1' || spec[0] > '0' + maxcode || spec[0] > '0' + AUTOSCALE_CODES - 1 || spec[1] != '=')
+		return -1;
+	code = spec[0] - '0';
+	n = sscanf(spec + 2, "%d:%d:%ld:%lf", &min, &max, &latency_us, &depth);
+	if (n < 2 || min < 1 || max < min || max > AUTOSCALE_MAX_REPLICAS || latency_us < 0 || depth <= 0)
+		return -1;
+	if (asc == NULL)
+	{
+		asc = mmap(NULL, sizeof(struct autoscale), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (asc == MAP_FAILED)
+		{
+			asc = NULL;
+			return -1;
+		}
+		memset(asc, 0, sizeof(*asc));
+	}
+	p = &asc->pool[code];
+	p->min = min;
+	p->max = max;
+	p->latency_ns = latency_us * 1000ULL;
+	p->depth = depth;
+	p->on = 1;
+	return 0;
+}
+
+/* Does a pool serve code? */
+static inline int autoscale_serves(int code)
+{
+	return asc != NULL && asc->pool[code].on;
+}
+
+/* Session: the replica for a step of code, with the fewest steps outstanding; sets
+to's port and *gen to the slot's generation, and counts the step on it. Returns the
+replica, or -1 (no pool, none up) */
+static inline int autoscale_pick(int code, struct sockaddr_in *to, uint32_t *gen)
+{
+	static unsigned rotate;					//spreads ties over the replicas
+	struct autoscale_pool *p;
+	int i, k, best = -1, load, bestload = 0;
+
+	if (!autoscale_serves(code))
+		return -1;
+	p = &asc->pool[code];
+	rotate++;
+	for (k = 0; k < AUTOSCALE_MAX_REPLICAS; k++)
+	{
+		i = (k + rotate) % AUTOSCALE_MAX_REPLICAS;
+		if (__atomic_load_n(&p->replica[i].state, __ATOMIC_ACQUIRE) != REPLICA_ACTIVE)
+			continue;
+		load = __atomic_load_n(&p->replica[i].outstanding, __ATOMIC_RELAXED);
+		if (best == -1 || load < bestload)
+		{
+			best = i;
+			bestload = load;
+		}
+	}
+	if (best == -1)
+		return -1;
+	*gen = __atomic_load_n(&p->replica[best].gen, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&p->replica[best].outstanding, 1, __ATOMIC_RELAXED);
+	to->sin_port = htons(p->replica[best].port);
+	return best;
+}
+
+/* Session: the step of code that arrived at arrival_ns was answered by replica r, picked
+in generation gen. A replica lost or retired since then gave its slot up, and the count
+started over with the next one, so only the same generation takes the step off. */
+static inline void autoscale_done(int code, int r, uint32_t gen, uint64_t arrival_ns)
+{
+	struct autoscale_pool *p = &asc->pool[code];
+
+	if (__atomic_load_n(&p->replica[r].gen, __ATOMIC_ACQUIRE) == gen)
+	{
+		__atomic_sub_fetch(&p->replica[r].outstanding, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&p->replica[r].steps, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&p->busy_ns, autoscale_now() - arrival_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->steps, 1, __ATOMIC_RELAXED);
+}
+
+/* Session: admission refused the step (queue full, or its deadline passed waiting) */
+static inline void autoscale_shed(int code, uint64_t arrival_ns)
+{
+	struct autoscale_pool *p;
+
+	if (!autoscale_serves(code))
+		return;
+	p = &asc->pool[code];
+	__atomic_add_fetch(&p->busy_ns, autoscale_now() - arrival_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->shed, 1, __ATOMIC_RELAXED);
+}
+
+/* Controller: log a change of pool code's size */
+static inline void autoscale_log(int code, struct autoscale_ctl *c, int replicas, const char *why)
+{
+	char text[BINLOG_STRLEN + 1];
+
+	snprintf(text, sizeof(text), "%s", why);
+	BLOG(BL_INFO, EV_SCALE, code, replicas, (uint64_t)(c->load * 1000) << 32 | (uint32_t)(c->latency / 1000), text);
+}
+
+/* Controller: start (again) the zygote of code */
+static inline void autoscale_zygote(int code, struct autoscale_ctl *c, uint64_t now)
+{
+	if ((c->fd = zygote_start(c->path, c->logfile, &c->zygote)) == -1)
+	{
+		fprintf(stderr, "autoscale: cannot start the zygote of code %d\n", code);
+		c->restart_ns = now + AUTOSCALE_RESTART_NS;
+	}
+	c->pending = 0;
+}
+
+/* Controller: the zygote of code ended; its replicas end with it */
+static inline void autoscale_zygote_lost(int code, struct autoscale_ctl *c, uint64_t now)
+{
+	struct autoscale_pool *p = &asc->pool[code];
+	int i;
+
+	for (i = 0; i < AUTOSCALE_MAX_REPLICAS; i++)
+		__atomic_store_n(&p->replica[i].state, REPLICA_FREE, __ATOMIC_RELEASE);
+	p->nactive = 0;
+	close(c->fd);
+	c->fd = -1;
+	c->zygote = 0;
+	c->pending = 0;
+	c->restart_ns = now + AUTOSCALE_RESTART_NS;
+	asc->lost++;
+	autoscale_log(code, c, 0, "zygote lost");
+}
+
+/* Controller: a message from the zygote of code */
+static inline void autoscale_message(int code, struct autoscale_ctl *c, const struct zygote_msg *m)
+{
+	struct autoscale_pool *p = &asc->pool[code];
+	struct autoscale_replica *r;
+	int i;
+
+	if (m->op == ZYGOTE_SPAWNED)
+	{
+		c->pending -= c->pending > 0;
+		if (m->pid <= 0)
+			return;
+		for (i = 0; i < AUTOSCALE_MAX_REPLICAS && p->replica[i].state != REPLICA_FREE; i++)
+			;
+		if (i == AUTOSCALE_MAX_REPLICAS)
+		{
+			zygote_send(c->fd, ZYGOTE_RETIRE, m->pid, 0);
+			return;
+		}
+		r = &p->replica[i];
+		r->port = m->port;
+		r->pid = m->pid;
+		__atomic_add_fetch(&r->gen, 1, __ATOMIC_RELEASE);	//late answers of the last replica count no more
+		r->outstanding = 0;
+		r->steps = 0;
+		__atomic_store_n(&r->state, REPLICA_ACTIVE, __ATOMIC_RELEASE);
+		p->nactive++;
+		asc->spawned++;
+	}
+	else if (m->op == ZYGOTE_EXITED)
+		for (i = 0; i < AUTOSCALE_MAX_REPLICAS; i++)
+		{
+			r = &p->replica[i];
+			if (r->state == REPLICA_FREE || r->pid != m->pid)
+				continue;
+			if (r->state == REPLICA_ACTIVE)
+			{
+				p->nactive--;
+				asc->lost++;
+				autoscale_log(code, c, p->nactive, "replica lost");
+			}
+			__atomic_store_n(&r->state, REPLICA_FREE, __ATOMIC_RELEASE);
+		}
+}
+
+/* Controller: measure pool code and resize it */
+static inline void autoscale_tick(int code, struct autoscale_ctl *c, uint64_t now)
+{
+	struct autoscale_pool *p = &asc->pool[code];
+	struct autoscale_replica *r;
+	uint64_t busy = __atomic_load_n(&p->busy_ns, __ATOMIC_RELAXED);
+	uint64_t steps = __atomic_load_n(&p->steps, __ATOMIC_RELAXED) + __atomic_load_n(&p->shed, __ATOMIC_RELAXED);
+	uint64_t shed = __atomic_load_n(&p->shed, __ATOMIC_RELAXED);
+	int n = p->nactive + c->pending, want, i;
+	const char *why = "load";
+
+	/* Little's law: time in the system per unit of time is the number in the system */
+	c->load += AUTOSCALE_SMOOTHING * ((double)(busy - c->busy_ns) / (now - c->last_ns) - c->load);
+	if (steps > c->steps)
+		c->latency += AUTOSCALE_SMOOTHING * ((double)(busy - c->busy_ns) / (steps - c->steps) - c->latency);
+	else
+		c->latency -= AUTOSCALE_SMOOTHING * c->latency;		//idle: nothing is slow
+	want = (int)(c->load / p->depth + 0.99);		//rounded up, but not for a trace of load
+	if (want <= n && p->latency_ns && c->latency > p->latency_ns)
+	{
+		want = n + 1;
+		why = "latency";
+	}
+	if (want <= n && shed > c->shed)
+	{
+		want = n + 1;
+		why = "shed";
+	}
+	if (want < p->min)
+	{
+		want = p->min;
+		why = "min";
+	}
+	if (want > p->max)
+		want = p->max;
+	c->busy_ns = busy;
+	c->steps = steps;
+	c->shed = shed;
+	c->last_ns = now;
+
+	if (want > n && c->fd != -1)
+	{
+		/* grow to what the load needs at once */
+		autoscale_log(code, c, want, why);
+		for (; n < want; n++)
+			if (zygote_send(c->fd, ZYGOTE_SPAWN, 0, 0) == 0)
+				c->pending++;
+		c->low_since = 0;
+	}
+	else if (c->pending == 0 && n > p->min && c->load / (n - 1) < p->depth / 2 &&
+			 (!p->latency_ns || c->latency < p->latency_ns / 2))
+	{
+		/* shrink by one, and only after the load stayed low for a while */
+		if (c->low_since == 0)
+			c->low_since = now;
+		else if (now - c->low_since >= AUTOSCALE_DOWN_NS)
+		{
+			for (i = AUTOSCALE_MAX_REPLICAS - 1; i >= 0 && p->replica[i].state != REPLICA_ACTIVE; i--)
+				;
+			if (i >= 0)
+			{
+				p->replica[i].retire_ns = now + AUTOSCALE_DRAIN_NS;
+				__atomic_store_n(&p->replica[i].state, REPLICA_DRAINING, __ATOMIC_RELEASE);
+				p->nactive--;
+				asc->retired++;
+				autoscale_log(code, c, p->nactive, "idle");
+			}
+			c->low_since = now;
+		}
+	}
+	else
+		c->low_since = 0;
+
+	/* drained: nothing can be on its way to it any more */
+	for (i = 0; i < AUTOSCALE_MAX_REPLICAS; i++)
+	{
+		r = &p->replica[i];
+		if (r->state == REPLICA_DRAINING && now >= r->retire_ns)
+		{
+			if (c->fd != -1)
+				zygote_send(c->fd, ZYGOTE_RETIRE, r->pid, 0);
+			__atomic_store_n(&r->state, REPLICA_FREE, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/* Controller process: zygotes up, then measure, resize and follow the zygotes forever */
+static inline void autoscale_controller(char *names[], const char *logfile)
+{
+	struct autoscale_ctl ctl[AUTOSCALE_CODES];
+	struct pollfd pfd[AUTOSCALE_CODES];
+	int pcode[AUTOSCALE_CODES];
+	struct zygote_msg m;
+	uint64_t now = autoscale_now(), next = now;
+	int code, i, n;
+
+	for (code = 0; code < AUTOSCALE_CODES; code++)
+	{
+		memset(&ctl[code], 0, sizeof(ctl[code]));
+		ctl[code].fd = -1;
+		ctl[code].last_ns = now;
+		if (asc->pool[code].on)
+		{
+			ctl[code].path = names[code];
+			ctl[code].logfile = logfile;
+			autoscale_zygote(code, &ctl[code], now);
+		}
+	}
+
+	for (;;)
+	{
+		now = autoscale_now();
+		for (code = 0; code < AUTOSCALE_CODES; code++)
+		{
+			if (!asc->pool[code].on)
+				continue;
+			if (ctl[code].zygote > 0 && waitpid(ctl[code].zygote, NULL, WNOHANG) == ctl[code].zygote)
+				autoscale_zygote_lost(code, &ctl[code], now);
+			if (ctl[code].fd == -1 && now >= ctl[code].restart_ns)
+				autoscale_zygote(code, &ctl[code], now);
+		}
+		if (now >= next)
+		{
+			for (code = 0; code < AUTOSCALE_CODES; code++)
+				if (asc->pool[code].on)
+					autoscale_tick(code, &ctl[code], now);
+			next += AUTOSCALE_TICK_NS;
+			if (next <= now)
+				next = now + AUTOSCALE_TICK_NS;
+		}
+
+		/* zygote messages until the next tick */
+		for (code = n = 0; code < AUTOSCALE_CODES; code++)
+			if (ctl[code].fd != -1)
+			{
+				pfd[n].fd = ctl[code].fd;
+				pfd[n].events = POLLIN;
+				pcode[n++] = code;
+			}
+		if (poll(pfd, n, (next - now) / 1000000 + 1) <= 0)
+			continue;
+		for (i = 0; i < n; i++)
+			if (pfd[i].revents & POLLIN)
+				while (recv(pfd[i].fd, &m, sizeof(m), MSG_DONTWAIT) == sizeof(m))
+					autoscale_message(pcode[i], &ctl[pcode[i]], &m);
+	}
+}
+
+/* Parent: fork the controller and wait (up to AUTOSCALE_START_NS) for every pool's
+min replicas; names[code] is the microserver executable of code, logfile their -g. 0 or -1 */
+static inline int autoscale_start(char *names[], const char *logfile)
+{
+	uint64_t until = autoscale_now() + AUTOSCALE_START_NS;
+	pid_t pid;
+	int code, ready;
+
+	if (asc == NULL)
+		return 0;
+	if ((pid = fork()) == -1)
+		return -1;
+	if (pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() == 1)
+			_exit(0);
+		autoscale_controller(names, logfile);
+		_exit(0);
+	}
+	do
+	{
+		for (code = 0, ready = 1; code < AUTOSCALE_CODES; code++)
+			if (asc->pool[code].on && __atomic_load_n(&asc->pool[code].nactive, __ATOMIC_ACQUIRE) < asc->pool[code].min)
+				ready = 0;
+		if (!ready)
+			usleep(1000);
+	} while (!ready && autoscale_now() < until);
+	if (!ready)
+		fprintf(stderr, "autoscale: not every pool is up yet, steps fork microservers until it is\n");
+	return 0;
+}
+
+#endif /* AUTOSCALE_H */
@@ -0,0 +1,128 @@
+/*
+Batch requests: many documents through one chain in one exchange.
+
+A batch is kept struct-of-arrays style: all documents back to back in
+one contiguous data buffer, plus an offsets array where document i is
+data[off[i], off[i+1]). The master runs each chain step over the whole
+buffer at once where the transform is a byte map (identity, upper,
+lower, caesar) and per document, by the offsets, where it is not
+(reverse, yours) or where a document begins on a UTF-8 continuation
+byte, which the kernels would read together with the end of the one
+before; see run_batch() in mainserver.c.
+
+On the wire (client option 4):
+	selection frame		"4 <ndocs> <databytes>" (or "4 <ndocs> <databytes> <priority> <deadline_ms>")
+	chain frame			the chain, as for option 2
+	payload				(ndocs + 1) offsets, uint32 in network byte order,
+						then the databytes bytes of the documents
+The answer is the line "BATCH <ndocs> <databytes>\n" followed by the
+results in the same layout, or one of the BUSY/EXPIRED/ERROR lines.
+Every document is at most BATCH_MAX_DOC bytes, like a sentence.
+
+Both arrays come from the pooled buffers of bufpool.h, so a session that
+keeps sending batches of about the same size reuses the same memory. The
+master does not even take a data array: batch_attach() runs the batch on
+the documents where they are in the received wire image, which then goes
+back out as the answer.
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "bufpool.h"
+
+/* Manifest constants */
+#define BATCH_MAX_DOCS 4096
+#define BATCH_MAX_DOC 99						/* bytes per document, as a sentence */
+#define BATCH_ERROR_MESSAGE "ERROR\n"			/* batch malformed, or a step changed a length */
+
+struct batch
+{
+	uint32_t n;									//documents
+	uint32_t *off;								//n + 1 offsets into data
+	char *data;									//off[n] bytes
+	int borrowed;								//data belongs to the caller (batch_attach)
+};
+
+/* Room for n documents of databytes bytes in total; 0 or -1 */
+static inline int batch_alloc(struct batch *b, uint32_t n, uint32_t databytes)
+{
+	b->n = n;
+	b->borrowed = 0;
+	b->off = bufpool_get((n + 1) * sizeof(uint32_t));
+	b->data = bufpool_get(databytes + 1);
+	if (b->off == NULL || b->data == NULL)
+	{
+		bufpool_put(b->off);
+		bufpool_put(b->data);
+		return -1;
+	}
+	memset(b->off, 0, (n + 1) * sizeof(uint32_t));
+	b->off[n] = databytes;
+	return 0;
+}
+
+/* A batch over databytes bytes of documents already at data (which must stay valid,
+with room for a null after them); only the offsets are allocated. 0 or -1 */
+static inline int batch_attach(struct batch *b, uint32_t n, uint32_t databytes, char *data)
+{
+	b->n = n;
+	b->borrowed = 1;
+	b->data = data;
+	if ((b->off = bufpool_get((n + 1) * sizeof(uint32_t))) == NULL)
+		return -1;
+	memset(b->off, 0, (n + 1) * sizeof(uint32_t));
+	b->off[n] = databytes;
+	return 0;
+}
+
+static inline void batch_free(struct batch *b)
+{
+	bufpool_put(b->off);
+	if (!b->borrowed)
+		bufpool_put(b->data);
+	b->off = NULL;
+	b->data = NULL;
+}
+
+/* Size of the payload of b on the wire */
+static inline size_t batch_wire_size(const struct batch *b)
+{
+	return (b->n + 1) * sizeof(uint32_t) + b->off[b->n];
+}
+
+/* Lay b out as its wire payload in out (batch_wire_size() bytes) */
+static inline void batch_pack(const struct batch *b, char *out)
+{
+	uint32_t i, v;
+
+	for (i = 0; i <= b->n; i++)
+	{
+		v = htonl(b->off[i]);
+		memcpy(out + i * sizeof(uint32_t), &v, sizeof(v));
+	}
+	memcpy(out + (b->n + 1) * sizeof(uint32_t), b->data, b->off[b->n]);
+}
+
+/* Take the offsets from a wire payload of a batch allocated for n documents and
+databytes bytes, and check them; the data follows them. Returns 0 or -1. */
+static inline int batch_unpack_offsets(struct batch *b, const char *in)
+{
+	uint32_t i, v, databytes = b->off[b->n];
+
+	for (i = 0; i <= b->n; i++)
+	{
+		memcpy(&v, in + i * sizeof(uint32_t), sizeof(v));
+		b->off[i] = ntohl(v);
+		if ((i == 0 && b->off[i] != 0) || (i > 0 && (b->off[i] < b->off[i - 1] || b->off[i] - b->off[i - 1] > BATCH_MAX_DOC)))
+			return -1;
+	}
+	return b->off[b->n] == databytes ? 0 : -1;
+}
+
+#endif /* BATCH_H */
@@ -0,0 +1,631 @@
+/*
+Benchmark harness.
+Starts the master server and all six microservers headless on the
+loopback interface, each on a free (ephemeral) port, drives scripted
+workloads through the same TCP protocol mainclient.c uses, and prints
+throughput and latency for every scenario in a summary table.
+Everything it started is torn down again before it exits.
+
+A scenario is: number of concurrent client sessions, chain length
+(number of transform steps per request), message size in bytes,
+and number of transform requests per session. Each session enters
+one sentence (option 1) and then times every transform (option 2)
+from sending the request until the answer line is back.
+Optionally the sessions send option 3 requests instead, with priority
+classes given round-robin (e.g. 0,2,2,2: one interactive session per
+three bulk ones) and a deadline; each class then gets its own row.
+
+Usage:
+	./bench.out [-d bindir] [-f scenariofile] [-m 'master options'] [-i] [-v]
+		-d bindir	directory with mainserver.out and the microservers (default .)
+		-f file		scenarios, one per line:
+				name sessions chainlength messagesize requests [classes [deadline_ms]]
+				(lines starting with # are comments); without -f a
+				built-in set of scenarios is run
+		-m options	extra options for mainserver.out, e.g. -m '-F 4 -Q 8'
+		-i		in-process: the master runs the transform plugins from
+				bindir/plugins (see plugin.h) instead of routing to the microservers
+		-v		leave the servers' output on the terminal
+
+Requests the master sheds with BUSY (admission control) or answers
+with EXPIRED (deadline passed) are counted in their own columns and
+left out of the latency percentiles.
+
+The master logs to bench.blog in the current directory. The allocs
+column adds up what the scenario's sessions report there when they end
+(EV_POOL): buffers the master had to take from the heap after each
+session's first request, which is 0 in an allocation-free steady state.
+*/
+
+/* Include files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "binlog.h"				//the sessions' EV_POOL records
+
+/* Manifest constants */
+#define MAX_MESSAGE_LENGTH 100		/* must match the master server's frames */
+#define SERVER_IP "127.0.0.1"		/* everything runs on loopback */
+#define NUM_TRANSFORMS 6
+#define MAX_SCENARIOS 64
+#define CHAIN_PATTERN "354261"		/* chain steps cycle through these codes */
+#define STARTUP_TIMEOUT_MS 5000
+#define BUSY_MESSAGE "BUSY\n"		/* must match the server's admission.h */
+#define LAT_FAILED -1				/* latencies[] markers for requests without a result */
+#define LAT_BUSY -2
+#define LAT_EXPIRED -3
+#define EXPIRED_MESSAGE "EXPIRED\n"	/* must match the server's admission.h */
+#define MAX_CLASSES 8
+#define MAX_MASTER_OPTIONS 32
+#define BENCH_LOG "bench.blog"		/* the master's log, -g */
+#define POOL_WAIT_MS 1000			/* how long ended sessions get to log EV_POOL */
+
+/* One scripted workload */
+struct scenario
+{
+	char name[32];
+	int sessions;			//concurrent client connections
+	int chainlen;			//transform steps per request
+	int msgsize;			//sentence length in bytes
+	int requests;			//transform requests per session
+	char classes[32];		//priority class per session, round-robin ("0,2"); empty: option 2
+	int deadline;			//ms, with classes; 0: none
+};
+
+/* Built-in scenarios, used when no -f file is given */
+static struct scenario defaults[] = {
+	{"single-step", 1, 1, 16, 2000, "", 0},
+	{"chain-4", 1, 4, 16, 1000, "", 0},
+	{"chain-4-99B", 1, 4, 99, 1000, "", 0},
+	{"4-sessions", 4, 4, 64, 500, "", 0},
+	{"16-sessions", 16, 4, 64, 200, "", 0},
+	{"mixed-prio", 16, 4, 64, 200, "0,2,2,2", 0},
+};
+
+/* microserver executables, indexed by transform code - 1 */
+static const char *microservers[NUM_TRANSFORMS] = {
+	"identity.out", "reverse.out", "upper.out", "lower.out", "caesar.out", "yours.out"
+};
+
+static const char *bindir = ".";
+static int verbose = 0;
+
+/* Monotonic clock in nanoseconds */
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Ask the kernel for a free loopback port of the given socket type */
+static int freeport(int type)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd, port;
+
+	if ((fd = socket(AF_INET, type, 0)) == -1)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = 0;				//0: kernel picks an ephemeral port
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || getsockname(fd, (struct sockaddr *)&sa, &len) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	port = ntohs(sa.sin_port);
+	close(fd);
+	return port;
+}
+
+/* fork+exec a server; its output goes to /dev/null unless -v */
+static pid_t launch(char *const args[])
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		if (!verbose)
+		{
+			int devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+			close(devnull);
+		}
+		execv(args[0], args);
+		fprintf(stderr, "bench: cannot run %s\n", args[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+/* Probe a looping microserver until it answers, so no request is sent before it is bound */
+static int wait_microserver(int port)
+{
+	struct sockaddr_in sa;
+	struct timeval tv = {0, 50000};
+	char probe[MAX_MESSAGE_LENGTH];
+	int fd, waited;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	inet_pton(AF_INET, SERVER_IP, &sa.sin_addr);
+
+	for (waited = 0; waited < STARTUP_TIMEOUT_MS; waited += 50)
+	{
+		sendto(fd, "x", 1, 0, (struct sockaddr *)&sa, sizeof(sa));
+		if (recv(fd, probe, sizeof(probe), 0) > 0)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+	close(fd);
+	return -1;
+}
+
+/* Connect a TCP client to the master; retries for a while when wait is set */
+static int connect_master(int port, int wait)
+{
+	struct sockaddr_in sa;
+	int fd, one = 1, waited = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	inet_pton(AF_INET, SERVER_IP, &sa.sin_addr);
+
+	for (;;)
+	{
+		if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			break;
+		close(fd);
+		if (!wait || waited >= STARTUP_TIMEOUT_MS)
+			return -1;
+		usleep(10000);
+		waited += 10;
+	}
+	/* request frames are small; don't let Nagle hold them back */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/* Send an option frame ("2", or "3 priority deadline") and its argument frame in one write.
+Both are fixed MAX_MESSAGE_LENGTH frames (zero padded), the same size
+the master reads them with, so back-to-back requests never run together. */
+static int send_request(int fd, const char *option, const char *arg)
+{
+	char frames[2 * MAX_MESSAGE_LENGTH];
+	size_t len = strlen(arg);
+
+	if (len > MAX_MESSAGE_LENGTH - 1)
+		len = MAX_MESSAGE_LENGTH - 1;
+	memset(frames, 0, sizeof(frames));
+	strncpy(frames, option, MAX_MESSAGE_LENGTH - 1);
+	memcpy(frames + MAX_MESSAGE_LENGTH, arg, len);
+	return send(fd, frames, sizeof(frames), 0) == sizeof(frames) ? 0 : -1;
+}
+
+/* Read one newline-terminated answer from the master */
+static int recv_answer(int fd, char *answer, int max)
+{
+	int got = 0, n;
+
+	while (got < max - 1)
+	{
+		if ((n = recv(fd, answer + got, max - 1 - got, 0)) <= 0)
+			return -1;
+		got += n;
+		if (answer[got - 1] == '\n')
+			break;
+	}
+	answer[got] = '\0';
+	return got;
+}
+
+/* Priority classes of a scenario; returns how many (0: plain option 2 requests) */
+static int scenario_classes(const struct scenario *sc, int *classes)
+{
+	const char *p = sc->classes;
+	int n = 0;
+
+	while (*p != '\0' && n < MAX_CLASSES)
+	{
+		classes[n++] = atoi(p);
+		while (*p != '\0' && *p != ',')
+			p++;
+		if (*p == ',')
+			p++;
+	}
+	return n;
+}
+
+/* One client session: enter a sentence, then time every transform request;
+latencies[] gets nanoseconds per request, LAT_FAILED, LAT_BUSY or LAT_EXPIRED otherwise */
+static void run_session(int port, struct scenario *sc, int priority, long long *latencies)
+{
+	char option[MAX_MESSAGE_LENGTH];
+	static const char words[] = "The quick brown fox jumps over the lazy dog ";
+	char sentence[MAX_MESSAGE_LENGTH];
+	char chain[MAX_MESSAGE_LENGTH];
+	char answer[MAX_MESSAGE_LENGTH + 1];
+	long long t0;
+	int fd, i;
+
+	for (i = 0; i < sc->msgsize; i++)
+		sentence[i] = words[i % (sizeof(words) - 1)];
+	sentence[sc->msgsize] = '\0';
+	for (i = 0; i < sc->chainlen; i++)
+		chain[i] = CHAIN_PATTERN[i % (sizeof(CHAIN_PATTERN) - 1)];
+	chain[sc->chainlen] = '\0';
+
+	if (priority < 0)
+		strcpy(option, "2");
+	else
+		snprintf(option, sizeof(option), "3 %d %d", priority, sc->deadline);
+
+	for (i = 0; i < sc->requests; i++)
+		latencies[i] = LAT_FAILED;
+	if ((fd = connect_master(port, 0)) == -1 || send_request(fd, "1", sentence) == -1)
+		return;
+
+	for (i = 0; i < sc->requests; i++)
+	{
+		t0 = now_ns();
+		if (send_request(fd, option, chain) == -1 || recv_answer(fd, answer, sizeof(answer)) == -1)
+		{
+			/* a session turned away at the door gets one BUSY and then the connection closes */
+			if (i > 0 && latencies[i - 1] == LAT_BUSY)
+				for (; i < sc->requests; i++)
+					latencies[i] = LAT_BUSY;
+			break;
+		}
+		if (strcmp(answer, BUSY_MESSAGE) == 0)
+			latencies[i] = LAT_BUSY;
+		else if (strcmp(answer, EXPIRED_MESSAGE) == 0)
+			latencies[i] = LAT_EXPIRED;
+		else
+			latencies[i] = now_ns() - t0;
+	}
+	close(fd);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Heap allocations after the first request, over the EV_POOL records the master's sessions
+log from position from on; waits for sessions of them. -1: none arrived */
+static long long pool_allocs(uint64_t from, int sessions)
+{
+	struct binlog_record copy;
+	const struct binlog_record *r;
+	long long allocs = -1;
+	uint64_t head;
+	int seen = 0, waited;
+
+	for (waited = 0; binlog != NULL; waited += 10)
+	{
+		head = __atomic_load_n(&binlog->hdr.head, __ATOMIC_ACQUIRE);
+		if (head - from > BINLOG_RECORDS)
+			from = head - BINLOG_RECORDS;
+		for (; from < head; from++)
+		{
+			r = &binlog->rec[from & (BINLOG_RECORDS - 1)];
+			if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != from + 1)
+			{
+				if (head - from < BINLOG_RECORDS / 2)
+					break;					//still being written, next pass
+				continue;
+			}
+			memcpy(&copy, r, sizeof(copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != from + 1 || copy.event != EV_POOL)
+				continue;
+			allocs = (allocs < 0 ? 0 : allocs) + copy.b;
+			seen++;
+		}
+		if (seen >= sessions || waited >= POOL_WAIT_MS)
+			break;
+		usleep(10000);
+	}
+	return allocs;
+}
+
+/* Print one table row for the sessions of one priority class (class -1: all sessions) */
+static void print_row(const char *name, struct scenario *sc, int nsessions, long long *latencies,
+					  int *sessionclass, int class, long long wall, long long allocs)
+{
+	long long *ok, sum = 0;
+	int i, s, total = 0, nok = 0, nbusy = 0, nexpired = 0;
+
+	ok = malloc((size_t)sc->sessions * sc->requests * sizeof(long long));
+	for (s = 0; s < sc->sessions; s++)
+	{
+		if (class >= 0 && sessionclass[s] != class)
+			continue;
+		for (i = 0; i < sc->requests; i++)
+		{
+			long long lat = latencies[(long)s * sc->requests + i];
+			total++;
+			/* keep only the successful requests for the percentiles */
+			if (lat >= 0)
+			{
+				ok[nok++] = lat;
+				sum += lat;
+			}
+			else if (lat == LAT_BUSY)
+				nbusy++;
+			else if (lat == LAT_EXPIRED)
+				nexpired++;
+		}
+	}
+	qsort(ok, nok, sizeof(long long), cmp_ll);
+
+	printf("%-16s %5d %5d %5d %8d %6d %7d %6d %10.0f", name, nsessions, sc->chainlen, sc->msgsize,
+		   total, nbusy, nexpired, total - nok - nbusy - nexpired, nok / (wall / 1e9));
+	if (nok > 0)
+		printf(" %9.1f %9.1f %9.1f %9.1f %9.1f", sum / (double)nok / 1e3, ok[nok / 2] / 1e3,
+			   ok[(int)(nok * 0.90)] / 1e3, ok[(int)(nok * 0.99)] / 1e3, ok[nok - 1] / 1e3);
+	else
+		printf(" %9s %9s %9s %9s %9s", "-", "-", "-", "-", "-");
+	if (allocs >= 0)
+		printf(" %7lld\n", allocs);
+	else
+		printf(" %7s\n", "-");
+	free(ok);
+}
+
+/* Run one scenario with one forked process per session, then print its table row(s) */
+static void run_scenario(int port, struct scenario *sc)
+{
+	int total = sc->sessions * sc->requests;
+	long long *latencies, t0, wall, allocs;
+	uint64_t logfrom = binlog != NULL ? __atomic_load_n(&binlog->hdr.head, __ATOMIC_ACQUIRE) : 0;
+	int classes[MAX_CLASSES], nclasses = scenario_classes(sc, classes);
+	int *sessionclass = calloc(sc->sessions, sizeof(int));
+	int i, c, n;
+	char name[48];
+	pid_t *pids = calloc(sc->sessions, sizeof(pid_t));
+
+	latencies = mmap(NULL, total * sizeof(long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latencies == MAP_FAILED)
+	{
+		fprintf(stderr, "bench: mmap() failed for scenario %s\n", sc->name);
+		return;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < sc->sessions; i++)
+	{
+		sessionclass[i] = nclasses > 0 ? classes[i % nclasses] : -1;
+		if ((pids[i] = fork()) == 0)
+		{
+			run_session(port, sc, sessionclass[i], latencies + (long)i * sc->requests);
+			_exit(0);
+		}
+		else if (pids[i] < 0)
+			fprintf(stderr, "bench: fork() failed\n");
+	}
+	/* only the sessions; the servers are children too and keep running */
+	for (i = 0; i < sc->sessions; i++)
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	wall = now_ns() - t0;
+	allocs = pool_allocs(logfrom, sc->sessions);
+
+	if (nclasses == 0)
+		print_row(sc->name, sc, sc->sessions, latencies, sessionclass, -1, wall, allocs);
+	else
+		for (c = 0; c < nclasses; c++)
+		{
+			/* one row per distinct class */
+			for (i = 0; i < c && classes[i] != classes[c]; i++)
+				;
+			if (i < c)
+				continue;
+			for (i = 0, n = 0; i < sc->sessions; i++)
+				n += sessionclass[i] == classes[c];
+			snprintf(name, sizeof(name), "%s/p%d", sc->name, classes[c]);
+			print_row(name, sc, n, latencies, sessionclass, classes[c], wall, allocs);
+		}
+	fflush(stdout);
+
+	free(sessionclass);
+	free(pids);
+	munmap(latencies, total * sizeof(long long));
+}
+
+/* Read scenarios from a file; returns how many were read */
+static int load_scenarios(const char *path, struct scenario *sc, int max)
+{
+	char line[256];
+	int n = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL)
+		return -1;
+	while (n < max && fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		memset(&sc[n], 0, sizeof(sc[n]));
+		if (sscanf(line, "%31s %d %d %d %d %31s %d", sc[n].name, &sc[n].sessions, &sc[n].chainlen,
+				   &sc[n].msgsize, &sc[n].requests, sc[n].classes, &sc[n].deadline) >= 5)
+			n++;
+		else
+			fprintf(stderr, "bench: skipping bad scenario line: %s", line);
+	}
+	fclose(fp);
+	return n;
+}
+
+/* Main program of the benchmark */
+int main(int argc, char *argv[])
+{
+	struct scenario scenarios[MAX_SCENARIOS];
+	int nscenarios;
+	const char *scenariofile = NULL;
+	pid_t servers[NUM_TRANSFORMS + 1];
+	char paths[NUM_TRANSFORMS + 1][256];
+	char ports[NUM_TRANSFORMS + 1][16];
+	char routes[NUM_TRANSFORMS][16];
+	char *args[8 + 2 * NUM_TRANSFORMS + MAX_MASTER_OPTIONS];
+	char plugindir[256];
+	int inprocess = 0;
+	char *masteroptions = NULL, *tok;
+	int udpports[NUM_TRANSFORMS];
+	int tcpport, opt, i, n;
+	int status = 0;
+
+	while ((opt = getopt(argc, argv, "d:f:m:iv")) != -1)
+	{
+		if (opt == 'd')
+			bindir = optarg;
+		else if (opt == 'f')
+			scenariofile = optarg;
+		else if (opt == 'm')
+			masteroptions = optarg;
+		else if (opt == 'i')
+			inprocess = 1;
+		else if (opt == 'v')
+			verbose = 1;
+		else
+		{
+			fprintf(stderr, "usage: %s [-d bindir] [-f scenariofile] [-m 'master options'] [-i] [-v]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (scenariofile != NULL)
+	{
+		if ((nscenarios = load_scenarios(scenariofile, scenarios, MAX_SCENARIOS)) <= 0)
+		{
+			fprintf(stderr, "bench: no scenarios in %s\n", scenariofile);
+			exit(1);
+		}
+	}
+	else
+	{
+		nscenarios = sizeof(defaults) / sizeof(defaults[0]);
+		memcpy(scenarios, defaults, sizeof(defaults));
+	}
+	for (i = 0; i < nscenarios; i++)
+	{
+		/* frames are MAX_MESSAGE_LENGTH bytes including the null */
+		if (scenarios[i].msgsize >= MAX_MESSAGE_LENGTH)
+			scenarios[i].msgsize = MAX_MESSAGE_LENGTH - 1;
+		if (scenarios[i].chainlen >= MAX_MESSAGE_LENGTH)
+			scenarios[i].chainlen = MAX_MESSAGE_LENGTH - 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(servers, 0, sizeof(servers));
+	if (binlog_open(BENCH_LOG) == -1)
+		fprintf(stderr, "bench: cannot map %s, no allocs column\n", BENCH_LOG);
+
+	/* 1- start every microserver in looping mode on its own free UDP port */
+	for (i = 0; i < NUM_TRANSFORMS; i++)
+	{
+		if ((udpports[i] = freeport(SOCK_DGRAM)) == -1)
+		{
+			fprintf(stderr, "bench: no free UDP port\n");
+			status = 1;
+			goto teardown;
+		}
+		snprintf(paths[i], sizeof(paths[i]), "%s/%s", bindir, microservers[i]);
+		snprintf(ports[i], sizeof(ports[i]), "%d", udpports[i]);
+		char *msargs[] = {paths[i], "-l", "-p", ports[i], NULL};
+		servers[i] = launch(msargs);
+	}
+	for (i = 0; i < NUM_TRANSFORMS; i++)
+		if (wait_microserver(udpports[i]) == -1)
+		{
+			fprintf(stderr, "bench: %s did not come up on UDP port %d\n", microservers[i], udpports[i]);
+			status = 1;
+			goto teardown;
+		}
+
+	/* 2- start the master, routing each transform code to its microserver (or to its plugin, -i) */
+	if ((tcpport = freeport(SOCK_STREAM)) == -1)
+	{
+		fprintf(stderr, "bench: no free TCP port\n");
+		status = 1;
+		goto teardown;
+	}
+	snprintf(paths[NUM_TRANSFORMS], sizeof(paths[NUM_TRANSFORMS]), "%s/mainserver.out", bindir);
+	snprintf(ports[NUM_TRANSFORMS], sizeof(ports[NUM_TRANSFORMS]), "%d", tcpport);
+	n = 0;
+	args[n++] = paths[NUM_TRANSFORMS];
+	args[n++] = "-p";
+	args[n++] = ports[NUM_TRANSFORMS];
+	args[n++] = "-g";
+	args[n++] = BENCH_LOG;
+	if (inprocess)
+	{
+		snprintf(plugindir, sizeof(plugindir), "%s/plugins", bindir);
+		args[n++] = "-L";
+		args[n++] = plugindir;
+	}
+	else
+		for (i = 0; i < NUM_TRANSFORMS; i++)
+		{
+			snprintf(routes[i], sizeof(routes[i]), "%d=%d", i + 1, udpports[i]);
+			args[n++] = "-s";
+			args[n++] = routes[i];
+		}
+	for (tok = masteroptions ? strtok(masteroptions, " ") : NULL; tok != NULL && n < (int)(sizeof(args) / sizeof(args[0])) - 1;
+		 tok = strtok(NULL, " "))
+		args[n++] = tok;
+	args[n] = NULL;
+	servers[NUM_TRANSFORMS] = launch(args);
+	if ((n = connect_master(tcpport, 1)) == -1)
+	{
+		fprintf(stderr, "bench: master server did not come up on TCP port %d\n", tcpport);
+		status = 1;
+		goto teardown;
+	}
+	close(n);
+
+	/* 3- run the scenarios */
+	if (inprocess)
+		printf("master on TCP %d, transforms in-process (%s)\n\n", tcpport, plugindir);
+	else
+		printf("master on TCP %d, microservers on UDP %d-%d (loopback)\n\n", tcpport, udpports[0], udpports[NUM_TRANSFORMS - 1]);
+	printf("%-16s %5s %5s %5s %8s %6s %7s %6s %10s %9s %9s %9s %9s %9s %7s\n", "scenario", "sess", "chain", "size",
+		   "requests", "busy", "expired", "errors", "req/s", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "allocs");
+	for (i = 0; i < nscenarios; i++)
+		run_scenario(tcpport, &scenarios[i]);
+
+teardown:
+	/* 4- stop everything that was started */
+	for (i = 0; i <= NUM_TRANSFORMS; i++)
+		if (servers[i] > 0)
+		{
+			kill(servers[i], SIGTERM);
+			waitpid(servers[i], NULL, 0);
+		}
+	return status;
+}
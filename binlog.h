@@ -0,0 +1,199 @@
+/*
+Binary logger for the hot path of the master server and the microservers.
+
+Instead of printf/fprintf (stdio locking, inet_ntoa and number formatting
+on every chain step), each log call fills one fixed-size 64-byte record
+in a ring that lives in an mmap'd log file shared by every process:
+the master, its forked session children and the exec'd microservers all
+map the same file and claim slots with one atomic add on the shared
+head counter, so there is no lock and no syscall per record. The kernel
+writes the pages back to the file in the background.
+
+Records are only turned into text by the separate decoder (logdecode.c),
+which can also change the log level of all running processes at once,
+because the level lives in the shared file header. When a record's level
+is above that level, BLOG() costs one load and one compare.
+
+Usage:
+	binlog_open(path);					//once per process, before forking
+	BLOG(BL_INFO, EV_STEP_SENT, code, port, bytes, NULL);
+*/
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* Manifest constants */
+#define BINLOG_MAGIC 0x474f4c4e49425354ULL	/* "TSBINLOG" */
+#define BINLOG_VERSION 1
+#define BINLOG_RECORDS 65536				/* ring capacity, power of two */
+#define BINLOG_STRLEN 16					/* inline text per record, truncated */
+#define BINLOG_DEFAULT_FILE "servers.blog"	/* used when no -g file is given */
+
+/* Log levels; a record is kept when its level <= the level in the header */
+#define BL_OFF 0
+#define BL_ERROR 1
+#define BL_WARN 2
+#define BL_INFO 3
+#define BL_DEBUG 4
+
+/* Events; the decoder knows how to print the arguments of each */
+enum binlog_event
+{
+	EV_SESSION_START,		//master: a = child pid
+	EV_SENTENCE,			//session: a = bytes, s = sentence
+	EV_CHAIN,				//session: a = chain length, s = chain
+	EV_STEP_SENT,			//session: a = transform code, b = UDP port, c = bytes
+	EV_STEP_ANSWER,			//session: a = transform code, b = bytes, s = answer
+	EV_RESPONSE,			//session: a = bytes, s = response
+	EV_MS_RECEIVED,			//microserver: a = bytes, b = IPv4 (network order), c = port, s = message
+	EV_MS_SENT,				//microserver: a = bytes, s = message
+	EV_STEP_INPROC,			//session: a = transform code, b = bytes, s = result of the plugin
+	EV_CACHE_HIT,			//session: a = steps reused from the chain cache, b = chain length, s = chain
+	EV_REBASE,				//session: a = steps sent for an edited sentence, b = bytes sent, c = bytes a full rerun sends
+	EV_BATCH,				//session: a = documents, b = bytes, c = datagrams sent, s = chain
+	EV_CODEC,				//session: a = batch payload bytes so far, b = of those on the wire, c = codec ns, s = codec
+	EV_COALESCED,			//session: a = requests joined so far (all sessions), b = requests led, c = steps saved, s = chain
+	EV_LOWLAT,				//any (-R): a = ns receives spun, b = ns slept, c = receives caught spinning << 32 | sleeps, s = process
+	EV_SCALE,				//controller (-A): a = transform code, b = replicas now, c = steps in the system * 1000 << 32 | mean step us, s = why
+	EV_POOL,				//session, at its end: a = pooled blocks from the heap, b = of those after the first request, c = buffers used
+	EV_ZEROCOPY,			//session, at its end (-Z): a = zero-copy sends, b = bytes, c = of the sends, copied by the kernel after all
+	EV_DOC_STORED,			//session (-D): a = bytes, b = 1 new / 0 stored already, c = bytes in memory << 32 | documents spilled so far, s = handle
+	EV_DOC_RUN,				//session (-D): a = bytes, b = datagrams sent, c = verdict, s = chain
+	EV_DOC_RANGE,			//session (-D): a = bytes of the range, b = bytes the steps ran over, c = datagrams sent, s = chain
+	EV_PLAN,				//session end (-W), per mode: a = steps run in this mode, b = their ns, c = ns they were mispredicted by, s = mode
+	EV_COUNT
+};
+
+/* One log record; seq is written last and equals slot index + 1 when complete */
+struct binlog_record
+{
+	uint64_t seq;
+	uint64_t time_ns;			//CLOCK_REALTIME
+	uint32_t pid;
+	uint16_t event;
+	uint8_t level;
+	uint8_t pad;
+	uint64_t a, b, c;
+	char s[BINLOG_STRLEN];		//not null-terminated when full
+};
+
+/* File header, followed by BINLOG_RECORDS records */
+struct binlog_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	volatile uint32_t level;	//runtime switchable (logdecode -l)
+	uint32_t pad;
+	uint64_t head;				//next slot to claim, only grows
+	char reserved[32];
+};
+
+struct binlog
+{
+	struct binlog_header hdr;
+	struct binlog_record rec[];
+};
+
+/* the mapping of this process; NULL when logging is unavailable */
+static struct binlog *binlog;
+static uint32_t binlog_pid;			//cached, getpid() is a syscall
+
+/* forked children inherit the mapping but need their own pid in records */
+static inline void binlog_atfork_child(void)
+{
+	binlog_pid = getpid();
+}
+
+/* Map (and create if needed) the shared log file; returns 0 or -1 */
+static inline int binlog_open(const char *path)
+{
+	size_t size = sizeof(struct binlog_header) + (size_t)BINLOG_RECORDS * sizeof(struct binlog_record);
+	struct stat st;
+	struct binlog *log;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+		return -1;
+
+	/* first process to get here initializes the file; the others wait for it */
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) == -1 || ((size_t)st.st_size != size && ftruncate(fd, size) == -1))
+	{
+		flock(fd, LOCK_UN);
+		close(fd);
+		return -1;
+	}
+	log = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (log != MAP_FAILED && (log->hdr.magic != BINLOG_MAGIC || log->hdr.version != BINLOG_VERSION ||
+							  log->hdr.capacity != BINLOG_RECORDS))
+	{
+		memset(log, 0, sizeof(struct binlog_header));
+		log->hdr.version = BINLOG_VERSION;
+		log->hdr.capacity = BINLOG_RECORDS;
+		log->hdr.level = BL_INFO;
+		__atomic_store_n(&log->hdr.magic, BINLOG_MAGIC, __ATOMIC_RELEASE);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (log == MAP_FAILED)
+		return -1;
+	if (binlog == NULL)
+		pthread_atfork(NULL, NULL, binlog_atfork_child);
+	binlog = log;
+	binlog_pid = getpid();
+	return 0;
+}
+
+/* Fill the next ring slot; call through BLOG() so disabled levels cost nothing */
+static inline void binlog_write(int level, int event, uint64_t a, uint64_t b, uint64_t c, const char *s)
+{
+	struct timespec ts;
+	uint64_t idx = __atomic_fetch_add(&binlog->hdr.head, 1, __ATOMIC_RELAXED);
+	struct binlog_record *r = &binlog->rec[idx & (BINLOG_RECORDS - 1)];
+
+	/* mark the slot as being rewritten so the decoder skips a half-written record */
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->pid = binlog_pid;
+	r->event = event;
+	r->level = level;
+	r->a = a;
+	r->b = b;
+	r->c = c;
+	if (s != NULL)
+	{
+		size_t n = strnlen(s, BINLOG_STRLEN);
+		memcpy(r->s, s, n);
+		if (n < BINLOG_STRLEN)
+			r->s[n] = '\0';
+	}
+	else
+		r->s[0] = '\0';
+
+	__atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+#define BLOG(lvl, ev, a, b, c, s)                                              \
+	do                                                                         \
+	{                                                                          \
+		if (binlog != NULL && (lvl) <= binlog->hdr.level)                      \
+			binlog_write((lvl), (ev), (uint64_t)(a), (uint64_t)(b),            \
+						 (uint64_t)(c), (s));                                  \
+	} while (0)
+
+#endif /* BINLOG_H */
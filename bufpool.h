@@ -0,0 +1,165 @@
+/*
+Pooled buffers: a size-classed free-list allocator for everything the
+master allocates per request (chain cache nodes, batch documents and
+their wire images, codec frames).
+
+Blocks come in power-of-two classes from BUFPOOL_MIN (64 bytes) up to
+BUFPOOL_MAX (64 MiB). A block that is put back goes on its class's free
+list instead of back to the heap, so once a session has seen its largest
+request, the next ones of that size are served without malloc(): the
+steady state of a session allocates nothing. A class keeps at most
+BUFPOOL_KEEP bytes of free blocks (always at least one), the rest go
+back to the heap; larger requests than BUFPOOL_MAX bypass the pool.
+
+The pool is per thread (every session is a single-threaded process; the
+client library's I/O thread gets its own), so there are no locks.
+bufpool_stats counts the blocks taken from the heap: a session logs it
+when it ends (EV_POOL) and bench.c shows the steady-state part of it.
+
+Usage:
+	p = bufpool_get(size);					//NULL when the heap is out
+	p = bufpool_grow(p, size);				//keeps the contents, as realloc(); NULL: p is still valid
+	bufpool_put(p);
+	bufpool_drain();						//a thread that ends gives its free blocks back
+*/
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Manifest constants */
+#define BUFPOOL_MIN_SHIFT 6
+#define BUFPOOL_MIN (1 << BUFPOOL_MIN_SHIFT)	/* smallest block, bytes */
+#define BUFPOOL_CLASSES 21						/* 64 B .. 64 MiB */
+#define BUFPOOL_MAX ((size_t)BUFPOOL_MIN << (BUFPOOL_CLASSES - 1))
+#define BUFPOOL_HUGE BUFPOOL_CLASSES			/* class of a block from the heap alone */
+#define BUFPOOL_KEEP (4 << 20)					/* free bytes a class holds on to */
+
+/* In front of every block; 16 bytes, so the data stays 16-byte aligned */
+struct bufpool_block
+{
+	struct bufpool_block *next;					//free list link
+	uint32_t cls;
+	uint32_t size;								//KiB of data, BUFPOOL_HUGE only
+};
+
+struct bufpool_counters
+{
+	uint64_t gets;								//buffers handed out
+	uint64_t heap;								//of those, new blocks from the heap
+	uint64_t returned;							//blocks given back to the heap
+};
+
+static __thread struct bufpool_block *bufpool_free[BUFPOOL_CLASSES];
+static __thread size_t bufpool_kept[BUFPOOL_CLASSES];
+static __thread struct bufpool_counters bufpool_stats;
+
+static inline size_t bufpool_class_size(uint32_t cls)
+{
+	return (size_t)BUFPOOL_MIN << cls;
+}
+
+/* Smallest class that holds size bytes; BUFPOOL_HUGE above BUFPOOL_MAX */
+static inline uint32_t bufpool_class(size_t size)
+{
+	if (size <= BUFPOOL_MIN)
+		return 0;
+	if (size > BUFPOOL_MAX)
+		return BUFPOOL_HUGE;
+	return 64 - __builtin_clzll((unsigned long long)(size - 1)) - BUFPOOL_MIN_SHIFT;
+}
+
+static inline struct bufpool_block *bufpool_header(void *p)
+{
+	return (struct bufpool_block *)p - 1;
+}
+
+/* Bytes p can hold */
+static inline size_t bufpool_size(void *p)
+{
+	struct bufpool_block *b = bufpool_header(p);
+
+	return b->cls == BUFPOOL_HUGE ? (size_t)b->size << 10 : bufpool_class_size(b->cls);
+}
+
+static inline void *bufpool_get(size_t size)
+{
+	uint32_t cls = bufpool_class(size);
+	struct bufpool_block *b;
+
+	bufpool_stats.gets++;
+	if (cls != BUFPOOL_HUGE && (b = bufpool_free[cls]) != NULL)
+	{
+		bufpool_free[cls] = b->next;
+		bufpool_kept[cls] -= bufpool_class_size(cls);
+		return b + 1;
+	}
+	if (cls == BUFPOOL_HUGE)
+		size = (size + 1023) & ~(size_t)1023;
+	else
+		size = bufpool_class_size(cls);
+	if ((b = malloc(sizeof(*b) + size)) == NULL)
+		return NULL;
+	bufpool_stats.heap++;
+	b->cls = cls;
+	b->size = cls == BUFPOOL_HUGE ? size >> 10 : 0;
+	return b + 1;
+}
+
+static inline void bufpool_put(void *p)
+{
+	struct bufpool_block *b;
+	uint32_t cls;
+
+	if (p == NULL)
+		return;
+	b = bufpool_header(p);
+	cls = b->cls;
+	if (cls == BUFPOOL_HUGE ||
+		(bufpool_free[cls] != NULL && bufpool_kept[cls] + bufpool_class_size(cls) > BUFPOOL_KEEP))
+	{
+		bufpool_stats.returned++;
+		free(b);
+		return;
+	}
+	b->next = bufpool_free[cls];
+	bufpool_free[cls] = b;
+	bufpool_kept[cls] += bufpool_class_size(cls);
+}
+
+static inline void *bufpool_grow(void *p, size_t size)
+{
+	void *q;
+
+	if (p == NULL)
+		return bufpool_get(size);
+	if (size <= bufpool_size(p))
+		return p;
+	if ((q = bufpool_get(size)) == NULL)
+		return NULL;
+	memcpy(q, p, bufpool_size(p));
+	bufpool_put(p);
+	return q;
+}
+
+static inline void bufpool_drain(void)
+{
+	struct bufpool_block *b;
+	int i;
+
+	for (i = 0; i < BUFPOOL_CLASSES; i++)
+	{
+		while ((b = bufpool_free[i]) != NULL)
+		{
+			bufpool_free[i] = b->next;
+			bufpool_stats.returned++;
+			free(b);
+		}
+		bufpool_kept[i] = 0;
+	}
+}
+
+#endif /* BUFPOOL_H */
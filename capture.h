@@ -0,0 +1,183 @@
+/*
+Traffic capture for the master server (mainserver -c file), read back by
+the replay tool (replay.c).
+
+Every client request a session receives is recorded with the time it
+arrived: the selection frame ("1", "2", "3 prio deadline", "4 n bytes",
+"5 lz4", "6 bytes", "7 handle", "8 handle", "9 handle from to"), its
+argument frame (the sentence or the chain; options 5, 6 and 8 have none,
+see capture_has_arg()) and the payload that follows: a batch's offsets
+and documents, or an uploaded document, as they were before any codec
+(option 5). Frames are stored without their zero padding, so a record is
+a 24-byte header plus the bytes the client actually typed. Handles are
+hashes of the documents' content, so a replay that uploads the same
+documents gets the same handles back.
+
+Each session collects its records in a buffer of its own and appends it
+to the file with one write() when it is full and when the session ends;
+the file is opened O_APPEND, so the sessions' writes never overlap. The
+records in the file are therefore grouped by session, not sorted by
+time; the replay tool sorts them.
+
+File layout:
+	struct capture_header
+	struct capture_record, sel[sellen], arg[arglen], payload[paylen]	//repeated
+
+Usage:
+	capture_open(path);							//master, before forking
+	capture_session(id);						//session child, once
+	capture_select(selin);						//selection frame arrived
+	capture_request(arg, arglen, payload, paylen);	//its argument is complete
+	capture_flush();							//session end
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+/* Manifest constants */
+#define CAPTURE_MAGIC 0x3150414d43534d44ULL	/* "DMSCMAP1" */
+#define CAPTURE_VERSION 1
+#define CAPTURE_FRAME 100					/* client frame size, as MAX_MESSAGE_LENGTH */
+#define CAPTURE_BUFFER 65536				/* per-session buffer, flushed when full */
+
+/* Start of the file */
+struct capture_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t pad;
+	uint64_t realtime_ns;			//wall clock when the file was created
+	uint64_t monotonic_ns;			//CLOCK_MONOTONIC at the same moment
+};
+
+/* One request; its bytes follow it */
+struct capture_record
+{
+	uint64_t t_ns;					//CLOCK_MONOTONIC when the selection frame arrived
+	uint32_t session;				//numbered by the master in accept order
+	uint8_t sellen, arglen;			//frame bytes without the zero padding
+	uint16_t pad;
+	uint32_t paylen;				//payload bytes after the frames (batches, uploads)
+	uint32_t pad2;
+};
+
+/* Does a request of this option send an argument frame after its selection frame? */
+static inline int capture_has_arg(char option)
+{
+	return option != '5' && option != '6' && option != '8';
+}
+
+/* Writer state of this process; fd -1: not capturing */
+static int capture_fd = -1;
+static uint32_t capture_id;
+static char *capture_buf;
+static size_t capture_used;
+static struct capture_record capture_pending;
+static char capture_sel[CAPTURE_FRAME];
+
+static inline uint64_t capture_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Open (create) the capture file; a new or empty file gets its header. 0 or -1 */
+static inline int capture_open(const char *path)
+{
+	struct capture_header h;
+	struct timespec ts;
+	struct stat st;
+
+	if ((capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+		return -1;
+	if (fstat(capture_fd, &st) == 0 && st.st_size == 0)
+	{
+		memset(&h, 0, sizeof(h));
+		h.magic = CAPTURE_MAGIC;
+		h.version = CAPTURE_VERSION;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		h.realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		h.monotonic_ns = capture_now();
+		if (write(capture_fd, &h, sizeof(h)) != sizeof(h))
+		{
+			close(capture_fd);
+			capture_fd = -1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Session child: records from here on belong to session id */
+static inline void capture_session(uint32_t id)
+{
+	capture_id = id;
+	capture_used = 0;
+	if (capture_fd != -1 && (capture_buf = malloc(CAPTURE_BUFFER)) == NULL)
+		capture_fd = -1;
+}
+
+/* Append what the session has buffered to the file */
+static inline void capture_flush(void)
+{
+	if (capture_fd != -1 && capture_used > 0 && write(capture_fd, capture_buf, capture_used) == -1)
+		capture_fd = -1;
+	capture_used = 0;
+}
+
+/* A selection frame arrived: note the time; the record is written once the argument is in */
+static inline void capture_select(const char *sel)
+{
+	if (capture_fd == -1)
+		return;
+	memset(&capture_pending, 0, sizeof(capture_pending));
+	capture_pending.t_ns = capture_now();
+	capture_pending.session = capture_id;
+	capture_pending.sellen = strnlen(sel, CAPTURE_FRAME);
+	memcpy(capture_sel, sel, capture_pending.sellen);
+}
+
+/* The pending request's argument frame (and batch payload) is complete: record it */
+static inline void capture_request(const char *arg, size_t arglen, const char *payload, size_t paylen)
+{
+	struct capture_record *r = &capture_pending;
+	struct iovec iov[4];
+	size_t size;
+
+	if (capture_fd == -1)
+		return;
+	r->arglen = strnlen(arg, arglen < CAPTURE_FRAME ? arglen : CAPTURE_FRAME);
+	r->paylen = paylen;
+	size = sizeof(*r) + r->sellen + r->arglen + paylen;
+	if (capture_used + size > CAPTURE_BUFFER)
+		capture_flush();
+	if (size > CAPTURE_BUFFER)
+	{
+		/* a large batch or document: straight to the file, still in one write */
+		iov[0] = (struct iovec){r, sizeof(*r)};
+		iov[1] = (struct iovec){capture_sel, r->sellen};
+		iov[2] = (struct iovec){(void *)arg, r->arglen};
+		iov[3] = (struct iovec){(void *)payload, paylen};
+		if (writev(capture_fd, iov, 4) == -1)
+			capture_fd = -1;
+		return;
+	}
+	memcpy(capture_buf + capture_used, r, sizeof(*r));
+	memcpy(capture_buf + capture_used + sizeof(*r), capture_sel, r->sellen);
+	memcpy(capture_buf + capture_used + sizeof(*r) + r->sellen, arg, r->arglen);
+	if (paylen > 0)
+		memcpy(capture_buf + capture_used + sizeof(*r) + r->sellen + r->arglen, payload, paylen);
+	capture_used += size;
+}
+
+#endif /* CAPTURE_H */
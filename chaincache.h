@@ -0,0 +1,208 @@
+/*
+Per-session cache of intermediate chain results.
+
+Clients explore chains step by step (3, then 35, then 354, then 352),
+and every request used to start again from the sentence. The session
+keeps a trie for the current sentence instead: the root holds the
+sentence, and the node reached by following codes c1..ck holds the
+text after running that prefix of the chain. A new chain resumes from
+the longest prefix already in the trie and only its remaining steps are
+run; every step that is run adds a node.
+
+The trie is dropped whenever the client enters a new sentence, unless
+the master carries its recently used chains over to the edited sentence
+(mainserver -I, see incremental.h); chaincache_retext() then gives each
+kept node its new text. Its memory is capped (mainserver -C bytes); over
+the cap the least recently used leaves are evicted, never the node being
+extended. Nodes are pooled buffers (bufpool.h): the trie of a new
+sentence is built in the memory of the old one.
+
+Usage:
+	chaincache_reset(&cache, sentence, len);
+	done = chaincache_lookup(&cache, chain, &node);	//node->text: result after chain[0..done)
+	node = chaincache_insert(&cache, node, code, text, len);
+*/
+
+#ifndef CHAINCACHE_H
+#define CHAINCACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bufpool.h"
+
+/* Manifest constants */
+#define CHAINCACHE_CODES 6					/* transform codes '1'..'6' */
+
+struct chain_node
+{
+	struct chain_node *child[CHAINCACHE_CODES + 1];	//by code, index 0 unused
+	struct chain_node *parent;
+	int code;								//code of the step leading here, 0 at the root
+	int len;								//bytes in text
+	uint64_t lastuse;						//cache clock when last on a request's path
+	char text[];							//null-terminated result
+};
+
+struct chain_cache
+{
+	struct chain_node *root;				//the sentence; NULL when caching is off
+	size_t used, cap;						//bytes of all nodes, and the limit
+	uint64_t clock;
+	uint64_t reused, run;					//steps taken from the trie, steps computed
+};
+
+static inline size_t chaincache_nodesize(int len)
+{
+	return sizeof(struct chain_node) + len + 1;
+}
+
+static inline struct chain_node *chaincache_node(struct chain_cache *c, struct chain_node *parent, int code,
+												 const char *text, int len)
+{
+	struct chain_node *n = bufpool_get(chaincache_nodesize(len));
+
+	if (n == NULL)
+		return NULL;
+	memset(n, 0, sizeof(*n));
+	n->parent = parent;
+	n->code = code;
+	n->len = len;
+	n->lastuse = c->clock;
+	memcpy(n->text, text, len);
+	n->text[len] = '\0';
+	c->used += chaincache_nodesize(len);
+	return n;
+}
+
+static inline void chaincache_free(struct chain_cache *c, struct chain_node *n)
+{
+	int i;
+
+	if (n == NULL)
+		return;
+	for (i = 1; i <= CHAINCACHE_CODES; i++)
+		chaincache_free(c, n->child[i]);
+	c->used -= chaincache_nodesize(n->len);
+	bufpool_put(n);
+}
+
+/* Start over for a new sentence; a cap of 0 turns the cache off */
+static inline void chaincache_reset(struct chain_cache *c, const char *sentence, int len)
+{
+	chaincache_free(c, c->root);
+	c->root = NULL;
+	if (c->cap > 0)
+		c->root = chaincache_node(c, NULL, 0, sentence, len);
+}
+
+/* Follow chain as far as the trie goes; returns the number of steps found
+and sets *node to where the chain continues (the root for 0; NULL when off) */
+static inline int chaincache_lookup(struct chain_cache *c, const char *chain, struct chain_node **node)
+{
+	struct chain_node *n = c->root;
+	int i, code;
+
+	*node = NULL;
+	if (n == NULL)
+		return 0;
+	c->clock++;
+	n->lastuse = c->clock;
+	for (i = 0; chain[i] >= '1' && chain[i] <= '0' + CHAINCACHE_CODES; i++)
+	{
+		code = chain[i] - '0';
+		if (n->child[code] == NULL)
+			break;
+		n = n->child[code];
+		n->lastuse = c->clock;
+	}
+	c->reused += i;
+	*node = n;
+	return i;
+}
+
+/* Least recently used leaf below n other than keep, or NULL */
+static inline struct chain_node *chaincache_lru_leaf(struct chain_node *n, struct chain_node *keep)
+{
+	struct chain_node *best = NULL, *l;
+	int i, leaf = 1;
+
+	for (i = 1; i <= CHAINCACHE_CODES; i++)
+		if (n->child[i] != NULL)
+		{
+			leaf = 0;
+			l = chaincache_lru_leaf(n->child[i], keep);
+			if (l != NULL && (best == NULL || l->lastuse < best->lastuse))
+				best = l;
+		}
+	if (leaf && n != keep && n->parent != NULL)
+		return n;
+	return best;
+}
+
+/* Remove n and everything below it */
+static inline void chaincache_drop(struct chain_cache *c, struct chain_node *n)
+{
+	if (n->parent != NULL)
+		n->parent->child[n->code] = NULL;
+	else
+		c->root = NULL;
+	chaincache_free(c, n);
+}
+
+/* Evict least recently used leaves until extra more bytes fit under the cap;
+keep is never evicted. Returns 0, or -1 when they still do not fit. */
+static inline int chaincache_trim(struct chain_cache *c, size_t extra, struct chain_node *keep)
+{
+	struct chain_node *victim;
+
+	while (c->used + extra > c->cap && c->root != NULL && (victim = chaincache_lru_leaf(c->root, keep)) != NULL)
+		chaincache_drop(c, victim);
+	return c->used + extra > c->cap ? -1 : 0;
+}
+
+/* Give n new text; returns the node, which may have moved */
+static inline struct chain_node *chaincache_retext(struct chain_cache *c, struct chain_node *n, const char *text, int len)
+{
+	struct chain_node *m;
+	int i;
+
+	if ((m = bufpool_grow(n, chaincache_nodesize(len))) == NULL)
+	{
+		chaincache_drop(c, n);
+		return NULL;
+	}
+	c->used += chaincache_nodesize(len) - chaincache_nodesize(m->len);
+	m->len = len;
+	memcpy(m->text, text, len);
+	m->text[len] = '\0';
+	if (m->parent != NULL)
+		m->parent->child[m->code] = m;
+	else
+		c->root = m;
+	for (i = 1; i <= CHAINCACHE_CODES; i++)
+		if (m->child[i] != NULL)
+			m->child[i]->parent = m;
+	return m;
+}
+
+/* Record that running code on node gave text; returns the new node, or NULL
+when the result does not fit under the cap (the rest of the chain then goes
+uncached, as it does after node == NULL) */
+static inline struct chain_node *chaincache_insert(struct chain_cache *c, struct chain_node *node, int code,
+												   const char *text, int len)
+{
+	c->run++;
+	if (node == NULL || code < 1 || code > CHAINCACHE_CODES)
+		return NULL;
+	if (node->child[code] != NULL)
+		return node->child[code];
+
+	/* make room: evict old leaves, but never node, which is being extended */
+	if (chaincache_trim(c, chaincache_nodesize(len), node) == -1 ||
+		(node->child[code] = chaincache_node(c, node, code, text, len)) == NULL)
+		return NULL;
+	return node->child[code];
+}
+
+#endif /* CHAINCACHE_H */
@@ -0,0 +1,283 @@
+/*
+Single-flight coalescing of identical requests across sessions (mainserver -J).
+
+When many sessions ask for the same chain on the same sentence at the
+same moment, only the first one (the leader) runs the steps. Every
+identical request that arrives while the leader is in flight joins it,
+waits for its answer and sends that to its own client, so the
+microservers see one dispatch instead of one per session.
+
+Like the admission state (admission.h), the table of requests in flight
+lives in one shared memory block mapped before the first fork, guarded
+by a process-shared robust mutex, with a condition variable broadcast
+whenever a leader finishes. A request is identified by its sentence and
+its chain; the 64-bit hash of both only narrows the search.
+
+A joiner stops waiting and answers EXPIRED when its own deadline passes.
+It runs the request itself when the leader was refused (BUSY or EXPIRED
+under its own priority and deadline) or died, since that verdict was not
+the joiner's. A finished slot goes to a new request after
+COALESCE_LINGER_NS even if a joiner has not woken up yet: each reuse
+bumps the slot's generation, and a joiner that finds it changed answers
+ALONE instead of taking someone else's result.
+
+Usage:
+	coalesce_init(slots);						//parent, before forking
+	flight = coalesce_begin(sentence, chain, deadline, result);
+	if (flight >= 0) { run the steps; coalesce_end(flight, result, ok); }
+	//COALESCE_JOINED: result holds the leader's answer
+	//COALESCE_ALONE: run the steps, nothing is shared
+	//COALESCE_EXPIRED: the deadline passed while waiting
+*/
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Manifest constants */
+#define COALESCE_MAX_SLOTS 1024			/* requests in flight at once, upper bound of -J */
+#define COALESCE_TEXT 100				/* sentence, chain and result, as MAX_MESSAGE_LENGTH */
+#define COALESCE_POLL_NS 100000000ULL	/* joiners check that their leader is alive this often */
+#define COALESCE_LINGER_NS 1000000000ULL	/* a finished slot is reused after this even if a joiner vanished */
+
+/* coalesce_begin() results other than a slot to lead */
+#define COALESCE_ALONE -1
+#define COALESCE_JOINED -2
+#define COALESCE_EXPIRED -3
+
+/* Slot states */
+#define FLIGHT_FREE 0
+#define FLIGHT_RUNNING 1
+#define FLIGHT_DONE 2
+#define FLIGHT_FAILED 3
+
+/* One request in flight */
+struct flight
+{
+	int state;
+	uint64_t key;						//hash of sentence and chain
+	pid_t leader;						//session running the steps
+	int waiters;						//sessions joined and not yet gone
+	uint64_t gen;						//bumped every time the slot is led anew
+	uint64_t done_ns;					//when it finished
+	char sentence[COALESCE_TEXT], chain[COALESCE_TEXT];
+	char result[COALESCE_TEXT];			//null-terminated answer, once done
+};
+
+struct coalesce
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;				//broadcast when a flight finishes
+	int nslots;
+
+	/* counters */
+	uint64_t led;						//requests whose steps were dispatched
+	uint64_t joined;					//requests answered from another session's flight
+	uint64_t stepssaved;				//chain steps those would have dispatched
+	uint64_t alone;						//table full, or leader refused or gone
+
+	struct flight slot[COALESCE_MAX_SLOTS];
+};
+
+static struct coalesce *coal;			//shared by the parent and every session child; NULL: off
+
+static inline uint64_t coalesce_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void coalesce_lock(void)
+{
+	if (pthread_mutex_lock(&coal->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&coal->lock);
+}
+
+static inline void coalesce_unlock(void)
+{
+	pthread_mutex_unlock(&coal->lock);
+}
+
+/* Map the shared table of slots entries; call once in the parent before forking */
+static inline int coalesce_init(int slots)
+{
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+
+	coal = mmap(NULL, sizeof(struct coalesce), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (coal == MAP_FAILED)
+	{
+		coal = NULL;
+		return -1;
+	}
+	memset(coal, 0, sizeof(*coal));
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&coal->lock, &ma);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&coal->cond, &ca);
+	coal->nslots = slots > 0 && slots <= COALESCE_MAX_SLOTS ? slots : COALESCE_MAX_SLOTS;
+	return 0;
+}
+
+/* FNV-1a of sentence and chain */
+static inline uint64_t coalesce_key(const char *sentence, const char *chain)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const char *p;
+
+	for (p = sentence; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	h = (h ^ 0xff) * 0x100000001b3ULL;	//sentence "ab" + chain "c" differs from "a" + "bc"
+	for (p = chain; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	return h;
+}
+
+/* A slot may be taken: free, or finished long enough ago that its joiners must be gone */
+static inline int coalesce_reusable(const struct flight *f, uint64_t now)
+{
+	return f->state == FLIGHT_FREE || (f->state != FLIGHT_RUNNING && (f->waiters == 0 || now - f->done_ns > COALESCE_LINGER_NS));
+}
+
+/* A joiner of generation gen is done with slot f (lock held); a slot led anew since then
+no longer counts it */
+static inline void coalesce_leave(struct flight *f, uint64_t gen)
+{
+	if (f->gen == gen && --f->waiters <= 0 && f->state != FLIGHT_RUNNING)
+		f->state = FLIGHT_FREE;
+}
+
+/* Session: lead or join the request (sentence, chain). Returns the slot to lead, or
+COALESCE_JOINED (result holds the answer), COALESCE_ALONE or COALESCE_EXPIRED. */
+static inline int coalesce_begin(const char *sentence, const char *chain, uint64_t deadline, char *result)
+{
+	uint64_t key, now, wake, gen;
+	struct flight *f;
+	struct timespec until;
+	int i, freeslot = -1, rc, ret;
+
+	if (coal == NULL || strlen(sentence) >= COALESCE_TEXT || strlen(chain) >= COALESCE_TEXT)
+		return COALESCE_ALONE;
+	key = coalesce_key(sentence, chain);
+	now = coalesce_now();
+
+	coalesce_lock();
+	for (i = 0; i < coal->nslots; i++)
+	{
+		f = &coal->slot[i];
+		if (f->state == FLIGHT_RUNNING && f->key == key && strcmp(f->sentence, sentence) == 0 && strcmp(f->chain, chain) == 0)
+			break;
+		if (freeslot == -1 && coalesce_reusable(f, now))
+			freeslot = i;
+	}
+
+	if (i == coal->nslots)
+	{
+		/* nobody runs it: lead, if there is room */
+		if (freeslot == -1)
+		{
+			coal->alone++;
+			coalesce_unlock();
+			return COALESCE_ALONE;
+		}
+		f = &coal->slot[freeslot];
+		f->state = FLIGHT_RUNNING;
+		f->gen++;
+		f->key = key;
+		f->leader = getpid();
+		f->waiters = 0;
+		strcpy(f->sentence, sentence);
+		strcpy(f->chain, chain);
+		coal->led++;
+		coalesce_unlock();
+		return freeslot;
+	}
+
+	/* join: wait for the leader, checking now and then that it is still there */
+	f = &coal->slot[i];
+	f->waiters++;
+	gen = f->gen;
+	while (f->gen == gen && f->state == FLIGHT_RUNNING)
+	{
+		now = coalesce_now();
+		if (deadline && now >= deadline)
+			break;
+		if (kill(f->leader, 0) == -1 && errno == ESRCH)
+		{
+			f->state = FLIGHT_FAILED;
+			f->done_ns = now;
+			break;
+		}
+		wake = now + COALESCE_POLL_NS;
+		if (deadline && deadline < wake)
+			wake = deadline;
+		until.tv_sec = wake / 1000000000ULL;
+		until.tv_nsec = wake % 1000000000ULL;
+		rc = pthread_cond_timedwait(&coal->cond, &coal->lock, &until);
+		if (rc == EOWNERDEAD)
+			pthread_mutex_consistent(&coal->lock);
+	}
+	if (f->gen != gen)
+	{
+		/* the slot lingered out and went to another request before this one woke up */
+		coal->alone++;
+		ret = COALESCE_ALONE;
+	}
+	else if (f->state == FLIGHT_DONE)
+	{
+		strcpy(result, f->result);
+		coal->joined++;
+		coal->stepssaved += strlen(chain);
+		ret = COALESCE_JOINED;
+	}
+	else if (f->state == FLIGHT_RUNNING)
+		ret = COALESCE_EXPIRED;
+	else
+	{
+		coal->alone++;
+		ret = COALESCE_ALONE;
+	}
+	coalesce_leave(f, gen);
+	coalesce_unlock();
+	return ret;
+}
+
+/* Session: the leader of slot is done; ok: result is the answer for everyone who joined */
+static inline void coalesce_end(int slot, const char *result, int ok)
+{
+	struct flight *f;
+	size_t len;
+
+	if (coal == NULL || slot < 0)
+		return;
+	f = &coal->slot[slot];
+	coalesce_lock();
+	if (ok)
+	{
+		len = strnlen(result, COALESCE_TEXT - 1);
+		memcpy(f->result, result, len);
+		f->result[len] = '\0';
+	}
+	f->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+	f->done_ns = coalesce_now();
+	if (f->waiters == 0)
+		f->state = FLIGHT_FREE;
+	pthread_cond_broadcast(&coal->cond);
+	coalesce_unlock();
+}
+
+#endif /* COALESCE_H */
@@ -0,0 +1,247 @@
+/*
+Payload compression on the client connection.
+
+Sentences, chains and answers are at most 100 bytes and are sent as they
+are; what gets large is a batch (client option 4, see batch.h). A client
+that wants its batches compressed asks for it right after connecting with
+the selection frame "5 lz4"; the master answers "CODEC lz4 <threshold>\n"
+when it was started with -z, or "CODEC none\n". From then on, in both
+directions, a batch payload travels as one codec frame:
+
+	uint32 rawlen, uint32 storedlen		network byte order
+	storedlen bytes						LZ4 block when storedlen < rawlen,
+										the raw payload when storedlen == rawlen
+
+Payloads below the threshold, and payloads that do not shrink, are stored
+raw, so small frames never pay for the codec.
+
+The codec writes the standard LZ4 block format (sequences of a token,
+literals, a 2-byte offset and a match length) with a greedy single-probe
+hash table, as LZ4's fast mode does; the decoder checks every length and
+offset, because the bytes come from the network.
+
+Usage:
+	stored = codec_encode(raw, rawlen, threshold, frame, &stats);	//frame: CODEC_FRAME_MAX(rawlen) bytes
+	codec_decode(frame + CODEC_HEADER, storedlen, raw, rawlen, &stats);	//0 or -1
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/* Manifest constants */
+#define CODEC_NAME "lz4"
+#define CODEC_REPLY "CODEC"						/* "CODEC lz4 <threshold>\n" or "CODEC none\n" */
+#define CODEC_HEADER 8							/* rawlen, storedlen */
+#define CODEC_DEFAULT_THRESHOLD 256				/* payloads below this are sent raw */
+#define CODEC_HASH_LOG 12
+#define CODEC_MIN_MATCH 4
+#define CODEC_LAST_LITERALS 5					/* LZ4: a block ends with at least 5 literals */
+#define CODEC_MF_LIMIT 12						/* LZ4: no match starts in the last 12 bytes */
+#define CODEC_MAX_OFFSET 65535
+#define CODEC_BOUND(n) ((n) + (n) / 255 + 16)	/* worst case of an LZ4 block */
+#define CODEC_FRAME_MAX(n) (CODEC_HEADER + CODEC_BOUND(n))
+
+/* What the codec did on a connection */
+struct codec_stats
+{
+	uint64_t raw, wire;							//payload bytes before and after the codec
+	uint64_t ns;								//time spent compressing and decompressing
+};
+
+static inline uint64_t codec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t codec_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned codec_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - CODEC_HASH_LOG);
+}
+
+/* An LZ4 length continuation: 255, 255, ..., rest */
+static inline unsigned char *codec_put_length(unsigned char *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)n;
+	return op;
+}
+
+/* One sequence: literals [anchor, anchor + lit), then a match (mlen 0: none, end of block) */
+static inline unsigned char *codec_sequence(unsigned char *op, const unsigned char *anchor, size_t lit,
+											size_t offset, size_t mlen)
+{
+	unsigned char *token = op++;
+
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = codec_put_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (mlen == 0)
+		return op;
+	*op++ = offset & 255;
+	*op++ = offset >> 8;
+	mlen -= CODEC_MIN_MATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = codec_put_length(op, mlen - 15);
+	return op;
+}
+
+/* Compress len bytes of in into out (CODEC_BOUND(len) bytes); returns the block's size */
+static inline size_t codec_compress(const char *in, size_t len, char *out)
+{
+	uint32_t table[1 << CODEC_HASH_LOG];
+	const unsigned char *base = (const unsigned char *)in, *ip = base, *anchor = base, *ref;
+	const unsigned char *end = base + len, *mflimit = end - CODEC_MF_LIMIT, *matchlimit = end - CODEC_LAST_LITERALS;
+	unsigned char *op = (unsigned char *)out;
+	unsigned h, misses = 0;
+	size_t mlen;
+
+	if (len > CODEC_MF_LIMIT)
+	{
+		memset(table, 0, sizeof(table));
+		while (ip < mflimit)
+		{
+			h = codec_hash(codec_read32(ip));
+			ref = base + table[h];
+			table[h] = ip - base;
+			if (ref >= ip || ip - ref > CODEC_MAX_OFFSET || codec_read32(ref) != codec_read32(ip))
+			{
+				/* skip faster through data that does not compress */
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			for (mlen = CODEC_MIN_MATCH; ip + mlen < matchlimit && ip[mlen] == ref[mlen]; mlen++)
+				;
+			op = codec_sequence(op, anchor, ip - anchor, ip - ref, mlen);
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+	op = codec_sequence(op, anchor, end - anchor, 0, 0);
+	return op - (unsigned char *)out;
+}
+
+/* Decompress an LZ4 block of inlen bytes that must give exactly outlen bytes; 0 or -1 */
+static inline int codec_decompress(const char *in, size_t inlen, char *out, size_t outlen)
+{
+	const unsigned char *ip = (const unsigned char *)in, *iend = ip + inlen;
+	unsigned char *op = (unsigned char *)out, *oend = op + outlen, *ref;
+	size_t lit, mlen, offset;
+	unsigned token, b;
+
+	while (ip < iend)
+	{
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15)
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				lit += b = *ip++;
+			} while (b == 255);
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;					//the last sequence has no match
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (unsigned char *)out))
+			return -1;
+		mlen = token & 15;
+		if (mlen == 15)
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				mlen += b = *ip++;
+			} while (b == 255);
+		mlen += CODEC_MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+		/* byte by byte: the match may overlap what it is producing */
+		for (ref = op - offset; mlen > 0; mlen--)
+			*op++ = *ref++;
+	}
+	return op == oend ? 0 : -1;
+}
+
+/* Build the codec frame of a payload in frame (CODEC_FRAME_MAX(len) bytes); returns its size */
+static inline size_t codec_encode(const char *raw, size_t len, size_t threshold, char *frame, struct codec_stats *st)
+{
+	uint64_t t0 = codec_now();
+	uint32_t v;
+	size_t stored = len;
+
+	if (len >= threshold && (stored = codec_compress(raw, len, frame + CODEC_HEADER)) >= len)
+		stored = len;
+	if (stored == len)
+		memcpy(frame + CODEC_HEADER, raw, len);
+	v = htonl(len);
+	memcpy(frame, &v, sizeof(v));
+	v = htonl(stored);
+	memcpy(frame + sizeof(v), &v, sizeof(v));
+	st->raw += len;
+	st->wire += CODEC_HEADER + stored;
+	st->ns += codec_now() - t0;
+	return CODEC_HEADER + stored;
+}
+
+/* Lengths from a codec frame header; -1 when they make no sense for a payload of at most max bytes */
+static inline int codec_header(const char *frame, size_t max, size_t *rawlen, size_t *stored)
+{
+	uint32_t v;
+
+	memcpy(&v, frame, sizeof(v));
+	*rawlen = ntohl(v);
+	memcpy(&v, frame + sizeof(v), sizeof(v));
+	*stored = ntohl(v);
+	return *rawlen > max || *stored > *rawlen ? -1 : 0;
+}
+
+/* Turn the stored bytes of a frame back into the rawlen-byte payload; 0 or -1 */
+static inline int codec_decode(const char *stored, size_t storedlen, char *raw, size_t rawlen, struct codec_stats *st)
+{
+	uint64_t t0 = codec_now();
+	int ret = 0;
+
+	if (storedlen == rawlen)
+		memcpy(raw, stored, rawlen);
+	else
+		ret = codec_decompress(stored, storedlen, raw, rawlen);
+	st->raw += rawlen;
+	st->wire += CODEC_HEADER + storedlen;
+	st->ns += codec_now() - t0;
+	return ret;
+}
+
+#endif /* CODEC_H */
@@ -0,0 +1,521 @@
+/*
+Shared document store: upload a large document once, transform it by
+handle from any session (mainserver -D, client options 6 to 9).
+
+A sentence lives in the messagein buffer of the session that received
+it, so another connection, or the same client after a reconnect, has to
+send it again. A stored document instead belongs to the master: the
+client uploads it once and gets back a handle, the 64-bit hash of its
+content in 16 hex digits, which any session accepts from then on.
+Storage is content-addressed: uploading the same bytes again (from any
+client) stores nothing new and returns the same handle. Two different
+documents with the same hash cannot both be stored; the second upload
+is refused.
+
+Every document is a file named by its handle, so sessions read it with
+an ordinary fd (and can splice it to the client, see zerocopy.h). The
+index of the documents is one shared memory block mapped before the
+first fork and guarded by a process-shared robust mutex, like the
+admission state (admission.h). Documents are kept in two tiers:
+
+	memory	a directory on tmpfs (/dev/shm), at most -D bytes in all
+	disk	the spill directory (-E, default docs.spill)
+
+Every upload counts one reference, every release (option 8) drops one.
+When a new document does not fit the memory budget, the least recently
+used documents make room: those nobody holds a reference to are
+deleted, the others are moved to disk. A document larger than the whole
+budget goes to disk directly. Documents without references stay (as a
+cache of uploads) until room is needed, and a session that has a
+document open keeps reading it even when it is moved or deleted
+meanwhile. Documents on disk are not moved back: the page cache keeps
+the busy ones in memory anyway. Both directories are emptied when the
+master starts; the documents live as long as the master.
+
+On the wire:
+	upload		"6 <bytes>", then the document (through the codec when
+				negotiated, as a batch payload); the answer is
+				"DOC <handle> <bytes>\n"
+	transform	"7 <handle>" (or "7 <handle> <priority> <deadline_ms>"),
+				then the chain frame; the answer is "DOC <bytes>\n"
+				and the transformed document. An empty chain sends
+				the document as stored
+	release		"8 <handle>"; the answer is "DOC <handle> <references left>\n"
+	range		"9 <handle> <from> <to>" (or with <priority> <deadline_ms>), then
+				the chain frame; the answer is "DOC <bytes>\n" and bytes
+				[from, to) of the transformed document (see rangeread.h)
+Any of them can be answered "ERROR\n" (no store, unknown handle, too
+large, store full); a transform also BUSY or EXPIRED.
+
+A document can have one sidecar file, for an index the master derives
+from it when it is stored (see rangeread.h). Sidecars are small, always
+stay in the memory directory, and go when their document goes.
+
+Usage:
+	docstore_init(budget, spilldir, tag);		//parent, before forking
+	docstore_put(data, len, &hash);				//1 stored, 0 stored already, -1; either way a reference
+	docstore_attach(hash, index, indexlen);		//after a 1 from docstore_put()
+	fd = docstore_open(hash, &len);				//-1: no such document
+	fd = docstore_open_sidecar(hash);			//-1: none (yet)
+	docstore_read(fd, dst, offset, len);		//0, or -1
+	refs = docstore_release(hash);				//-1: no such document
+*/
+
+#ifndef DOCSTORE_H
+#define DOCSTORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+/* Manifest constants */
+#define DOCSTORE_MAX_DOCS 4096				/* documents stored at once; a power of two */
+#define DOCSTORE_MAX_BYTES (64 << 20)		/* one document, as the largest pooled buffer */
+#define DOCSTORE_MEMORY_DIR "/dev/shm"		/* the memory tier is a directory in here */
+#define DOCSTORE_SPILL_DIR "docs.spill"		/* default disk tier */
+#define DOCSTORE_SIDECAR ".idx"				/* what the master derives from a document, next to it */
+#define DOCSTORE_DIR 160					/* bytes of a tier's directory name */
+#define DOCSTORE_PATH (DOCSTORE_DIR + 64)
+#define DOC_REPLY "DOC"						/* "DOC <handle> <bytes>\n", "DOC <bytes>\n" */
+#define DOC_ERROR_MESSAGE "ERROR\n"
+
+/* Tiers; an entry that was deleted stays DOC_GONE so the probe chains behind it hold */
+#define DOC_FREE 0
+#define DOC_MEMORY 1
+#define DOC_DISK 2
+#define DOC_GONE 3
+
+struct doc_entry
+{
+	uint64_t hash;						//the handle
+	uint64_t len;
+	int tier;
+	int refs;							//uploads not yet released
+	uint64_t lastuse;					//docstore clock of the last upload or read
+};
+
+struct docstore
+{
+	pthread_mutex_t lock;
+	uint64_t budget;					//bytes the memory tier holds at most
+	uint64_t inmemory, ondisk;			//bytes in each tier
+	uint64_t clock;
+	char dir[DOC_DISK + 1][DOCSTORE_DIR];	//directory of each tier
+
+	/* counters */
+	uint64_t uploads;					//documents stored
+	uint64_t deduped;					//uploads of content already stored
+	uint64_t reads;						//documents opened by handle
+	uint64_t spilled;					//moved from memory to disk
+	uint64_t dropped;					//deleted to make room
+
+	struct doc_entry doc[DOCSTORE_MAX_DOCS];
+};
+
+static struct docstore *docs;			//shared by the parent and every session child; NULL: off
+
+static inline void docstore_lock(void)
+{
+	if (pthread_mutex_lock(&docs->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&docs->lock);
+}
+
+static inline void docstore_unlock(void)
+{
+	pthread_mutex_unlock(&docs->lock);
+}
+
+/* FNV-1a over 8-byte words (then the tail bytes), finished with the splitmix64 mixer;
+the handle of the content */
+static inline uint64_t docstore_hash(const char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ len, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for (; i < len; i++)
+		h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+/* The handle in hex, as the client sees it; 0, or -1 when s is not one */
+static inline int docstore_parse(const char *s, uint64_t *hash)
+{
+	char *end;
+
+	errno = 0;
+	*hash = strtoull(s, &end, 16);
+	return end == s || *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+static inline void docstore_path(char *path, int tier, uint64_t hash, const char *suffix)
+{
+	snprintf(path, DOCSTORE_PATH, "%s/%016llx%s", docs->dir[tier], (unsigned long long)hash, suffix);
+}
+
+/* Delete every file in dir, making it first if need be; 0, or -1 */
+static inline int docstore_clear(const char *dir)
+{
+	struct dirent *e;
+	char path[DOCSTORE_DIR + sizeof(e->d_name) + 1];
+	DIR *d;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return -1;
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while ((e = readdir(d)) != NULL)
+		if (e->d_name[0] != '.')
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+			unlink(path);
+		}
+	closedir(d);
+	return 0;
+}
+
+/* Map the shared index and set up both tiers; the memory tier is named after tag (the
+master's port) so several masters can run side by side. Call once, before forking. */
+static inline int docstore_init(uint64_t budget, const char *spilldir, int tag)
+{
+	pthread_mutexattr_t ma;
+
+	docs = mmap(NULL, sizeof(struct docstore), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (docs == MAP_FAILED)
+	{
+		docs = NULL;
+		return -1;
+	}
+	memset(docs, 0, sizeof(*docs));
+	docs->budget = budget;
+	snprintf(docs->dir[DOC_MEMORY], DOCSTORE_DIR, "%s/transform-docs.%d", DOCSTORE_MEMORY_DIR, tag);
+	snprintf(docs->dir[DOC_DISK], DOCSTORE_DIR, "%s", spilldir != NULL ? spilldir : DOCSTORE_SPILL_DIR);
+	if (docstore_clear(docs->dir[DOC_MEMORY]) == -1 || docstore_clear(docs->dir[DOC_DISK]) == -1)
+	{
+		munmap(docs, sizeof(*docs));
+		docs = NULL;
+		return -1;
+	}
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&docs->lock, &ma);
+	return 0;
+}
+
+/* Entry of hash, or -1; with a lock held */
+static inline int docstore_find(uint64_t hash)
+{
+	uint32_t i, k;
+
+	for (k = 0, i = hash & (DOCSTORE_MAX_DOCS - 1); k < DOCSTORE_MAX_DOCS; k++, i = (i + 1) & (DOCSTORE_MAX_DOCS - 1))
+	{
+		if (docs->doc[i].tier == DOC_FREE)
+			return -1;
+		if (docs->doc[i].tier != DOC_GONE && docs->doc[i].hash == hash)
+			return i;
+	}
+	return -1;
+}
+
+/* Entry where hash goes (not stored yet), or -1 when the index is full */
+static inline int docstore_slot(uint64_t hash)
+{
+	uint32_t i, k;
+
+	for (k = 0, i = hash & (DOCSTORE_MAX_DOCS - 1); k < DOCSTORE_MAX_DOCS; k++, i = (i + 1) & (DOCSTORE_MAX_DOCS - 1))
+		if (docs->doc[i].tier == DOC_FREE || docs->doc[i].tier == DOC_GONE)
+			return i;
+	return -1;
+}
+
+/* Delete document i */
+static inline void docstore_drop(int i)
+{
+	struct doc_entry *d = &docs->doc[i];
+	char path[DOCSTORE_PATH];
+
+	docstore_path(path, d->tier, d->hash, "");
+	unlink(path);
+	docstore_path(path, DOC_MEMORY, d->hash, DOCSTORE_SIDECAR);
+	unlink(path);
+	if (d->tier == DOC_MEMORY)
+		docs->inmemory -= d->len;
+	else
+		docs->ondisk -= d->len;
+	d->tier = DOC_GONE;
+	docs->dropped++;
+}
+
+/* Copy document i from memory to disk; 0, or -1 (it is then still in memory) */
+static inline int docstore_spill(int i)
+{
+	struct doc_entry *d = &docs->doc[i];
+	char from[DOCSTORE_PATH], tmp[DOCSTORE_PATH], to[DOCSTORE_PATH];
+	off_t off = 0;
+	ssize_t n = 0;
+	int in, out;
+
+	docstore_path(from, DOC_MEMORY, d->hash, "");
+	docstore_path(tmp, DOC_DISK, d->hash, ".spill");
+	docstore_path(to, DOC_DISK, d->hash, "");
+	if ((in = open(from, O_RDONLY)) == -1)
+		return -1;
+	if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+	{
+		close(in);
+		return -1;
+	}
+	while ((uint64_t)off < d->len && (n = sendfile(out, in, &off, d->len - off)) > 0)
+		;
+	close(in);
+	if (close(out) == -1 || (uint64_t)off != d->len || rename(tmp, to) == -1)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	unlink(from);
+	d->tier = DOC_DISK;
+	docs->inmemory -= d->len;
+	docs->ondisk += d->len;
+	docs->spilled++;
+	return 0;
+}
+
+/* Least recently used document of tier, among those with no references when unused; -1: none */
+static inline int docstore_lru(int tier, int unused)
+{
+	int i, best = -1;
+
+	for (i = 0; i < DOCSTORE_MAX_DOCS; i++)
+		if (docs->doc[i].tier == tier && (!unused || docs->doc[i].refs == 0) &&
+			(best == -1 || docs->doc[i].lastuse < docs->doc[best].lastuse))
+			best = i;
+	return best;
+}
+
+/* Free len bytes of the memory tier: unreferenced documents are deleted first, then the
+least recently used are spilled; 0, or -1 */
+static inline int docstore_make_room(uint64_t len)
+{
+	int i;
+
+	while (docs->inmemory + len > docs->budget)
+	{
+		if ((i = docstore_lru(DOC_MEMORY, 1)) != -1)
+			docstore_drop(i);
+		else if ((i = docstore_lru(DOC_MEMORY, 0)) == -1 || docstore_spill(i) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Is the file at path exactly the len bytes at data? */
+static inline int docstore_same(const char *path, const char *data, size_t len)
+{
+	char *m;
+	int fd, same;
+
+	if (len == 0)
+		return 1;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return 0;
+	same = memcmp(m, data, len) == 0;
+	munmap(m, len);
+	return same;
+}
+
+/* Write len bytes to a new file at path; 0, or -1 */
+static inline int docstore_write(const char *path, const char *data, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+		return -1;
+	while (done < len && ((n = write(fd, data + done, len - done)) > 0 || (n == -1 && errno == EINTR)))
+		done += n > 0 ? n : 0;
+	if (close(fd) == -1 || done < len)
+	{
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Store the len bytes at data (or find them stored already) and take a reference;
+1 (0 when they were stored already) with *hash set, or -1. The file is written before the lock is taken, into the tier it
+will most likely stay in, and only renamed into place under the lock. */
+static inline int docstore_put(const char *data, size_t len, uint64_t *hash)
+{
+	char tmp[DOCSTORE_PATH], path[DOCSTORE_PATH];
+	int i, tier, r = -1;
+	char suffix[24];
+
+	if (docs == NULL || len > DOCSTORE_MAX_BYTES)
+		return -1;
+	*hash = docstore_hash(data, len);
+	tier = len <= docs->budget ? DOC_MEMORY : DOC_DISK;
+	snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+	docstore_path(tmp, tier, *hash, suffix);
+	if (docstore_write(tmp, data, len) == -1)
+		return -1;
+
+	docstore_lock();
+	if ((i = docstore_find(*hash)) != -1)
+	{
+		/* stored already, or another document with the same hash */
+		docstore_path(path, docs->doc[i].tier, *hash, "");
+		if (docs->doc[i].len == len && docstore_same(path, data, len))
+		{
+			docs->doc[i].refs++;
+			docs->doc[i].lastuse = ++docs->clock;
+			docs->deduped++;
+			r = 0;
+		}
+		unlink(tmp);
+		docstore_unlock();
+		return r;
+	}
+
+	/* a full index gives up the least recently used unreferenced document */
+	if ((i = docstore_slot(*hash)) == -1 &&
+		(docstore_lru(DOC_MEMORY, 1) != -1 || docstore_lru(DOC_DISK, 1) != -1))
+	{
+		i = docstore_lru(DOC_MEMORY, 1);
+		docstore_drop(i != -1 ? i : docstore_lru(DOC_DISK, 1));
+		i = docstore_slot(*hash);
+	}
+	docstore_path(path, tier, *hash, "");
+	if (i == -1 || (tier == DOC_MEMORY && docstore_make_room(len) == -1) || rename(tmp, path) == -1)
+	{
+		unlink(tmp);
+		docstore_unlock();
+		return -1;
+	}
+	docs->doc[i].hash = *hash;
+	docs->doc[i].len = len;
+	docs->doc[i].tier = tier;
+	docs->doc[i].refs = 1;
+	docs->doc[i].lastuse = ++docs->clock;
+	if (tier == DOC_MEMORY)
+		docs->inmemory += len;
+	else
+		docs->ondisk += len;
+	docs->uploads++;
+	docstore_unlock();
+	return 1;
+}
+
+/* Open the stored document hash for reading and set *len; the fd, or -1. The fd stays
+valid when the document is spilled or deleted meanwhile. */
+static inline int docstore_open(uint64_t hash, uint64_t *len)
+{
+	char path[DOCSTORE_PATH];
+	int i, fd = -1;
+
+	if (docs == NULL)
+		return -1;
+	docstore_lock();
+	if ((i = docstore_find(hash)) != -1)
+	{
+		docstore_path(path, docs->doc[i].tier, hash, "");
+		if ((fd = open(path, O_RDONLY)) != -1)
+		{
+			*len = docs->doc[i].len;
+			docs->doc[i].lastuse = ++docs->clock;
+			docs->reads++;
+		}
+	}
+	docstore_unlock();
+	return fd;
+}
+
+/* Read len bytes from offset of an opened document into dst; 0, or -1 */
+static inline int docstore_read(int fd, char *dst, uint64_t offset, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		if ((n = pread(fd, dst + done, len - done, offset + done)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Write the sidecar of document hash; 0, or -1. It is written under a temporary name and
+renamed into place, so a reader finds all of it or none. */
+static inline int docstore_attach(uint64_t hash, const void *data, size_t len)
+{
+	char tmp[DOCSTORE_PATH], path[DOCSTORE_PATH], suffix[24];
+	int r = -1;
+
+	if (docs == NULL)
+		return -1;
+	snprintf(suffix, sizeof(suffix), "%s.%d", DOCSTORE_SIDECAR, (int)getpid());
+	docstore_path(tmp, DOC_MEMORY, hash, suffix);
+	docstore_path(path, DOC_MEMORY, hash, DOCSTORE_SIDECAR);
+	if (docstore_write(tmp, data, len) == -1)
+		return -1;
+	docstore_lock();
+	if (docstore_find(hash) != -1)			//not dropped meanwhile
+		r = rename(tmp, path);
+	docstore_unlock();
+	if (r == -1)
+		unlink(tmp);
+	return r;
+}
+
+/* Open the sidecar of document hash; the fd, or -1 */
+static inline int docstore_open_sidecar(uint64_t hash)
+{
+	char path[DOCSTORE_PATH];
+
+	if (docs == NULL)
+		return -1;
+	docstore_path(path, DOC_MEMORY, hash, DOCSTORE_SIDECAR);
+	return open(path, O_RDONLY);
+}
+
+/* Drop one reference to document hash; the references left, or -1 when it is not stored
+(or has none left to drop) */
+static inline int docstore_release(uint64_t hash)
+{
+	int i, refs = -1;
+
+	if (docs == NULL)
+		return -1;
+	docstore_lock();
+	if ((i = docstore_find(hash)) != -1 && docs->doc[i].refs > 0)
+		refs = --docs->doc[i].refs;
+	docstore_unlock();
+	return refs;
+}
+
+#endif /* DOCSTORE_H */
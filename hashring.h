@@ -0,0 +1,277 @@
+/*
+Consistent-hash routing of chain steps across several nodes (mainserver -N).
+
+A node is a host running microservers in looping mode (./upper.out -l -a
+address -p port), one per transform code it serves. The node list is a
+text file, one node per line:
+
+	# name	address		code=port ...				[weight=w]
+	alpha	127.0.0.2	1=47001 2=47002 3=47003
+	beta	127.0.0.3	1=47001 3=47003 6=47006		weight=2
+
+Every node is put on a 32-bit hash ring at RING_VNODES points per unit of
+weight (virtual nodes), placed by hashing its name, so a node keeps its
+points when its address or ports change (names must therefore differ: two
+lines with the same name would share every point). A step goes to the node owning
+the first point at or after hash(code, input text) that serves the code:
+the same text through the same transform always lands on the same node,
+whose caches stay warm, and when a node joins or leaves only the keys
+between its points and their neighbours move (about 1/n of them).
+
+The ring lives in memory shared by the master and all its sessions. On
+SIGHUP the master re-reads the file into the spare one of two tables and
+then switches to it; a seqlock per table lets a session that looked at a
+table while it was rewritten look again. A list that cannot be read
+keeps the current ring.
+
+Usage:
+	ring = hashring_create();					//before forking
+	hashring_load(ring, path);					//at start and on SIGHUP
+	if (hashring_route(ring, code, text, len, &to) != -1) ...	//to: address and port of the node
+*/
+
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Manifest constants */
+#define RING_MAX_NODES 64
+#define RING_MAX_WEIGHT 4
+#define RING_VNODES 64							/* points per unit of weight */
+#define RING_MAX_POINTS (RING_MAX_NODES * RING_MAX_WEIGHT * RING_VNODES)
+#define RING_CODES 6							/* transform codes 1..6 */
+#define RING_SAMPLES 4096						/* keys compared on reload to report what moved */
+
+struct ring_node
+{
+	char name[32];
+	struct in_addr addr;
+	uint16_t port[RING_CODES + 1];				//UDP port per code, 0: not served here
+	int weight;
+};
+
+struct ring_point
+{
+	uint32_t hash;
+	uint16_t node;
+};
+
+struct ring_table
+{
+	volatile uint32_t seq;						//odd while being written
+	int nnodes, npoints;
+	uint32_t codes;								//bit c: some node serves code c
+	struct ring_node nodes[RING_MAX_NODES];
+	struct ring_point points[RING_MAX_POINTS];
+};
+
+struct hash_ring
+{
+	volatile int active;						//table in use
+	struct ring_table table[2];
+};
+
+/* FNV-1a over bytes, finished with the splitmix64 mixer so nearby keys spread */
+static inline uint32_t hashring_hash(uint64_t seed, const char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return (h ^ (h >> 31)) >> 32;
+}
+
+static int hashring_cmp(const void *a, const void *b)
+{
+	const struct ring_point *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return (x->node > y->node) - (x->node < y->node);
+}
+
+/* Shared, empty ring; NULL when it cannot be mapped */
+static inline struct hash_ring *hashring_create(void)
+{
+	struct hash_ring *r = mmap(NULL, sizeof(struct hash_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	return r == MAP_FAILED ? NULL : r;
+}
+
+/* Node owning key for code in table t, or -1 */
+static inline int hashring_owner(const struct ring_table *t, int code, uint32_t key)
+{
+	int np = t->npoints, lo = 0, hi = np, mid, i, n;	//read once: a reload may be rewriting t
+
+	if (np <= 0 || np > RING_MAX_POINTS || !(t->codes & (1u << code)))
+		return -1;
+	/* first point at or after key; past the last one the ring wraps to the first */
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (t->points[mid].hash < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = 0; i < np; i++)
+	{
+		n = t->points[(lo + i) % np].node;
+		if (t->nodes[n].port[code] != 0)
+			return n;
+	}
+	return -1;
+}
+
+/* Read one node line into n; 0, or -1 when it is malformed */
+static inline int hashring_parse(char *line, struct ring_node *n)
+{
+	char *tok, *save;
+	int code;
+
+	memset(n, 0, sizeof(*n));
+	n->weight = 1;
+	if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL || strlen(tok) >= sizeof(n->name))
+		return -1;
+	strcpy(n->name, tok);
+	if ((tok = strtok_r(NULL, " \t\r\n", &save)) == NULL || inet_pton(AF_INET, tok, &n->addr) != 1)
+		return -1;
+	while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+	{
+		if (strncmp(tok, "weight=", 7) == 0)
+			n->weight = atoi(tok + 7);
+		else if (tok[0] >= '1' && tok[0] <= '0' + RING_CODES && tok[1] == '=')
+		{
+			code = tok[0] - '0';
+			n->port[code] = atoi(tok + 2);
+		}
+		else
+			return -1;
+	}
+	return n->weight >= 1 && n->weight <= RING_MAX_WEIGHT ? 0 : -1;
+}
+
+/* Is name already taken by one of the first n nodes of t? */
+static inline int hashring_named(const struct ring_table *t, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(t->nodes[i].name, name) == 0)
+			return 1;
+	return 0;
+}
+
+/* (Re)load the node list into the spare table and switch to it; returns the number of
+nodes, or -1 (the ring in use stays) when the file cannot be read or has a bad line */
+static inline int hashring_load(struct hash_ring *r, const char *path)
+{
+	struct ring_table *old = &r->table[r->active], *t = &r->table[!r->active];
+	char line[512], vname[64];
+	int lineno = 0, i, v, code, moved = 0, total = 0, a, b;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "ring: cannot open node list %s\n", path);
+		return -1;
+	}
+	__atomic_add_fetch(&t->seq, 1, __ATOMIC_RELEASE);
+	t->nnodes = t->npoints = 0;
+	t->codes = 0;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+			continue;
+		if (t->nnodes == RING_MAX_NODES || hashring_parse(line, &t->nodes[t->nnodes]) == -1 ||
+			hashring_named(t, t->nnodes, t->nodes[t->nnodes].name))
+		{
+			fprintf(stderr, "ring: %s line %d: bad node, name used twice, or more than %d nodes\n", path, lineno,
+					RING_MAX_NODES);
+			fclose(fp);
+			__atomic_add_fetch(&t->seq, 1, __ATOMIC_RELEASE);
+			return -1;
+		}
+		for (code = 1; code <= RING_CODES; code++)
+			if (t->nodes[t->nnodes].port[code] != 0)
+				t->codes |= 1u << code;
+		for (v = 0; v < t->nodes[t->nnodes].weight * RING_VNODES; v++)
+		{
+			snprintf(vname, sizeof(vname), "%s#%d", t->nodes[t->nnodes].name, v);
+			t->points[t->npoints].hash = hashring_hash(0, vname, strlen(vname));
+			t->points[t->npoints].node = t->nnodes;
+			t->npoints++;
+		}
+		t->nnodes++;
+	}
+	fclose(fp);
+	qsort(t->points, t->npoints, sizeof(struct ring_point), hashring_cmp);
+	__atomic_add_fetch(&t->seq, 1, __ATOMIC_RELEASE);
+
+	/* how much of the key space changed owner (by node name) */
+	for (code = 1; code <= RING_CODES; code++)
+		for (i = 0; i < RING_SAMPLES; i++)
+		{
+			a = hashring_owner(old, code, (uint32_t)((uint64_t)i * 0x100000000ULL / RING_SAMPLES));
+			b = hashring_owner(t, code, (uint32_t)((uint64_t)i * 0x100000000ULL / RING_SAMPLES));
+			if (a == -1 && b == -1)
+				continue;
+			total++;
+			moved += a == -1 || b == -1 || strcmp(old->nodes[a].name, t->nodes[b].name) != 0;
+		}
+	__atomic_store_n(&r->active, !r->active, __ATOMIC_RELEASE);
+	if (old->nnodes == 0)
+		fprintf(stderr, "ring: %d nodes, %d points from %s\n", t->nnodes, t->npoints, path);
+	else
+		fprintf(stderr, "ring: %d nodes, %d points from %s; %.1f%% of the keys moved\n", t->nnodes, t->npoints, path,
+				total ? 100.0 * moved / total : 0.0);
+	return t->nnodes;
+}
+
+/* Does any node serve code? */
+static inline int hashring_serves(struct hash_ring *r, int code)
+{
+	return r != NULL && (r->table[__atomic_load_n(&r->active, __ATOMIC_ACQUIRE)].codes & (1u << code));
+}
+
+/* Node for a step of code on text; fills in to's address and port. Returns the node, or -1 */
+static inline int hashring_route(struct hash_ring *r, int code, const char *text, int len, struct sockaddr_in *to)
+{
+	const struct ring_table *t;
+	uint32_t seq, key = hashring_hash(code, text, len);
+	struct in_addr addr;
+	uint16_t port = 0;
+	int n;
+
+	if (r == NULL)
+		return -1;
+	do
+	{
+		t = &r->table[__atomic_load_n(&r->active, __ATOMIC_ACQUIRE)];
+		seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		if ((n = hashring_owner(t, code, key)) != -1)
+		{
+			addr = t->nodes[n].addr;
+			port = t->nodes[n].port[code];
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE));
+	if (n == -1)
+		return -1;
+	to->sin_addr = addr;
+	to->sin_port = htons(port);
+	return n;
+}
+
+#endif /* HASHRING_H */
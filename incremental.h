@@ -0,0 +1,144 @@
+/*
+Incremental re-transformation of an edited sentence.
+
+When a client re-enters a sentence that differs from the previous one
+in a few words, the chain results cached for the old sentence (see
+chaincache.h) are carried over instead of recomputed: the new text is
+diffed against the old one, only a fragment around the edit is sent
+through each step, and the step's answer is spliced into the old output.
+
+The splice rules follow from the transforms themselves:
+	identity, upper, lower, caesar	every character maps to one of the same
+				length in the same place (utf8.h); the fragment is the
+				edited range, spliced at the same place
+	reverse		the edited range comes back reversed, at the mirrored
+				place: the input's unchanged suffix is the output's prefix
+				(reverse keeps each character's bytes in order, so this
+				holds for UTF-8 text)
+	yours		every second character becomes Z, and a space makes the
+				next character the one that counts; which characters
+				count can shift past the edit, so the fragment runs on
+				until the new and the old text count the same positions
+				again, and starts with a space when its first character
+				is one that counts (the kernel never looks at index 0)
+
+A plugin serving one of these codes must keep its semantics. Whatever
+does not fit these rules (a result of the wrong length, a fragment too
+long for a frame) is recomputed on the whole text.
+*/
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <string.h>
+#include <ctype.h>
+
+/* old[start, oldend) was replaced by new[start, newend); the rest is equal */
+struct text_edit
+{
+	int start, oldend, newend;
+};
+
+/* The part of the new input a step has to see again */
+struct fragment
+{
+	int start, end;						//range of the new input
+	int pad;							//characters put in front of it (yours)
+};
+
+/* Is byte i of t inside a UTF-8 character rather than at its start? */
+static inline int text_midchar(const char *t, int len, int i)
+{
+	return i < len && ((unsigned char)t[i] & 0xC0) == 0x80;
+}
+
+/* Common prefix and suffix of a and b, ending and starting on whole UTF-8 characters
+(a fragment never splits one); returns 0 when they are equal */
+static inline int text_diff(const char *a, int alen, const char *b, int blen, struct text_edit *e)
+{
+	int p = 0, s = 0, min = alen < blen ? alen : blen;
+
+	while (p < min && a[p] == b[p])
+		p++;
+	while (p > 0 && (text_midchar(a, alen, p) || text_midchar(b, blen, p)))
+		p--;
+	while (s < min - p && a[alen - 1 - s] == b[blen - 1 - s])
+		s++;
+	while (s > 0 && text_midchar(a, alen, alen - s))
+		s--;
+	e->start = p;
+	e->oldend = alen - s;
+	e->newend = blen - s;
+	return !(p == alen && p == blen);
+}
+
+/* Index the yours kernel looks at after index i of t */
+static inline int yours_next(const char *t, int i)
+{
+	return isspace((unsigned char)t[i]) ? i + 1 : i + 2;
+}
+
+/* Fragment of newin that step code has to recompute after edit e of its input;
+returns 0, or -1 when code has no splice rule */
+static inline int incr_fragment(int code, const char *oldin, int oldlen, const char *newin, int newlen,
+								const struct text_edit *e, struct fragment *f)
+{
+	int n, nn, no, delta = newlen - oldlen;
+
+	f->start = e->start;
+	f->end = e->newend;
+	f->pad = 0;
+	if (code == 1 || code == 2 || code == 3 || code == 4 || code == 5)
+		return 0;
+	if (code != 6)
+		return -1;
+
+	/* yours: does the kernel look at the fragment's first character? */
+	for (n = 1; n < e->start; n = yours_next(newin, n))
+		;
+	f->pad = n == e->start;
+
+	/* run both scans past the edit, then until they look at the same places */
+	for (nn = n; nn < e->newend; nn = yours_next(newin, nn))
+		;
+	for (no = n; no < e->oldend; no = yours_next(oldin, no))
+		;
+	while (nn < newlen && no < oldlen && nn - delta != no)
+	{
+		if (nn - delta < no)
+			nn = yours_next(newin, nn);
+		else
+			no = yours_next(oldin, no);
+	}
+	f->end = nn < newlen && no < oldlen ? nn : newlen;
+	return 0;
+}
+
+/* Build the step's new output from its old output and the fragment's result r;
+returns the new output's length, or -1 when r does not fit the rule */
+static inline int incr_splice(int code, const char *oldout, int oldlen, int newlen, const struct text_edit *e,
+							  const struct fragment *f, const char *r, int rlen, char *newout)
+{
+	int delta = newlen - oldlen, tail;
+
+	if (rlen != f->end - f->start || f->end - delta > oldlen)
+		return -1;
+	if (code == 2)
+	{
+		/* reverse: unchanged suffix of the input leads the output */
+		tail = oldlen - e->oldend;
+		memcpy(newout, oldout, tail);
+		memcpy(newout + tail, r, rlen);
+		memcpy(newout + tail + rlen, oldout + oldlen - e->start, e->start);
+	}
+	else
+	{
+		memcpy(newout, oldout, f->start);
+		memcpy(newout + f->start, r, rlen);
+		memcpy(newout + f->end, oldout + f->end - delta, newlen - f->end);
+	}
+	newout[newlen] = '\0';
+	return newlen;
+}
+
+#endif /* INCREMENTAL_H */
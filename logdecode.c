@@ -0,0 +1,208 @@
+/*
+Decoder for the binary log written by the master server and the
+microservers (see binlog.h). Prints the records still in the ring,
+oldest first, as text.
+
+Usage:
+	./logdecode.out [-f] [-l level] [logfile]
+		logfile		log to read (default servers.blog)
+		-f		keep following the log, like tail -f
+		-l level	set the log level of every process writing this log
+				(0 off, 1 error, 2 warn, 3 info, 4 debug) and exit
+*/
+
+/* Include files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "binlog.h"
+
+static const char *levelnames[] = {"OFF", "ERROR", "WARN", "INFO", "DEBUG"};
+
+/* Print one record the way the servers used to printf it */
+static void print_record(const struct binlog_record *r)
+{
+	char text[BINLOG_STRLEN + 1];
+	char when[32];
+	struct in_addr ip;
+	time_t sec = r->time_ns / 1000000000ULL;
+	struct tm tm;
+
+	memcpy(text, r->s, BINLOG_STRLEN);
+	text[BINLOG_STRLEN] = '\0';
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%H:%M:%S", &tm);
+	printf("%s.%06llu %6u %-5s ", when, (unsigned long long)(r->time_ns % 1000000000ULL) / 1000,
+		   r->pid, r->level <= BL_DEBUG ? levelnames[r->level] : "?");
+
+	switch (r->event)
+	{
+	case EV_SESSION_START:
+		printf("Master Server Created child process %llu to handle new client\n", (unsigned long long)r->a);
+		break;
+	case EV_SENTENCE:
+		printf("Sentence received (%llu bytes): \"%s\"\n", (unsigned long long)r->a, text);
+		break;
+	case EV_CHAIN:
+		printf("Child process received requested transformation: %s\n", text);
+		break;
+	case EV_STEP_SENT:
+		printf("Sent %llu bytes to microserver %llu on UDP port %llu\n", (unsigned long long)r->c,
+			   (unsigned long long)r->a, (unsigned long long)r->b);
+		break;
+	case EV_STEP_ANSWER:
+		printf("Answer from microserver %llu received by master server (%llu bytes): %s\n",
+			   (unsigned long long)r->a, (unsigned long long)r->b, text);
+		break;
+	case EV_RESPONSE:
+		printf("Child about to send message to TCP client (%llu bytes): %s\n", (unsigned long long)r->a, text);
+		break;
+	case EV_MS_RECEIVED:
+		ip.s_addr = (in_addr_t)r->b;
+		printf("Microserver received %llu bytes \"%s\" from IP %s port %llu\n", (unsigned long long)r->a,
+			   text, inet_ntoa(ip), (unsigned long long)r->c);
+		break;
+	case EV_MS_SENT:
+		printf("Microserver sending back %llu bytes to master: \"%s\"\n", (unsigned long long)r->a, text);
+		break;
+	case EV_STEP_INPROC:
+		printf("Transform %llu ran in-process (%llu bytes): %s\n", (unsigned long long)r->a,
+			   (unsigned long long)r->b, text);
+		break;
+	case EV_CACHE_HIT:
+		printf("Chain %s resumes after %llu of %llu steps from the cache\n", text, (unsigned long long)r->a,
+			   (unsigned long long)r->b);
+		break;
+	case EV_REBASE:
+		printf("Edited sentence carried over: %llu steps sent %llu bytes instead of %llu\n", (unsigned long long)r->a,
+			   (unsigned long long)r->b, (unsigned long long)r->c);
+		break;
+	case EV_BATCH:
+		printf("Batch of %llu documents (%llu bytes) through chain %s: %llu datagrams\n", (unsigned long long)r->a,
+			   (unsigned long long)r->b, text, (unsigned long long)r->c);
+		break;
+	case EV_COALESCED:
+		printf("Chain %s answered from another session's flight; %llu requests joined, %llu dispatched, %llu steps saved so far\n",
+			   text, (unsigned long long)r->a, (unsigned long long)r->b, (unsigned long long)r->c);
+		break;
+	case EV_LOWLAT:
+		printf("%s low-latency receives: spun %.3f ms (%llu answered while spinning), slept %.3f ms (%llu times)\n", text,
+			   r->a / 1e6, (unsigned long long)(r->c >> 32), r->b / 1e6, (unsigned long long)(r->c & 0xffffffff));
+		break;
+	case EV_SCALE:
+		printf("Pool of code %llu now %llu replicas (%s): %.2f steps in the system, %.3f ms per step\n",
+			   (unsigned long long)r->a, (unsigned long long)r->b, text, (r->c >> 32) / 1000.0, (r->c & 0xffffffff) / 1000.0);
+		break;
+	case EV_POOL:
+		printf("Buffers: %llu used, %llu taken from the heap, %llu of those after the first request\n",
+			   (unsigned long long)r->c, (unsigned long long)r->a, (unsigned long long)r->b);
+		break;
+	case EV_ZEROCOPY:
+		printf("Zero-copy: %llu sends, %llu bytes, %llu of the sends copied by the kernel after all\n",
+			   (unsigned long long)r->a, (unsigned long long)r->b, (unsigned long long)r->c);
+		break;
+	case EV_DOC_STORED:
+		printf("Document %s: %llu bytes, %s; %llu bytes in memory, %llu documents spilled so far\n", text,
+			   (unsigned long long)r->a, r->b ? "stored" : "stored already", (unsigned long long)(r->c >> 32),
+			   (unsigned long long)(r->c & 0xffffffff));
+		break;
+	case EV_DOC_RUN:
+		printf("Document of %llu bytes through %s: %llu datagrams, verdict %lld\n", (unsigned long long)r->a, text,
+			   (unsigned long long)r->b, (long long)r->c);
+		break;
+	case EV_DOC_RANGE:
+		printf("Range of %llu bytes through %s: steps ran over %llu bytes, %llu datagrams\n", (unsigned long long)r->a,
+			   text, (unsigned long long)r->b, (unsigned long long)r->c);
+		break;
+	case EV_PLAN:
+		printf("Planner ran %llu steps %s in %.3f ms, predicted %.1f%% off on average\n", (unsigned long long)r->a, text,
+			   r->b / 1e6, r->b ? 100.0 * r->c / r->b : 0.0);
+		break;
+	case EV_CODEC:
+		printf("Codec %s: %llu payload bytes sent as %llu (%.1f%%) in %.3f ms so far\n", text, (unsigned long long)r->a,
+			   (unsigned long long)r->b, r->a ? 100.0 * r->b / r->a : 100.0, r->c / 1e6);
+		break;
+	default:
+		printf("event %u: %llu %llu %llu \"%s\"\n", r->event, (unsigned long long)r->a,
+			   (unsigned long long)r->b, (unsigned long long)r->c, text);
+	}
+}
+
+/* Print records [from, head) that are complete; returns the new position */
+static uint64_t print_from(uint64_t from)
+{
+	uint64_t head = __atomic_load_n(&binlog->hdr.head, __ATOMIC_ACQUIRE);
+	struct binlog_record copy;
+	const struct binlog_record *r;
+
+	/* older records have already been overwritten */
+	if (head - from > BINLOG_RECORDS)
+		from = head - BINLOG_RECORDS;
+
+	for (; from < head; from++)
+	{
+		r = &binlog->rec[from & (BINLOG_RECORDS - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != from + 1)
+		{
+			/* still being written; a follower retries it on the next pass */
+			if (head - from < BINLOG_RECORDS / 2)
+				break;
+			continue;
+		}
+		memcpy(&copy, r, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != from + 1)
+			continue;				//overwritten while copying
+		print_record(&copy);
+	}
+	fflush(stdout);
+	return from;
+}
+
+/* Main program of the decoder */
+int main(int argc, char *argv[])
+{
+	const char *path = BINLOG_DEFAULT_FILE;
+	int follow = 0, setlevel = -1, opt;
+	uint64_t pos = 0;
+
+	while ((opt = getopt(argc, argv, "fl:")) != -1)
+	{
+		if (opt == 'f')
+			follow = 1;
+		else if (opt == 'l')
+			setlevel = atoi(optarg);
+		else
+		{
+			fprintf(stderr, "usage: %s [-f] [-l level] [logfile]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+
+	if (access(path, F_OK) == -1 || binlog_open(path) == -1)
+	{
+		fprintf(stderr, "logdecode: cannot open log %s\n", path);
+		exit(1);
+	}
+
+	if (setlevel >= 0)
+	{
+		binlog->hdr.level = setlevel;
+		printf("log level of %s set to %d\n", path, setlevel);
+		exit(0);
+	}
+
+	for (;;)
+	{
+		pos = print_from(pos);
+		if (!follow)
+			break;
+		usleep(100000);
+	}
+	exit(0);
+}
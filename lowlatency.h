@@ -0,0 +1,320 @@
+/*
+Low-latency operating mode of the master server and the microservers (-R spec).
+
+For a tier that would rather burn CPU than wait on the scheduler, every
+process of the pipeline can be set up for tail latency at startup:
+
+	cpus=2,4-6		pin to these cores: a microserver and the master's
+					accepting parent run on the whole set, each session
+					child on one core of it, round-robin in accept order
+	busy=usec		SO_BUSY_POLL on the service sockets: a blocking
+					receive polls the device queue for this long first
+	spin=usec		receive by polling the socket (MSG_DONTWAIT) for up to
+					this long before going to sleep in poll(); 0 spins
+					forever (default 1000)
+	lock			mlockall() current and future memory, pre-fault the
+					stack and keep freed heap mapped, so the hot path
+					never takes a page fault
+	fifo=prio		SCHED_FIFO real-time class at this priority (1-99)
+
+Items are separated by ':', e.g. -R cpus=2-5:busy=50:spin=200:lock:fifo=10.
+What the kernel refuses (mlockall and SCHED_FIFO need privileges or
+rlimits) is reported and the rest stays in effect.
+
+Memory locks are not inherited across fork(), so each session child
+enters the mode again. The master's sessions receive on plain syscalls
+in this mode, as with -P: a spinning receive needs a socket it can poll,
+not a ring to wait on.
+
+Each process accounts the time its receives spent spinning and sleeping
+and logs it (EV_LOWLAT) every LOWLAT_REPORT_NS and when it ends.
+
+Usage:
+	lowlat_parse(spec);							//-R; 0 or -1
+	lowlat_enter(index, who);					//per process; index -1: the whole cpu set
+	lowlat_socket(s);							//each service socket
+	n = lowlat_recvfrom(s, buf, len, 0, from, &fromlen);	//instead of recvfrom()
+	lowlat_report(1);							//process end
+	lowlat_report_on_signal();					//or when killed (SIGINT, SIGTERM)
+*/
+
+#ifndef LOWLATENCY_H
+#define LOWLATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "binlog.h"
+
+/* Manifest constants */
+#define LOWLAT_MAX_CPUS 1024
+#define LOWLAT_DEFAULT_SPIN_US 1000
+#define LOWLAT_STACK_PREFAULT (256 * 1024)		/* stack touched once by lock */
+#define LOWLAT_REPORT_NS 10000000000ULL			/* spin/sleep totals logged this often */
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+struct lowlat
+{
+	int on;									//-R given
+	int ncpus;
+	int cpus[LOWLAT_MAX_CPUS];
+	int busypoll;							//SO_BUSY_POLL microseconds, 0: not set
+	int spinus;								//spin budget per receive, 0: no limit
+	int lock;								//mlockall and pre-fault
+	int fifo;								//SCHED_FIFO priority, 0: normal class
+	const char *who;						//name in the log
+
+	/* this process's receives */
+	uint64_t spin_ns, sleep_ns;
+	uint64_t spinhits;						//answered while spinning
+	uint64_t sleeps;						//went to sleep in poll()
+	uint64_t reported;						//last EV_LOWLAT
+};
+
+static struct lowlat lowlat = {.spinus = LOWLAT_DEFAULT_SPIN_US};
+
+static inline uint64_t lowlat_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void lowlat_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* "2,4-6" into the cpu list; 0 or -1 */
+static inline int lowlat_parse_cpus(const char *s)
+{
+	char *end;
+	long a, b;
+
+	lowlat.ncpus = 0;
+	while (*s != '\0')
+	{
+		a = b = strtol(s, &end, 10);
+		if (end == s || a < 0 || a >= LOWLAT_MAX_CPUS)
+			return -1;
+		s = end;
+		if (*s == '-')
+		{
+			b = strtol(s + 1, &end, 10);
+			if (end == s + 1 || b < a || b >= LOWLAT_MAX_CPUS)
+				return -1;
+			s = end;
+		}
+		for (; a <= b; a++)
+			if (lowlat.ncpus < LOWLAT_MAX_CPUS)
+				lowlat.cpus[lowlat.ncpus++] = a;
+		if (*s == ',')
+			s++;
+		else if (*s != '\0')
+			return -1;
+	}
+	return lowlat.ncpus > 0 ? 0 : -1;
+}
+
+/* Read the -R spec; 0, or -1 when an item is unknown or out of range */
+static inline int lowlat_parse(const char *spec)
+{
+	char copy[512], *item, *save;
+
+	if (strlen(spec) >= sizeof(copy))
+		return -1;
+	strcpy(copy, spec);
+	for (item = strtok_r(copy, ":", &save); item != NULL; item = strtok_r(NULL, ":", &save))
+	{
+		if (strncmp(item, "cpus=", 5) == 0)
+		{
+			if (lowlat_parse_cpus(item + 5) == -1)
+				return -1;
+		}
+		else if (strncmp(item, "busy=", 5) == 0)
+			lowlat.busypoll = atoi(item + 5);
+		else if (strncmp(item, "spin=", 5) == 0)
+			lowlat.spinus = atoi(item + 5);
+		else if (strcmp(item, "lock") == 0)
+			lowlat.lock = 1;
+		else if (strncmp(item, "fifo=", 5) == 0)
+		{
+			lowlat.fifo = atoi(item + 5);
+			if (lowlat.fifo < 1 || lowlat.fifo > 99)
+				return -1;
+		}
+		else
+			return -1;
+	}
+	if (lowlat.busypoll < 0 || lowlat.spinus < 0)
+		return -1;
+	lowlat.on = 1;
+	return 0;
+}
+
+/* Touch the stack once so its pages are present (and, after mlockall, locked) */
+static __attribute__((noinline)) void lowlat_prefault_stack(void)
+{
+	volatile char stack[LOWLAT_STACK_PREFAULT];
+
+	memset((char *)stack, 0, sizeof(stack));
+}
+
+/* Set this process up: pin (to cpus[index % n], or the whole set when index is -1),
+lock and pre-fault memory, real-time class. who names it in messages and the log */
+static inline void lowlat_enter(int index, const char *who)
+{
+	unsigned long mask[LOWLAT_MAX_CPUS / (8 * sizeof(unsigned long))];
+	struct sched_param sp;
+	int i, cpu;
+
+	if (!lowlat.on)
+		return;
+	lowlat.who = who;
+	lowlat.spin_ns = lowlat.sleep_ns = lowlat.spinhits = lowlat.sleeps = 0;
+	lowlat.reported = lowlat_now();
+
+	if (lowlat.ncpus > 0)
+	{
+		/* raw syscall: the glibc CPU_SET macros want _GNU_SOURCE before the first include */
+		memset(mask, 0, sizeof(mask));
+		for (i = 0; i < lowlat.ncpus; i++)
+			if (index == -1 || i == index % lowlat.ncpus)
+			{
+				cpu = lowlat.cpus[i];
+				mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+			}
+		if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == -1)
+			fprintf(stderr, "%s: cannot pin to the cpus given: %s\n", who, strerror(errno));
+	}
+	if (lowlat.lock)
+	{
+		/* freed heap stays mapped, so it does not fault again when reused */
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			fprintf(stderr, "%s: cannot lock memory: %s\n", who, strerror(errno));
+		lowlat_prefault_stack();
+	}
+	if (lowlat.fifo > 0)
+	{
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = lowlat.fifo;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1)
+			fprintf(stderr, "%s: cannot switch to SCHED_FIFO: %s\n", who, strerror(errno));
+	}
+}
+
+/* Busy polling on a service socket */
+static inline void lowlat_socket(int s)
+{
+	if (lowlat.on && lowlat.busypoll > 0 &&
+		setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &lowlat.busypoll, sizeof(lowlat.busypoll)) == -1)
+		fprintf(stderr, "%s: cannot set SO_BUSY_POLL: %s\n", lowlat.who, strerror(errno));
+}
+
+/* Log the spin and sleep totals: now (force), or when LOWLAT_REPORT_NS has passed */
+static inline void lowlat_report(int force)
+{
+	uint64_t now;
+
+	if (!lowlat.on)
+		return;
+	now = lowlat_now();
+	if (!force && now - lowlat.reported < LOWLAT_REPORT_NS)
+		return;
+	lowlat.reported = now;
+	BLOG(BL_INFO, EV_LOWLAT, lowlat.spin_ns, lowlat.sleep_ns, lowlat.spinhits << 32 | (lowlat.sleeps & 0xffffffff), lowlat.who);
+}
+
+static void lowlat_killed(int sig)
+{
+	lowlat_report(1);
+	_exit(0);
+}
+
+/* For processes that only end when killed: log the totals on SIGINT and SIGTERM */
+static inline void lowlat_report_on_signal(void)
+{
+	if (lowlat.on)
+	{
+		signal(SIGINT, lowlat_killed);
+		signal(SIGTERM, lowlat_killed);
+	}
+}
+
+/* recvmsg() that spins on the socket for up to the spin budget, then sleeps in poll() */
+static inline ssize_t lowlat_recvmsg(int s, struct msghdr *msg, int flags)
+{
+	struct pollfd pfd = {.fd = s, .events = POLLIN};
+	uint64_t start, now;
+	ssize_t r;
+
+	if (!lowlat.on)
+		return recvmsg(s, msg, flags);
+	start = now = lowlat_now();
+	for (;;)
+	{
+		r = recvmsg(s, msg, flags | MSG_DONTWAIT);
+		if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			now = lowlat_now();
+			lowlat.spin_ns += now - start;
+			lowlat.spinhits += r >= 0;
+			lowlat_report(0);
+			return r;
+		}
+		if (lowlat.spinus > 0 && (now = lowlat_now()) - start >= lowlat.spinus * 1000ULL)
+			break;
+		lowlat_relax();
+	}
+	lowlat.spin_ns += now - start;
+
+	/* nothing within the budget: sleep until the socket is readable */
+	lowlat.sleeps++;
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+	lowlat.sleep_ns += lowlat_now() - now;
+	r = recvmsg(s, msg, flags);
+	lowlat_report(0);
+	return r;
+}
+
+/* recvfrom(), and recv() with from NULL, on top of lowlat_recvmsg() */
+static inline ssize_t lowlat_recvfrom(int s, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen)
+{
+	struct iovec iov = {buf, len};
+	struct msghdr mh;
+	ssize_t r;
+
+	if (!lowlat.on)
+		return recvfrom(s, buf, len, flags, from, fromlen);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = from;
+	mh.msg_namelen = fromlen != NULL ? *fromlen : 0;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	r = lowlat_recvmsg(s, &mh, flags);
+	if (r >= 0 && fromlen != NULL)
+		*fromlen = mh.msg_namelen;
+	return r;
+}
+
+#endif /* LOWLATENCY_H */
@@ -25,6 +25,8 @@ Usage:
 #include <unistd.h>
 #include <netdb.h>    //networking
 #include <string.h>
+#include "batch.h"    //option 4: packed documents + offsets
+#include "codec.h"    //compressed batch payloads, when the server offers it
 
 /* Some generic error handling stuff */
 extern int errno;
@@ -35,6 +37,15 @@ void perror(const char *s);
 #define MAX_WORD_LENGTH 100   /*max length of messages sent over the network*/
 #define BYNAME 1
 #define MYPORTNUM 8080        /* must match the server's port! */  /*for server struct, so you know where to connect to*/
+#define BUSY_MESSAGE "BUSY\n" /* must match the server's admission.h; sent instead of a result under overload */
+#define EXPIRED_MESSAGE "EXPIRED\n" /* must match admission.h; the deadline passed before the request ran */
+#define DOC_REPLY "DOC"       /* must match the server's docstore.h */
+#define DOC_MAX_BYTES (64 << 20)  /* largest document the server stores, as DOCSTORE_MAX_BYTES */
+
+/* Batch payload compression, as negotiated with the server right after connecting */
+int codec = 0;
+int codecthreshold;
+struct codec_stats codecstats;
 
 /* Menu selections */
 #define ALLDONE 0
@@ -47,11 +58,304 @@ void printmenu()
     printf("Please choose from the following selections:\n");
     printf("  1 - Enter a Sentence\n");
     printf("  2 - Perform a Transformation\n");
+    printf("  3 - Perform a Transformation with priority and deadline\n");
+    printf("  4 - Transform every line of a file in one batch\n");
+    printf("  6 - Upload a file to the server's document store\n");
+    printf("  7 - Transform a stored document\n");
+    printf("  8 - Release a stored document\n");
+    printf("  9 - Show part of a transformed stored document\n");
     printf("  0 - Exit program\n");
     printf("Your desired menu selection? ");
   }
 
 
+/* Receive exactly len bytes; 0 when the server went away first */
+int recvall(int sockfd, char *buf, size_t len)
+  {
+    size_t got = 0;
+    ssize_t bytes;
+
+    while( got < len )
+    {
+        if( (bytes = recv(sockfd, buf + got, len - got, 0)) <= 0 )
+            return 0;
+        got += bytes;
+    }
+    return 1;
+  }
+
+/* Read one answer line, one byte at a time so nothing that follows it is read with it */
+void recvline(int sockfd, char *line, int max)
+  {
+    int i;
+
+    for( i = 0; i < max - 1 && recv(sockfd, line + i, 1, 0) == 1 && line[i] != '\n'; i++ )
+        ;
+    line[i] = '\0';
+  }
+
+/* Send a batch payload; compressed when the server agreed to the codec */
+void sendpayload(int sockfd, const char *data, size_t len)
+  {
+    char *frame;
+
+    if( !codec )
+    {
+        send(sockfd, data, len, 0);
+        return;
+    }
+    frame = malloc(CODEC_FRAME_MAX(len));
+    send(sockfd, frame, codec_encode(data, len, codecthreshold, frame, &codecstats), 0);
+    free(frame);
+  }
+
+/* Receive a batch payload of exactly len bytes; 0 on failure */
+int recvpayload(int sockfd, char *data, size_t len)
+  {
+    char header[CODEC_HEADER], *stored;
+    size_t rawlen, storedlen;
+    int ok;
+
+    if( !codec )
+        return recvall(sockfd, data, len);
+    if( !recvall(sockfd, header, CODEC_HEADER) || codec_header(header, len, &rawlen, &storedlen) == -1 || rawlen != len )
+        return 0;
+    stored = malloc(storedlen + 1);
+    ok = recvall(sockfd, stored, storedlen) && codec_decode(stored, storedlen, data, len, &codecstats) == 0;
+    free(stored);
+    return ok;
+  }
+
+/* Option 4: send the lines of a file as one batch through one chain and print the results */
+void sendbatch(int sockfd)
+  {
+    char path[256], chain[MAX_WORD_LENGTH], sel[MAX_WORD_LENGTH], line[256], header[64];
+    struct batch b, answer;
+    unsigned int n = 0, total = 0, i;
+    size_t len;
+    char *wire;
+    FILE *fp;
+
+    printf("File with one sentence per line: ");
+    scanf("%255s", path);
+    printf("Enter Transformations: ");
+    scanf("%99s", chain);
+    if( (fp = fopen(path, "r")) == NULL )
+    {
+        printf("Cannot open %s\n", path);
+        return;
+    }
+
+    /* pack the lines back to back; the offsets say where each one starts */
+    if( batch_alloc(&b, BATCH_MAX_DOCS, BATCH_MAX_DOCS * BATCH_MAX_DOC) == -1 )
+    {
+        fclose(fp);
+        printf("Out of memory\n");
+        return;
+    }
+    while( n < BATCH_MAX_DOCS && fgets(line, sizeof(line), fp) != NULL )
+    {
+        len = strcspn(line, "\n");
+        if( len > BATCH_MAX_DOC )
+            len = BATCH_MAX_DOC;
+        b.off[n] = total;
+        memcpy(b.data + total, line, len);
+        total += len;
+        n++;
+    }
+    fclose(fp);
+    if( n == 0 )
+    {
+        printf("%s is empty\n", path);
+        batch_free(&b);
+        return;
+    }
+    b.n = n;
+    b.off[n] = total;
+
+    /* selection frame, chain frame, then the packed documents */
+    bzero(sel, MAX_WORD_LENGTH);
+    snprintf(sel, MAX_WORD_LENGTH, "4 %u %u", n, total);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    bzero(sel, MAX_WORD_LENGTH);
+    strcpy(sel, chain);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    wire = malloc(batch_wire_size(&b));
+    batch_pack(&b, wire);
+    sendpayload(sockfd, wire, batch_wire_size(&b));
+    free(wire);
+    batch_free(&b);
+
+    recvline(sockfd, header, sizeof(header));
+    if( sscanf(header, "BATCH %u %u", &n, &total) != 2 )
+    {
+        printf("~~~~~\nServer answered: %s\n~~~~~\n", header);
+        return;
+    }
+
+    if( batch_alloc(&answer, n, total) == -1 || (wire = malloc(batch_wire_size(&answer))) == NULL )
+    {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    if( !recvpayload(sockfd, wire, batch_wire_size(&answer)) || batch_unpack_offsets(&answer, wire) == -1 )
+    {
+        printf("Sorry, dude. Server failed!\n");
+        exit(1);
+    }
+    memcpy(answer.data, wire + (n + 1) * sizeof(uint32_t), total);
+    printf("~~~~~\n");
+    for( i = 0; i < n; i++ )
+        printf("%u: %.*s\n", i + 1, (int)(answer.off[i + 1] - answer.off[i]), answer.data + answer.off[i]);
+    printf("~~~~~\n");
+    if( codec )
+        printf("Batch payloads so far: %lu bytes, %lu on the wire, %.3f ms in the codec\n",
+               (unsigned long)codecstats.raw, (unsigned long)codecstats.wire, codecstats.ns / 1e6);
+    free(wire);
+    batch_free(&answer);
+  }
+
+/* Option 6: upload a whole file once; the server answers the handle to transform it by */
+void uploaddoc(int sockfd)
+  {
+    char path[256], sel[MAX_WORD_LENGTH], line[128];
+    char *data;
+    long len;
+    FILE *fp;
+
+    printf("File to upload: ");
+    scanf("%255s", path);
+    if( (fp = fopen(path, "rb")) == NULL )
+    {
+        printf("Cannot open %s\n", path);
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    if( len < 0 || len > DOC_MAX_BYTES || (data = malloc(len + 1)) == NULL || fread(data, 1, len, fp) != (size_t)len )
+    {
+        printf("Cannot read %s (at most %d bytes)\n", path, DOC_MAX_BYTES);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+
+    bzero(sel, MAX_WORD_LENGTH);
+    snprintf(sel, MAX_WORD_LENGTH, "6 %ld", len);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    sendpayload(sockfd, data, len);
+    free(data);
+
+    recvline(sockfd, line, sizeof(line));
+    if( strncmp(line, DOC_REPLY " ", strlen(DOC_REPLY) + 1) == 0 )
+        printf("~~~~~\nStored; handle %s\n~~~~~\n", line + strlen(DOC_REPLY) + 1);
+    else
+        printf("~~~~~\nServer answered: %s\n~~~~~\n", line);
+  }
+
+/* Option 7: run a stored document through a chain and write the result to a file */
+void transformdoc(int sockfd)
+  {
+    char handle[32], chain[MAX_WORD_LENGTH], path[256], sel[MAX_WORD_LENGTH], line[128];
+    unsigned long len;
+    char *data;
+    FILE *fp;
+
+    printf("Handle: ");
+    scanf("%31s", handle);
+    printf("Enter Transformations (- for none): ");
+    scanf("%99s", chain);
+    printf("Write the result to: ");
+    scanf("%255s", path);
+
+    bzero(sel, MAX_WORD_LENGTH);
+    snprintf(sel, MAX_WORD_LENGTH, "7 %s", handle);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    bzero(sel, MAX_WORD_LENGTH);
+    if( strcmp(chain, "-") != 0 )
+        strcpy(sel, chain);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+
+    recvline(sockfd, line, sizeof(line));
+    if( sscanf(line, DOC_REPLY " %lu", &len) != 1 )
+    {
+        printf("~~~~~\nServer answered: %s\n~~~~~\n", line);
+        return;
+    }
+    if( (data = malloc(len + 1)) == NULL )
+    {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    if( !recvpayload(sockfd, data, len) )
+    {
+        printf("Sorry, dude. Server failed!\n");
+        exit(1);
+    }
+    if( (fp = fopen(path, "wb")) == NULL || fwrite(data, 1, len, fp) != len )
+        printf("Cannot write %s\n", path);
+    else
+        printf("~~~~~\n%lu bytes written to %s\n~~~~~\n", len, path);
+    if( fp != NULL )
+        fclose(fp);
+    free(data);
+  }
+
+/* Option 8: give up the reference the upload took; the server may then drop the document */
+void releasedoc(int sockfd)
+  {
+    char handle[32], sel[MAX_WORD_LENGTH], line[128];
+
+    printf("Handle: ");
+    scanf("%31s", handle);
+    bzero(sel, MAX_WORD_LENGTH);
+    snprintf(sel, MAX_WORD_LENGTH, "8 %s", handle);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    recvline(sockfd, line, sizeof(line));
+    printf("~~~~~\nServer answered: %s\n~~~~~\n", line);
+  }
+
+/* Option 9: bytes [from, to) of a stored document's result; the server computes only those */
+void rangedoc(int sockfd)
+  {
+    char handle[32], chain[MAX_WORD_LENGTH], sel[MAX_WORD_LENGTH], line[128];
+    unsigned long from, to, len;
+    char *data;
+
+    printf("Handle: ");
+    scanf("%31s", handle);
+    printf("Enter Transformations (- for none): ");
+    scanf("%99s", chain);
+    printf("From byte: ");
+    scanf("%lu", &from);
+    printf("To byte (not included): ");
+    scanf("%lu", &to);
+
+    bzero(sel, MAX_WORD_LENGTH);
+    snprintf(sel, MAX_WORD_LENGTH, "9 %s %lu %lu", handle, from, to);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+    bzero(sel, MAX_WORD_LENGTH);
+    if( strcmp(chain, "-") != 0 )
+        strcpy(sel, chain);
+    send(sockfd, sel, MAX_WORD_LENGTH, 0);
+
+    recvline(sockfd, line, sizeof(line));
+    if( sscanf(line, DOC_REPLY " %lu", &len) != 1 )
+    {
+        printf("~~~~~\nServer answered: %s\n~~~~~\n", line);
+        return;
+    }
+    if( (data = malloc(len + 1)) == NULL || !recvpayload(sockfd, data, len) )
+    {
+        printf("Sorry, dude. Server failed!\n");
+        exit(1);
+    }
+    printf("~~~~~\n%.*s\n~~~~~\n", (int)len, data);
+    free(data);
+  }
+
+
 /* Main program of client */
 int main()
   {
@@ -120,6 +424,18 @@ int main()
 
     /* Print welcome banner */
     printf("Client Connected!\n\n");
+
+    /* ask for compressed batch payloads; the server answers whether it does that */
+    bzero(message, MAX_WORD_LENGTH);
+    strcpy(message, "5 " CODEC_NAME);
+    send(sockfd, message, MAX_WORD_LENGTH, 0);
+    recvline(sockfd, message, MAX_WORD_LENGTH);
+    if( sscanf(message, CODEC_REPLY " " CODEC_NAME " %d", &codecthreshold) == 1 )
+    {
+        codec = 1;
+        printf("Batches are compressed (%s) from %d bytes on.\n", CODEC_NAME, codecthreshold);
+    }
+    bzero(message, MAX_WORD_LENGTH);
  //////////////////////////////////End Initialization/////////////////////////////////////   
 
 
@@ -169,14 +485,26 @@ int main()
                     //sleep(1);
                     continue;
         }
-        if( choice == 2)    //user chose to transform the text
+        if( choice == 2 || choice == 3 )    //user chose to transform the text
         {
-                    /* get rid of newline after the (integer) menu choice given */
-                    c = getchar();
-
                     //send server the choice selection
                     char sel[MAX_WORD_LENGTH];
+                    bzero(sel, MAX_WORD_LENGTH);
                     sel[0] = '2';
+
+                    if( choice == 3 )   //option 3 frame carries "priority deadline_ms" after the '3'
+                    {
+                        int priority, deadline;
+                        printf("Priority (0 interactive, 1 normal, 2 bulk): ");
+                        scanf("%d", &priority);
+                        printf("Deadline in milliseconds (0 for none): ");
+                        scanf("%d", &deadline);
+                        snprintf(sel, MAX_WORD_LENGTH, "3 %d %d", priority, deadline);
+                    }
+
+                    /* get rid of newline after the (integer) menu choice given */
+                    c = getchar();
+
                     send(sockfd,sel,MAX_WORD_LENGTH,0);
 
                     /* prompt TCP client for the input */
@@ -202,6 +530,20 @@ int main()
 
                             /* make sure the message is null-terminated in C */
                             messageback[bytes] = '\0';
+
+                            /* the server is shedding load; the request was not run */
+                            if (strcmp(messageback, BUSY_MESSAGE) == 0)
+                            {
+                                printf("~~~~~\nServer is busy, please try again later.\n~~~~~\n");
+                                bzero(transformkey, len);
+                                continue;
+                            }
+                            if (strcmp(messageback, EXPIRED_MESSAGE) == 0)
+                            {
+                                printf("~~~~~\nDeadline passed before the server could run the request.\n~~~~~\n");
+                                bzero(transformkey, len);
+                                continue;
+                            }
                             
                             /*Print output to client terminal*/
                             printf("~~~~~\nAnswer received from server: ");
@@ -219,6 +561,26 @@ int main()
                     bzero(messageback, bytes);
                     bzero(transformkey, len);
         }
+        else if( choice == 4 )    //user chose to send a file as a batch
+        {
+                    sendbatch(sockfd);
+        }
+        else if( choice == 6 )    //user chose to upload a document
+        {
+                    uploaddoc(sockfd);
+        }
+        else if( choice == 7 )    //user chose to transform a stored document
+        {
+                    transformdoc(sockfd);
+        }
+        else if( choice == 8 )    //user chose to release a stored document
+        {
+                    releasedoc(sockfd);
+        }
+        else if( choice == 9 )    //user chose to see part of a transformed document
+        {
+                    rangedoc(sockfd);
+        }
         else printf("Invalid menu selection. Please try again.\n");
 
 
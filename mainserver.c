@@ -14,6 +14,73 @@ Update: This version has full functionality including reentering new sentences.
 
 Usage:
 	Run the bash script 'run' in the current directory
+	or: ./mainserver.out [-p tcpport] [-u udpport] [-s code=port ...] [-g logfile] [-t rate] [-T tracefile]
+			[-S sessions] [-F inflight] [-Q queue] [-r rate -b burst] [-P] [-L plugindir] [-X codes]
+			[-C bytes [-I chains]] [-c capturefile] [-z threshold] [-N nodefile] [-J slots] [-R spec]
+			[-A code=min:max[:latency_us[:depth]] ...] [-Z bytes] [-D bytes [-E spilldir]] [-W window]
+		-p tcpport	TCP port clients connect to (default 8080)
+		-u udpport	UDP port given to microservers forked per step (default 8081)
+		-s code=port	transform code (1-6) is served by an already running
+				microserver (./upper.out -l -p port) on SERVER_IP:port;
+				it is not forked for every step (see bench.c)
+		-g logfile	binary log shared with the microservers (default servers.blog);
+				read it with ./logdecode.out
+		-t rate		fraction of requests (0..1) whose trace is exported (default 0)
+		-T tracefile	Chrome trace-event JSON file for those traces (default traces.json)
+		-S -F -Q -r -b	admission control: caps on sessions and in-flight steps,
+				per-service queue bound, per-client token bucket (see admission.h);
+				over a limit the client gets BUSY instead of a result.
+				Waiting steps are scheduled by priority class, then earliest
+				deadline (client option 3); expired work is answered EXPIRED
+		-P		plain syscalls even when io_uring is available (see uring.h)
+		-L plugindir	load transform plugins (*.so, see plugin.h) and run
+				their codes inside the session, without a microserver
+		-X codes	codes (e.g. 25) that stay out of process even with a plugin;
+				-s code=port also takes precedence over a plugin
+		-C bytes	per-session cache of intermediate chain results, at most
+				this many bytes (default 0, off; see chaincache.h)
+		-I chains	when the client re-enters an edited sentence, carry the
+				last this many chains in the cache over to it by sending
+				only the edited ranges through the steps (see incremental.h)
+		-c capturefile	append every client request (time, session, frames) to
+				this file, for ./replay.out (see capture.h)
+		-z threshold	offer LZ4 compression of batch payloads to clients that
+				ask for it (option 5); payloads below threshold bytes
+				are sent raw (see codec.h)
+		-N nodefile	spread the steps over the microservers of several nodes by
+				consistent hashing of (code, text); kill -HUP re-reads the
+				file (see hashring.h). -s code=port takes precedence, and
+				codes on the ring no longer run in-process
+		-J slots	coalesce identical requests (same sentence and chain) of
+				different sessions while the first is in flight, with room
+				for this many distinct requests at once (see coalesce.h)
+		-R spec		low-latency mode, e.g. cpus=2-5:busy=50:spin=200:lock:fifo=10:
+				sessions pinned round-robin to the cpus, busy polling and
+				spinning receives on their sockets, locked memory, SCHED_FIFO;
+				implies -P (see lowlatency.h)
+		-A code=min:max[:latency_us[:depth]]
+				elastic pool of min to max replicas for the code, forked
+				from a zygote of its microserver and resized by a
+				controller process: grown past depth steps in the system
+				per replica (default 1), past the mean step latency
+				target, or when steps are shed; shrunk when the load
+				stays low (see autoscale.h). -s and -N take precedence,
+				and a pooled code no longer runs in-process
+		-Z bytes	batch answers of at least this many bytes are sent
+				zero-copy (MSG_ZEROCOPY, or SENDMSG_ZC on io_uring) from
+				the buffer they were transformed in (default 0, off;
+				see zerocopy.h)
+		-D bytes	keep a document store: clients upload a document once
+				(option 6) and transform it by its handle from any
+				session (option 7), or just a range of the result
+				(option 9); this many bytes of documents stay
+				in memory (tmpfs), the rest spills to disk (see docstore.h)
+		-E spilldir	where documents spill to (default docs.spill)
+		-W window	cost-based planning: a code with both a plugin and a
+				microserver (-s, -N or -A) runs each step where a live
+				cost model predicts it is cheapest, in-process, remote,
+				or for documents remote with up to this many pieces in
+				flight at once (see planner.h)
 
 References:
 
@@ -33,6 +100,30 @@ https://pages.cpsc.ucalgary.ca/~sina.keshvadi1/cpsc441/
 #include <string.h>
 #include <arpa/inet.h>		//networking
 #include <sys/socket.h>		//networking
+#include <netinet/tcp.h>		//TCP_NODELAY
+#include <sys/wait.h>
+#include <errno.h>
+#include "binlog.h"			//hot-path logging, see logdecode.c
+#include "trace.h"			//per-request traces across the microservers
+#include "admission.h"		//session/in-flight caps, load shedding
+#include "uring.h"			//io_uring backend, plain syscalls when unavailable
+#include "plugin.h"			//in-process transform kernels (-L)
+#include "chaincache.h"		//per-session trie of chain prefix results (-C)
+#include "incremental.h"	//re-transform only the edited part of a sentence (-I)
+#include "batch.h"			//option 4: many documents through one chain
+#include "capture.h"		//record client requests for replay (-c)
+#include "codec.h"			//compressed batch payloads (-z, option 5)
+#include "hashring.h"		//steps routed over several nodes (-N)
+#include "coalesce.h"		//identical requests across sessions share one dispatch (-J)
+#include "lowlatency.h"		//pinned, spinning, locked processes (-R)
+#include "autoscale.h"		//elastic microserver replicas forked from zygotes (-A)
+#include "bufpool.h"			//pooled per-request buffers, an allocation-free steady state
+#include "zerocopy.h"		//scatter-gather and zero-copy answers (-Z)
+#include "probes.h"			//USDT probes for perf and bpftrace
+#include "docstore.h"		//documents uploaded once, transformed by handle (-D, options 6-9)
+#include "rangeread.h"		//option 9: a range of a stored document's result, from a window of it
+#include "planner.h"		//in-process or remote, chosen per step from a live cost model (-W)
+#include "utf8.h"			//character boundaries, for batches of UTF-8 aware transforms
 
 /* Global manifest constants */
 #define MAX_MESSAGE_LENGTH 100
@@ -51,16 +142,1617 @@ https://stackoverflow.com/questions/6437383/can-tcp-and-udp-sockets-use-the-same
 /* Global variable */
 int childsockfd;
 
+/* Session: the microserver a chain step goes to (port set per step), and the
+one UDP socket all steps of the session use */
+#define SERVER_IP "127.0.0.1" 		/* loopback interface */ //; ip of master server to connect to
+struct sockaddr_in si_server;
+int udpsock;
+char *logfile = BINLOG_DEFAULT_FILE;
+char *capturefile;				//-c: NULL, no capture
+uint32_t sessionseq;			//sessions accepted so far; the capture's session number
+int codecthreshold = -1;		//-z: smallest payload worth compressing; -1: codec not offered
+int sessioncodec;				//session: the client asked for the codec and got it
+struct codec_stats codecstats;	//session: payload bytes, bytes on the wire, codec time
+long zcthreshold;				//-Z: smallest batch answer sent zero-copy; 0: off
+
+/* UDP port of an already running microserver for each transform code '1'..'6';
+0 means fork the microserver for every chain step (set with -s code=port) */
+#define NUM_TRANSFORMS 6
+int serviceport[NUM_TRANSFORMS + 1];
+int isolated[NUM_TRANSFORMS + 1];	//-X: never run this code in-process
+int planlocal[NUM_TRANSFORMS + 1];	//-W, session: the planner's last choice for the code was in-process
+int plansock = -1;				//-W, session: UDP socket of parallel document steps, opened on first use
+uint32_t planseq;				//session: span ids of their pieces, to match the answers
+
+/* Nodes running microservers (-N); NULL: everything on SERVER_IP */
+char *nodefile;
+struct hash_ring *nodering;
+volatile sig_atomic_t reloadnodes;	//SIGHUP came: re-read nodefile
+
+/* Session: results of chain prefixes for the current sentence (-C) */
+struct chain_cache cache;
+int incrchains;				//-I: recent chains carried over to an edited sentence
+int rebasesteps, rebasebytes, fullbytes;	//what carrying them over sent, and what rerunning would have
+
+/* Request tracing (-t, -T) */
+double tracerate = 0;
+char *tracefile = TRACE_DEFAULT_FILE;
+uint64_t traceseq;			//per session, mixed into a trace id per request
+
+/* Next trace id of this session (splitmix64 of a per-session sequence) */
+uint64_t next_trace_id(void)
+{
+	uint64_t z = (traceseq += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Interrupts accept() so the parent reaps finished sessions and frees their admission slots */
+void childdone(int sig)
+{
+}
+
+/* Interrupts accept() so the parent re-reads the node list */
+void nodeshup(int sig)
+{
+	reloadnodes = 1;
+}
+
+/* Parent: collect finished session children */
+void reap_sessions(void)
+{
+	pid_t done;
+
+	while ((done = waitpid(-1, NULL, WNOHANG)) > 0)
+		admission_session_end(done);
+}
+
+/* Parent: turn a client away without forking; it gets BUSY as its answer */
+void reject_client(int sockfd)
+{
+	char drain[MAX_MESSAGE_LENGTH];
+
+	send(sockfd, BUSY_MESSAGE, strlen(BUSY_MESSAGE), MSG_DONTWAIT);
+	shutdown(sockfd, SHUT_WR);
+	/* read what already arrived so close() does not reset the connection before BUSY is read */
+	while (recv(sockfd, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+		;
+	close(sockfd);
+}
+
+/* I/O backend: io_uring unless -P or the kernel refuses it */
+int useuring = 1;
+struct uring ring = {.fd = -1};	//parent: accepts; session child: its own ring for client and UDP traffic
+struct uring_bufs framebufs;	//session: client frames are received into these
+int sessionuring;				//this session's I/O goes through ring
+
+#define UD_ACCEPT 1				//user_data of the ring operations
+#define UD_CLIENT_RECV 2
+#define UD_CLIENT_SEND 3
+#define UD_STEP_SEND 4
+#define UD_STEP_RECV 5
+#define UD_CLIENT_SEND_ZC 6
+#define FIXED_CLIENT 0			//fixed file indexes of a session
+#define FIXED_UDP 1
+#define FRAME_GROUP 0			//provided-buffer group of the client frames
+#define FRAME_BUFS 16			//power of two
+
+/* Session: completed client recvs not yet consumed, oldest first */
+struct frame
+{
+	int len;					//recv() result
+	unsigned bid;				//buffer holding the bytes
+} frames[FRAME_BUFS + 1];		//every buffer, plus end of stream
+int framehead, nframes, framesseen;
+int frameoff;					//bytes of the oldest frame already consumed
+int recvarmed;					//multishot recv is active
+int sendpending;				//sendbuf is still being sent
+int sendresult;					//what the last send completed with
+char sendbuf[MAX_MESSAGE_LENGTH];
+int stepdone, stepresult;
+
+/* Parent: one multishot accept delivers every new client */
+void arm_accept(int listenfd)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+	uring_prep(sqe, IORING_OP_ACCEPT, listenfd, NULL, 0, UD_ACCEPT);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Parent: next client from the ring, like accept(); -1 with errno EINTR when a session ended */
+int ring_accept(int listenfd)
+{
+	struct io_uring_cqe *cqe;
+	int res, more;
+
+	for (;;)
+	{
+		if ((cqe = uring_cqe(&ring)) != NULL)
+		{
+			res = cqe->res;
+			more = cqe->flags & IORING_CQE_F_MORE;
+			uring_cqe_seen(&ring);
+			if (res == -EINVAL)
+			{
+				/* kernel without multishot accept */
+				uring_exit(&ring);
+				return accept(listenfd, NULL, NULL);
+			}
+			if (!more)
+				arm_accept(listenfd);
+			if (res >= 0)
+				return res;
+			errno = -res;
+			return -1;
+		}
+		if (uring_submit(&ring, 1) == -1)
+			return -1;
+	}
+}
+
+/* Session: one multishot recv; each completion is what one recv() would have returned */
+void arm_client_recv(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+	uring_prep(sqe, IORING_OP_RECV, FIXED_CLIENT, NULL, 0, UD_CLIENT_RECV);
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = FRAME_GROUP;
+	recvarmed = 1;
+}
+
+/* Session: put this session's client socket and UDP socket on a ring of its own; 0 or -1 */
+int session_ring_start(int udpfd)
+{
+	int fds[2] = {childsockfd, udpfd};
+
+	if (uring_init(&ring, 16) == -1)
+		return -1;
+	if (uring_register_files(&ring, fds, 2) == -1 ||
+		uring_bufs_init(&ring, &framebufs, FRAME_GROUP, FRAME_BUFS, MAX_MESSAGE_LENGTH) == -1)
+	{
+		uring_exit(&ring);
+		return -1;
+	}
+	arm_client_recv();
+	return 0;
+}
+
+/* Session: sort out the completions that are in */
+void session_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct frame *f;
+
+	while ((cqe = uring_cqe(&ring)) != NULL)
+	{
+		if (cqe->user_data == UD_CLIENT_RECV)
+		{
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				recvarmed = 0;
+			/* out of buffers: re-armed once session_recv() has given one back */
+			if (cqe->res != -ENOBUFS)
+			{
+				f = &frames[(framehead + nframes++) % (FRAME_BUFS + 1)];
+				f->len = cqe->res;
+				f->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			}
+		}
+		else if (cqe->user_data == UD_CLIENT_SEND)
+		{
+			sendpending = 0;
+			sendresult = cqe->res;
+		}
+		else if (cqe->user_data == UD_CLIENT_SEND_ZC)
+		{
+			/* the result, and when IORING_CQE_F_MORE says so, later the notification
+			that the kernel is done with the pages */
+			if (cqe->flags & IORING_CQE_F_NOTIF)
+				zc_completed(zc_done, zc_done, (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED) != 0);
+			else
+			{
+				sendpending = 0;
+				sendresult = cqe->res;
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					zc_completed(zc_done, zc_done, 0);		//failed, no notification follows
+			}
+		}
+		else if (cqe->user_data == UD_STEP_RECV)
+		{
+			stepdone = 1;
+			stepresult = cqe->res;
+		}
+		else if (cqe->user_data == UD_STEP_SEND)
+			stepresult = cqe->res;		//failed; the linked recv completes as cancelled
+		uring_cqe_seen(&ring);
+	}
+}
+
+/* Session: wait for completions; anything queued is submitted with the wait */
+int session_wait(void)
+{
+	if (uring_submit(&ring, 1) == -1 && errno != EINTR)
+		return -1;
+	session_reap();
+	return 0;
+}
+
+/* Session: next client frame, like recv(childsockfd, dst, size, 0);
+a frame larger than size is handed out over several calls */
+int session_recv(char *dst, int size)
+{
+	struct frame f;
+	int len;
+
+	if (!sessionuring)
+		return lowlat_recvfrom(childsockfd, dst, size, 0, NULL, NULL);
+
+	while (nframes == 0)
+	{
+		if (!recvarmed)
+			arm_client_recv();
+		if (session_wait() == -1)
+			return -1;
+	}
+	f = frames[framehead];
+	if (f.len > 0 && f.len - frameoff > size)
+	{
+		/* take part of the frame, leave the rest for the next call */
+		memcpy(dst, uring_buf(&framebufs, f.bid) + frameoff, size);
+		frameoff += size;
+		return size;
+	}
+	framehead = (framehead + 1) % (FRAME_BUFS + 1);
+	nframes--;
+
+	if (f.len == -EINVAL && framesseen == 0)
+	{
+		/* kernel without multishot recv: this session continues on syscalls */
+		uring_exit(&ring);
+		sessionuring = 0;
+		return recv(childsockfd, dst, size, 0);
+	}
+	framesseen++;
+	if (f.len <= 0)
+	{
+		errno = -f.len;
+		return f.len == 0 ? 0 : -1;
+	}
+
+	len = f.len - frameoff;
+	memcpy(dst, uring_buf(&framebufs, f.bid) + frameoff, len);
+	frameoff = 0;
+	uring_buf_put(&framebufs, f.bid);
+	if (!recvarmed)
+		arm_client_recv();
+	return len;
+}
+
+/* Session: exactly n bytes from the client; n, or 0/-1 when the client went away first */
+int session_recv_all(char *dst, int n)
+{
+	int got = 0, r;
+
+	while (got < n)
+	{
+		if ((r = session_recv(dst + got, n - got)) <= 0)
+			return r;
+		got += r;
+	}
+	return n;
+}
+
+/* Session: one frame from the client into dst (MAX_MESSAGE_LENGTH bytes), as session_recv();
+the rest of a short frame is cleared and the last byte is always a null, so nothing of an
+earlier frame shows through and the buffers need no clearing between requests */
+int session_recv_frame(char *dst)
+{
+	int r = session_recv(dst, MAX_MESSAGE_LENGTH), got = r > 0 ? r : 0;
+
+	if (got < MAX_MESSAGE_LENGTH)
+		memset(dst + got, 0, MAX_MESSAGE_LENGTH - got);
+	dst[MAX_MESSAGE_LENGTH - 1] = '\0';
+	return r;
+}
+
+/* Session: send all of a large answer and wait until it is out; len, or -1 */
+int session_send_all(const char *data, int len)
+{
+	struct io_uring_sqe *sqe;
+	int sent = 0, r;
+
+	while (sent < len)
+	{
+		if (!sessionuring)
+			r = send(childsockfd, data + sent, len - sent, 0);
+		else
+		{
+			while (sendpending)
+				if (session_wait() == -1)
+					return -1;
+			sqe = uring_sqe(&ring);
+			uring_prep(sqe, IORING_OP_SEND, FIXED_CLIENT, data + sent, len - sent, UD_CLIENT_SEND);
+			sqe->flags = IOSQE_FIXED_FILE;
+			sendpending = 1;
+			while (sendpending)
+				if (session_wait() == -1)
+					return -1;
+			r = sendresult;
+		}
+		if (r <= 0)
+			return -1;
+		sent += r;
+	}
+	return len;
+}
+
+/* Session: receive a batch payload of size bytes, through the codec when the client
+negotiated it; size, 0 when the client went away, or -1 for a bad codec frame */
+int session_recv_payload(char *dst, int size)
+{
+	char header[CODEC_HEADER], *stored;
+	size_t rawlen, storedlen;
+	int r;
+
+	if (!sessioncodec)
+		return session_recv_all(dst, size);
+	if ((r = session_recv_all(header, CODEC_HEADER)) <= 0)
+		return r;
+	if (codec_header(header, size, &rawlen, &storedlen) == -1 || rawlen != (size_t)size ||
+		(stored = bufpool_get(storedlen + 1)) == NULL)
+		return -1;
+	if ((r = session_recv_all(stored, storedlen)) > 0 || storedlen == 0)
+		r = codec_decode(stored, storedlen, dst, size, &codecstats) == -1 ? -1 : size;
+	bufpool_put(stored);
+	return r;
+}
+
+/* Session: send a batch payload, compressed when the client negotiated the codec; len, or -1 */
+int session_send_payload(const char *data, int len)
+{
+	char *frame;
+	int r;
+
+	if (!sessioncodec)
+		return session_send_all(data, len);
+	if ((frame = bufpool_get(CODEC_FRAME_MAX(len))) == NULL)
+		return -1;
+	r = session_send_all(frame, codec_encode(data, len, codecthreshold, frame, &codecstats)) == -1 ? -1 : len;
+	bufpool_put(frame);
+	return r;
+}
+
+/* Session: send all of iov[0..n) in one sendmsg() where the socket takes it, going on
+after short writes (iov is used up); the total, or -1. From -Z bytes on, the pages go out
+zero-copy and *zerocopy is set: the caller must zc_hold() the buffers instead of reusing them */
+int session_sendv_all(struct iovec *iov, int n, int *zerocopy)
+{
+	struct io_uring_sqe *sqe;
+	struct msghdr mh;
+	size_t total = 0, left;
+	int i, r, zc;
+
+	for (i = 0; i < n; i++)
+		total += iov[i].iov_len;
+	zc = zc_wanted(total);
+	left = total;
+	*zerocopy = 0;
+	while (n > 0)
+	{
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		if (!sessionuring)
+		{
+			r = sendmsg(childsockfd, &mh, zc ? MSG_ZEROCOPY : 0);
+			if (r == -1 && zc && errno == ENOBUFS)
+			{
+				zc = 0;						//over the socket's pinned-page budget: copy this one
+				continue;
+			}
+			if (r > 0 && zc)
+				zc_sent(r);
+		}
+		else
+		{
+			while (sendpending)
+				if (session_wait() == -1)
+					return -1;
+			sqe = uring_sqe(&ring);
+			uring_prep(sqe, zc ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG, FIXED_CLIENT, &mh, 1,
+					   zc ? UD_CLIENT_SEND_ZC : UD_CLIENT_SEND);
+			sqe->flags = IOSQE_FIXED_FILE;
+			if (zc)
+			{
+				sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+				zc_sent(left);				//its id is settled by the completions
+			}
+			sendpending = 1;
+			while (sendpending)
+				if (session_wait() == -1)
+					return -1;
+			r = sendresult;
+			if (zc && (r == -EINVAL || r == -EOPNOTSUPP))
+			{
+				zc = 0;						//kernel without SENDMSG_ZC: copy from now on
+				zc_threshold = 0;
+				continue;
+			}
+		}
+		if (r <= 0)
+			return -1;
+		*zerocopy |= zc;
+		left -= r;
+
+		/* skip what went out */
+		for (; n > 0 && (size_t)r >= iov->iov_len; n--, iov++)
+			r -= iov->iov_len;
+		if (n > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return total;
+}
+
+/* Session: wait until the kernel is done with at least one more zero-copy send */
+void session_zc_wait(void)
+{
+	int held = zc_nheld;
+
+	if (!sessionuring)
+		zc_reap(childsockfd, 1);
+	else
+		while (zc_nheld == held && held > 0)
+			if (session_wait() == -1)
+				return;
+}
+
+/* Session: answer the client; on the ring the send goes out with the next wait */
+int session_send(const char *msg, int len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!sessionuring)
+		return session_send_all(msg, len);
+
+	while (sendpending)
+		if (session_wait() == -1)
+			return -1;
+	memcpy(sendbuf, msg, len);
+	sqe = uring_sqe(&ring);
+	uring_prep(sqe, IORING_OP_SEND, FIXED_CLIENT, sendbuf, len, UD_CLIENT_SEND);
+	sqe->flags = IOSQE_FIXED_FILE;
+	sendpending = 1;
+	return len;
+}
+
+/* Session: send one datagram to a microserver and receive its answer on socket s;
+on the ring this is a linked sendmsg + recvmsg, one io_uring_enter() */
+int session_step(int s, struct msghdr *out, struct msghdr *in)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!sessionuring)
+	{
+		if (sendmsg(s, out, 0) == -1)
+			return -1;
+		return lowlat_recvmsg(s, in, 0);
+	}
+
+	sqe = uring_sqe(&ring);
+	uring_prep(sqe, IORING_OP_SENDMSG, FIXED_UDP, out, 1, UD_STEP_SEND);
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	sqe = uring_sqe(&ring);
+	uring_prep(sqe, IORING_OP_RECVMSG, FIXED_UDP, in, 1, UD_STEP_RECV);
+	sqe->flags = IOSQE_FIXED_FILE;
+
+	stepdone = 0;
+	stepresult = 0;
+	while (!stepdone)
+		if (session_wait() == -1)
+			return -1;
+	if (stepresult < 0)
+	{
+		errno = -stepresult;
+		return -1;
+	}
+	return stepresult;
+}
+
+/* Executables of the microservers, by transform code */
+char *msnames[NUM_TRANSFORMS + 1] = {NULL, "./identity.out", "./reverse.out", "./upper.out",
+									 "./lower.out", "./caesar.out", "./yours.out"};
+
+/* Does the planner choose where code runs (-W)? When it has a plugin not kept out by -X,
+and a microserver to go to: -s, the node ring or an elastic pool */
+int plannable(int code)
+{
+	return plan != NULL && plugins[code] != NULL && !isolated[code] &&
+		   (serviceport[code] != 0 || hashring_serves(nodering, code) || autoscale_serves(code));
+}
+
+/* Session: does code run in-process? As the planner last chose, or only with a plugin, and
+when neither -s, -X, the node ring nor an elastic pool sends it elsewhere */
+int inprocess(int code)
+{
+	if (plannable(code))
+		return planlocal[code];
+	return serviceport[code] == 0 && !isolated[code] && plugins[code] != NULL && !hashring_serves(nodering, code) &&
+		   !autoscale_serves(code);
+}
+
+/* Session: can a document step of code have several pieces in flight? Not under an
+in-flight cap (-F), which holds one slot per session */
+int plan_parallel_ok(int code)
+{
+	return plan != NULL && plan->window > 1 && plannable(code) && (adm == NULL || adm->max_inflight <= 0);
+}
+
+/* Session: plan a step of code over bytes, n datagrams when remote, and set inprocess() to
+match. Returns the mode (PLAN_*) with its predicted ns in *predicted, or -1 when there is
+nothing to choose. */
+int plan_step(int code, uint64_t bytes, uint64_t n, int parallel_ok, uint64_t *predicted)
+{
+	int mode;
+
+	*predicted = 0;
+	if (!plannable(code))
+		return -1;
+	mode = plan_choose(code, bytes, n, parallel_ok, predicted);
+	planlocal[code] = mode == PLAN_LOCAL;
+	if (mode != PLAN_LOCAL)
+		plan_busy(code, 1);
+	PROBE4(plan, sessionseq, code, mode, *predicted);
+	return mode;
+}
+
+/* Session: the step planned as mode at start is over; ok: it ran, so its time counts */
+void plan_step_done(int code, int mode, uint64_t predicted, uint64_t start, int ok)
+{
+	uint64_t actual = plan_now() - start;
+
+	if (mode < 0)
+		return;
+	if (mode != PLAN_LOCAL)
+		plan_busy(code, -1);
+	if (!ok)
+		return;
+	plan_done(mode, predicted, actual);
+	PROBE4(plan_done, sessionseq, code, mode, actual);
+}
+
+/* Session: run transform code on the len bytes in text and leave the null-terminated
+result in text (at most MAX_MESSAGE_LENGTH - 1 bytes): in-process when a plugin serves
+the code, else on its microserver (the -s one, the ring's node for text, a replica of its pool,
+or a forked one) behind th. Returns the result's length, or ADMIT_BUSY /
+ADMIT_EXPIRED when the step was not run. st gets the step's timing for the trace. */
+int run_step(int code, char *text, int len, int priority, uint64_t deadline, struct trace_header *th,
+			 struct trace_step *st)
+{
+	struct iovec iov[2], riov[2];
+	struct msghdr mh, rmh;				//the step's datagram out, and the answer
+	struct sockaddr_in to = si_server;	//microserver of this step
+	struct sockaddr_in from;			//sender of the answer
+	int verdict, readBytes, mspid;
+	int replica = -1;					//of the code's elastic pool (-A)
+	uint32_t replicagen = 0;
+	uint64_t arrival = autoscale_now();	//the pool's latency counts the admission wait
+
+	st->code = code;
+	st->bytes = len;
+	PROBE4(step_start, sessionseq, code, len, th->trace_id);
+
+	/*work past its deadline is dropped before it reaches a microserver*/
+	if (deadline && admission_now() >= deadline)
+	{
+		PROBE4(step_done, sessionseq, code, ADMIT_EXPIRED, 0);
+		return ADMIT_EXPIRED;
+	}
+
+	/*in-process plugin: run the kernel on text right here;
+	no microserver, so no datagram and no admission slot*/
+	if (inprocess(code))
+	{
+		st->t_send = trace_now();
+		readBytes = plugins[code]->kernel(text, len, text, MAX_MESSAGE_LENGTH - 1);
+		text[readBytes] = '\0';
+		st->t_recv = trace_now();
+		plan_kernel(code, len, st->t_recv - st->t_send);
+		memset(&st->ms, 0, sizeof(st->ms));
+		BLOG(BL_INFO, EV_STEP_INPROC, code, readBytes, 0, text);
+		PROBE4(step_done, sessionseq, code, readBytes, st->t_recv - st->t_send);
+		return readBytes;
+	}
+
+	/*admission: wait for an in-flight slot (by priority and deadline),
+	or shed the request if this service's queue is full*/
+	if ((verdict = admission_acquire(code, priority, deadline)) != ADMIT_OK)
+	{
+		autoscale_shed(code, arrival);
+		PROBE4(step_done, sessionseq, code, verdict, 0);
+		return verdict;
+	}
+
+	if (serviceport[code] != 0)
+	{
+		/*microserver is already running (-s); just talk to it*/
+		to.sin_port = htons(serviceport[code]);
+	}
+	else if (hashring_route(nodering, code, text, len, &to) != -1)
+	{
+		/*the node that owns this text for this code on the ring (-N)*/
+	}
+	else if ((replica = autoscale_pick(code, &to, &replicagen)) != -1)
+	{
+		/*the least busy replica of the code's elastic pool (-A)*/
+	}
+	else
+	{
+		to.sin_port = htons(udpport);
+
+		/*start remote microserver in a forked process*/
+		mspid = fork();
+		if( mspid  == 0)
+		{
+				//child
+				char portarg[16];
+				sprintf(portarg, "%d", udpport);
+				char *args[] = {msnames[code], "-p", portarg, "-g", logfile, NULL};
+				//execute microserver
+				if (execvp(args[0],args) == -1)			//child terminates this process and is running server now;
+				{
+					printf("\nerror reached\n");
+				}
+		}
+		else
+		{
+			//parent waits for child to finish, otherwise parent will be 'sending' before microserver child is listening
+			sleep(1);
+		}
+	}
+
+	/*send text to the microserver, behind the trace header of this request*/
+	iov[0].iov_base = th;
+	iov[0].iov_len = sizeof(*th);
+	iov[1].iov_base = text;
+	iov[1].iov_len = len;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &to;
+	mh.msg_namelen = sizeof(to);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+
+	/*the answer comes back into text; the stamped trace header lands in st->ms*/
+	riov[0].iov_base = &st->ms;
+	riov[0].iov_len = sizeof(*th);
+	riov[1].iov_base = text;
+	riov[1].iov_len = MAX_MESSAGE_LENGTH - 1;
+	memset(&rmh, 0, sizeof(rmh));
+	rmh.msg_name = &from;
+	rmh.msg_namelen = sizeof(from);
+	rmh.msg_iov = riov;
+	rmh.msg_iovlen = 2;
+
+	BLOG(BL_DEBUG, EV_STEP_SENT, code, ntohs(to.sin_port), len, NULL);
+	st->t_send = trace_now();
+	if ((readBytes = session_step(udpsock, &mh, &rmh)) == -1)
+	{
+		printf("Microserver step failed!\n");
+		exit(1);
+	}
+	st->t_recv = trace_now();
+	readBytes -= sizeof(*th);
+	if (readBytes < 0 || st->ms.magic != TRACE_MAGIC)
+	{
+		printf("Read error!\n");
+		exit(1);
+	}
+
+	//proper null-termination of string so it can be used further if needed
+	text[readBytes] = '\0';
+	admission_release();
+	plan_hop(code, st->t_recv - st->t_send, st->ms.t_send - st->ms.t_recv);
+	if (replica != -1)
+		autoscale_done(code, replica, replicagen, arrival);
+
+	BLOG(BL_INFO, EV_STEP_ANSWER, code, readBytes, 0, text);
+	PROBE4(step_done, sessionseq, code, readBytes, st->t_recv - st->t_send);
+	return readBytes;
+}
+
+/* Session: run_step(), in-process or remote as the planner chooses (-W) */
+int run_planned_step(int code, char *text, int len, int priority, uint64_t deadline, struct trace_header *th,
+					 struct trace_step *st)
+{
+	uint64_t predicted, start;
+	int mode, n;
+
+	mode = plan_step(code, len, 1, 0, &predicted);
+	start = plan_now();
+	n = run_step(code, text, len, priority, deadline, th, st);
+	plan_step_done(code, mode, predicted, start, n >= 0);
+	return n;
+}
+
+/* Session: node still holds the old text and becomes newtext; work out the new text of
+every recently used child (lastuse >= recent) from the edit alone, then its children.
+Children not used recently, or whose step is refused, are dropped. */
+void rebase_children(struct chain_node *node, const char *newtext, int newlen, uint64_t recent)
+{
+	struct chain_node *child;
+	struct text_edit e;
+	struct fragment f;
+	struct trace_header th;
+	struct trace_step st;
+	char frag[MAX_MESSAGE_LENGTH], out[MAX_MESSAGE_LENGTH];
+	int code, n, fraglen;
+
+	if (!text_diff(node->text, node->len, newtext, newlen, &e))
+		return;						//same text: everything below still holds
+	memset(&th, 0, sizeof(th));
+	th.magic = TRACE_MAGIC;
+
+	for (code = 1; code <= NUM_TRANSFORMS; code++)
+	{
+		if ((child = node->child[code]) == NULL)
+			continue;
+		if (child->lastuse < recent)
+		{
+			chaincache_drop(&cache, child);
+			continue;
+		}
+
+		/* send only the fragment through the step and splice its answer in */
+		n = -1;
+		if (incr_fragment(code, node->text, node->len, newtext, newlen, &e, &f) == 0 &&
+			(fraglen = f.pad + f.end - f.start) < MAX_MESSAGE_LENGTH)
+		{
+			memset(frag, ' ', f.pad);
+			memcpy(frag + f.pad, newtext + f.start, f.end - f.start);
+			frag[fraglen] = '\0';
+			if (fraglen > 0)
+			{
+				fraglen = run_step(code, frag, fraglen, PRIO_NORMAL, 0, &th, &st);
+				rebasesteps++;
+				rebasebytes += st.bytes;
+			}
+			if (fraglen >= f.pad)
+				n = incr_splice(code, child->text, child->len, newlen, &e, &f, frag + f.pad, fraglen - f.pad, out);
+		}
+		/* no rule for it: the whole text again */
+		if (n < 0)
+		{
+			memcpy(out, newtext, newlen);
+			n = run_step(code, out, newlen, PRIO_NORMAL, 0, &th, &st);
+			rebasesteps++;
+			rebasebytes += newlen;
+		}
+		fullbytes += newlen;
+		if (n < 0)
+		{
+			chaincache_drop(&cache, child);
+			continue;
+		}
+
+		rebase_children(child, out, n, recent);
+		chaincache_retext(&cache, child, out, n);
+	}
+}
+
+/* Batches (client option 4, see batch.h) */
+#define BATCH_FAILED -3			//run_batch(): a step changed a document's length
+
+/* Transforms that map every character to one of the same length in the same place
+(utf8.h), so a buffer of whole documents can go through them in one call */
+int bytemap(int code)
+{
+	return code == 1 || code == 3 || code == 4 || code == 5;
+}
+
+/* Does document j of b begin where a character can (not on a continuation byte)? The
+UTF-8 aware kernels would otherwise read a character truncated at the end of the
+document before it together with j's first bytes, and one document would change
+another's result. Past the last document there is nothing to run into. */
+int batch_boundary(const struct batch *b, uint32_t j)
+{
+	return b->off[j] == b->off[b->n] || !utf8_continuation(b->data[b->off[j]]);
+}
+
+/* Session: run transform code over every document of b, in place. In-process, a byte map
+is one kernel call over the whole buffer and reverse/yours one call per document; out of
+process, each datagram carries as many whole documents as fit. Documents only share a
+call or a datagram where batch_boundary() holds between them; the whole buffer goes in
+one call only when it holds everywhere. Returns ADMIT_OK, ADMIT_BUSY, ADMIT_EXPIRED or
+BATCH_FAILED; *datagrams counts what was sent. */
+int run_batch_step(int code, struct batch *b, int priority, uint64_t deadline, struct trace_header *th, int *datagrams)
+{
+	struct trace_step st;
+	char group[MAX_MESSAGE_LENGTH];
+	int start[MAX_MESSAGE_LENGTH];		//where each document of the group begins
+	uint32_t i, j, k, total = b->off[b->n];
+	int len, glen, pad, n, whole;
+	uint64_t t;
+
+	if (inprocess(code))
+	{
+		t = plan_now();
+		for (whole = bytemap(code), i = 1; whole && i < b->n; i++)
+			whole = batch_boundary(b, i);
+		if (whole)
+		{
+			if (plugins[code]->kernel(b->data, total, b->data, total) != total)
+				return BATCH_FAILED;
+		}
+		else
+			for (i = 0; i < b->n; i++)
+			{
+				len = b->off[i + 1] - b->off[i];
+				if (plugins[code]->kernel(b->data + b->off[i], len, b->data + b->off[i], len) != (size_t)len)
+					return BATCH_FAILED;
+			}
+		plan_kernel(code, total, plan_now() - t);
+		return ADMIT_OK;
+	}
+
+	for (i = 0; i < b->n; i = j)
+	{
+		/* fill a datagram with documents i..j-1 */
+		glen = 0;
+		for (j = i; j < b->n && j - i < MAX_MESSAGE_LENGTH; j++)
+		{
+			len = b->off[j + 1] - b->off[j];
+			pad = 0;
+			if (code == 6)
+			{
+				/* yours: make the kernel look at the document's second character first, as on its own */
+				for (n = 1; n < glen; n = yours_next(group, n))
+					;
+				pad = n == glen;
+			}
+			if (glen + pad + len > MAX_MESSAGE_LENGTH - 1 || (j > i && !batch_boundary(b, j)))
+				break;
+			memset(group + glen, 'x', pad);
+			glen += pad;
+			start[j - i] = glen;
+			memcpy(group + glen, b->data + b->off[j], len);
+			glen += len;
+		}
+		if (glen == 0)
+			continue;
+		group[glen] = '\0';
+
+		n = run_step(code, group, glen, priority, deadline, th, &st);
+		(*datagrams)++;
+		if (n < 0)
+			return n;
+		if (n != glen)
+			return BATCH_FAILED;
+
+		/* reverse turned the whole group around: each document comes back from the mirrored place */
+		for (k = i; k < j; k++)
+		{
+			len = b->off[k + 1] - b->off[k];
+			memcpy(b->data + b->off[k], group + (code == 2 ? glen - start[k - i] - len : start[k - i]), len);
+		}
+	}
+	return ADMIT_OK;
+}
+
+/* Session: run chain over every document of b, in place, step by step with run_batch_step(),
+each step where the planner chooses (-W). Returns ADMIT_OK, ADMIT_BUSY, ADMIT_EXPIRED or
+BATCH_FAILED; *datagrams counts what was sent. */
+int run_batch(const char *chain, struct batch *b, int priority, uint64_t deadline, int *datagrams)
+{
+	struct trace_header th;
+	uint64_t predicted, start, total = b->off[b->n];
+	int code, c, mode, verdict;
+
+	memset(&th, 0, sizeof(th));
+	th.magic = TRACE_MAGIC;
+	th.trace_id = next_trace_id();
+	*datagrams = 0;
+
+	for (c = 0; chain[c] >= '1' && chain[c] <= '0' + NUM_TRANSFORMS; c++)
+	{
+		code = chain[c] - '0';
+		if (deadline && admission_now() >= deadline)
+			return ADMIT_EXPIRED;
+		mode = plan_step(code, total, total / (MAX_MESSAGE_LENGTH - 2) + 1, 0, &predicted);
+		start = plan_now();
+		verdict = run_batch_step(code, b, priority, deadline, &th, datagrams);
+		plan_step_done(code, mode, predicted, start, verdict == ADMIT_OK);
+		if (verdict != ADMIT_OK)
+			return verdict;
+	}
+	return ADMIT_OK;
+}
+
+/* Session: client option 4 (see batch.h): read the batch, run it, send the results back.
+Returns -1 when the stream cannot be followed any more and the session should end. */
+int handle_batch(char *selin, uint32_t clientip)
+{
+	unsigned ndocs = 0, databytes = 0;
+	int priority = PRIO_NORMAL, deadlinems = 0, verdict, datagrams = 0;
+	int zerocopy = 0;
+	char chain[MAX_MESSAGE_LENGTH], line[64], *wire = NULL;
+	struct batch b;
+	struct iovec iov[2];
+	uint64_t deadline;
+	size_t wiresize;
+
+	selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+	sscanf(selin + 1, "%u %u %d %d", &ndocs, &databytes, &priority, &deadlinems);
+	if (priority < PRIO_INTERACTIVE || priority > PRIO_BULK)
+		priority = PRIO_NORMAL;
+	if (session_recv_all(chain, MAX_MESSAGE_LENGTH) <= 0)
+		return -1;
+	chain[MAX_MESSAGE_LENGTH - 1] = '\0';
+
+	/* without sane sizes the payload cannot be skipped: answer and end the session;
+	the documents are run where they arrive, in the wire image, which is then the answer */
+	wiresize = (ndocs + 1) * sizeof(uint32_t) + databytes;
+	if (zc_nheld > 0 && !sessionuring)
+		zc_reap(childsockfd, 0);			//answers sent zero-copy that are done by now
+	if (ndocs == 0 || ndocs > BATCH_MAX_DOCS || databytes > ndocs * BATCH_MAX_DOC ||
+		(wire = bufpool_get(wiresize + 1)) == NULL || batch_attach(&b, ndocs, databytes, wire + (ndocs + 1) * sizeof(uint32_t)) == -1)
+	{
+		bufpool_put(wire);
+		session_send_all(BATCH_ERROR_MESSAGE, strlen(BATCH_ERROR_MESSAGE));
+		return -1;
+	}
+	if (session_recv_payload(wire, wiresize) <= 0)
+	{
+		bufpool_put(wire);
+		batch_free(&b);
+		return -1;
+	}
+	capture_request(chain, MAX_MESSAGE_LENGTH, wire, wiresize);
+	PROBE3(request, sessionseq, '4', wiresize);
+	deadline = deadlinems > 0 ? admission_now() + deadlinems * 1000000ULL : 0;
+
+	if (batch_unpack_offsets(&b, wire) == -1)
+		verdict = BATCH_FAILED;
+	else if (admission_take_token(clientip) == -1)
+		verdict = ADMIT_BUSY;
+	else
+		verdict = run_batch(chain, &b, priority, deadline, &datagrams);
+	BLOG(BL_INFO, EV_BATCH, ndocs, databytes, datagrams, chain);
+
+	if (verdict == ADMIT_OK)
+	{
+		/* the offsets in the wire image are unchanged: the line and the image in one send */
+		snprintf(line, sizeof(line), "BATCH %u %u\n", ndocs, databytes);
+		iov[0].iov_base = line;
+		iov[0].iov_len = strlen(line);
+		iov[1].iov_base = wire;
+		iov[1].iov_len = wiresize;
+		if (sessioncodec ? session_send_all(line, strlen(line)) == -1 || session_send_payload(wire, wiresize) == -1
+						 : session_sendv_all(iov, 2, &zerocopy) == -1)
+			verdict = BATCH_FAILED;
+	}
+	else if (verdict == ADMIT_BUSY)
+		session_send_all(BUSY_MESSAGE, strlen(BUSY_MESSAGE));
+	else if (verdict == ADMIT_EXPIRED)
+		session_send_all(EXPIRED_MESSAGE, strlen(EXPIRED_MESSAGE));
+	else
+		session_send_all(BATCH_ERROR_MESSAGE, strlen(BATCH_ERROR_MESSAGE));
+	PROBE3(response, sessionseq, verdict == ADMIT_OK ? wiresize : 0, verdict);
+	if (sessioncodec)
+		BLOG(BL_INFO, EV_CODEC, codecstats.raw, codecstats.wire, codecstats.ns, CODEC_NAME);
+	batch_free(&b);
+	while (zerocopy && zc_hold(wire) == -1)
+		session_zc_wait();
+	if (!zerocopy)
+		bufpool_put(wire);
+	return 0;
+}
+
+/* Session: cut the piece of a document step of code that starts at byte p of the len bytes
+in text into piece: as much as fits a datagram behind the pad, not splitting a character.
+A yours piece starts with an 'x' when the kernel is to look at its first character (see
+incremental.h); *next is the byte yours looks at next. Sets *pad, returns the piece's bytes
+of text. */
+int document_piece(int code, const char *text, size_t len, size_t p, size_t *next, char *piece, int *pad)
+{
+	int plen;
+
+	*pad = code == 6 && *next == p;
+	plen = len - p < (size_t)(MAX_MESSAGE_LENGTH - 2) ? (int)(len - p) : MAX_MESSAGE_LENGTH - 2;
+	while (plen > 1 && text_midchar(text, len, p + plen))
+		plen--;
+	if (code == 6)
+		for (; *next < p + plen; *next = yours_next(text, *next))
+			;
+	memset(piece, 'x', *pad);
+	memcpy(piece + *pad, text + p, plen);
+	piece[*pad + plen] = '\0';
+	return plen;
+}
+
+/* Parallel document steps (-W) */
+#define PLAN_WAIT_MS 1000			/* pieces not answered by then are sent again */
+#define PLAN_TRIES 5				/* times a piece is sent before the step fails */
+
+/* A piece of a parallel document step in flight */
+struct plan_piece
+{
+	size_t p;						//where in the document
+	int plen, pad;					//bytes of the document, -1: slot free; 'x' in front
+	int replica;					//of the code's elastic pool (-A), or -1
+	uint32_t gen;					//the replica slot's generation
+	int tries;
+	uint32_t span;					//span id in its trace header, matches the answer
+	uint64_t sent, arrival;
+	struct sockaddr_in to;
+	char text[MAX_MESSAGE_LENGTH];
+};
+
+/* Session: send piece s of a step behind a copy of th; 0, or -1 */
+int plan_send_piece(struct plan_piece *s, const struct trace_header *th)
+{
+	struct trace_header h = *th;
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	h.span_id = s->span;
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = s->text;
+	iov[1].iov_len = s->pad + s->plen;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &s->to;
+	mh.msg_namelen = sizeof(s->to);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	s->sent = trace_now();
+	s->tries++;
+	return sendmsg(plansock, &mh, 0) == -1 ? -1 : 0;
+}
+
+/* Session: run_document_step() on the microserver with up to plan->window pieces in flight
+at once, each routed on its own (a pool spreads them over its replicas). Answers come back
+in any order and go where their piece came from (mirrored, into scratch, for reverse). On
+its own socket, so answers of a failed step that come late cannot mix with run_step()'s.
+Returns ADMIT_OK or BATCH_FAILED. */
+int run_document_parallel(int code, char *text, char *scratch, size_t len, int first, struct trace_header *th,
+						  int *datagrams)
+{
+	struct plan_piece slot[PLAN_MAX_WINDOW], *s;
+	struct trace_header ans;
+	struct iovec riov[2];
+	struct msghdr rmh;
+	struct pollfd pfd;
+	char reply[MAX_MESSAGE_LENGTH];
+	size_t p = 0, next = first;
+	int i, n, inflight = 0, verdict = ADMIT_OK;
+
+	if (plansock == -1 && (plansock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return BATCH_FAILED;
+	for (i = 0; i < plan->window; i++)
+		slot[i].plen = -1;
+
+	while (verdict == ADMIT_OK && (p < len || inflight > 0))
+	{
+		/* fill the free slots with the next pieces */
+		for (i = 0; i < plan->window && p < len; i++)
+		{
+			if ((s = &slot[i])->plen != -1)
+				continue;
+			s->p = p;
+			s->plen = document_piece(code, text, len, p, &next, s->text, &s->pad);
+			p += s->plen;
+			s->to = si_server;
+			s->replica = -1;
+			s->arrival = autoscale_now();
+			s->tries = 0;
+			s->span = planseq++;
+			if (serviceport[code] != 0)
+				s->to.sin_port = htons(serviceport[code]);
+			else if (hashring_route(nodering, code, s->text, s->pad + s->plen, &s->to) == -1)
+				s->replica = autoscale_pick(code, &s->to, &s->gen);
+			inflight++;
+			(*datagrams)++;
+			BLOG(BL_DEBUG, EV_STEP_SENT, code, ntohs(s->to.sin_port), s->pad + s->plen, NULL);
+			if (plan_send_piece(s, th) == -1)
+				verdict = BATCH_FAILED;
+		}
+
+		/* an answer; none for PLAN_WAIT_MS: the datagrams may be lost, send the pieces again */
+		pfd.fd = plansock;
+		pfd.events = POLLIN;
+		if (verdict != ADMIT_OK || (n = poll(&pfd, 1, PLAN_WAIT_MS)) == -1)
+		{
+			if (verdict == ADMIT_OK && errno != EINTR)
+				verdict = BATCH_FAILED;
+			continue;
+		}
+		if (n == 0)
+		{
+			for (i = 0; i < plan->window; i++)
+				if (slot[i].plen != -1 && (slot[i].tries == PLAN_TRIES || plan_send_piece(&slot[i], th) == -1))
+					verdict = BATCH_FAILED;
+			continue;
+		}
+		riov[0].iov_base = &ans;
+		riov[0].iov_len = sizeof(ans);
+		riov[1].iov_base = reply;
+		riov[1].iov_len = MAX_MESSAGE_LENGTH - 1;
+		memset(&rmh, 0, sizeof(rmh));
+		rmh.msg_iov = riov;
+		rmh.msg_iovlen = 2;
+		if ((n = recvmsg(plansock, &rmh, 0) - (int)sizeof(ans)) < 0 || ans.magic != TRACE_MAGIC ||
+			ans.trace_id != th->trace_id)
+			continue;
+		for (i = 0; i < plan->window && (slot[i].plen == -1 || slot[i].span != ans.span_id); i++)
+			;
+		if (i == plan->window)
+			continue;					//a piece sent again, answered twice
+		s = &slot[i];
+		if (n != s->pad + s->plen)
+			verdict = BATCH_FAILED;
+		else
+			memcpy(code == 2 ? scratch + len - s->p - s->plen : text + s->p, reply + s->pad, s->plen);
+		plan_service(code, ans.t_send - ans.t_recv);
+		if (s->replica != -1)
+			autoscale_done(code, s->replica, s->gen, s->arrival);
+		s->plen = -1;
+		inflight--;
+	}
+
+	/* a failed step leaves its pieces: give their replicas back */
+	for (i = 0; i < plan->window; i++)
+		if (slot[i].plen != -1 && slot[i].replica != -1)
+			autoscale_done(code, slot[i].replica, slot[i].gen, slot[i].arrival);
+	return verdict;
+}
+
+/* Session: run transform code over the len bytes in *data (a stored document, or a window
+of one), in place. In-process this is one kernel call; out of process the text goes to the
+microserver in pieces of whole characters that fit a datagram (document_piece()), one at a
+time, or several at once when the planner says so (-W). Reverse pieces come back to the
+mirrored place, in *scratch (the two buffers then swap). first is the byte yours looks at
+first: 1, as for any text, or 0 for a window where the kernel looks at the first byte.
+Returns ADMIT_OK, ADMIT_BUSY, ADMIT_EXPIRED or BATCH_FAILED, and counts the datagrams sent
+in *datagrams. */
+int run_document_step(int code, char **data, char **scratch, size_t len, int first, int priority, uint64_t deadline,
+					  struct trace_header *th, int *datagrams)
+{
+	struct trace_step st;
+	char piece[MAX_MESSAGE_LENGTH], *text = *data, *swap;
+	size_t p, next;						//piece [p, p + plen) of the document; yours looks at next index
+	int n, pad, plen, skip, mode, verdict = ADMIT_OK;
+	uint64_t predicted, start;
+
+	if (deadline && admission_now() >= deadline)
+		return ADMIT_EXPIRED;
+	mode = plan_step(code, len, len / (MAX_MESSAGE_LENGTH - 3) + 1, plan_parallel_ok(code), &predicted);
+	start = plan_now();
+
+	if (inprocess(code))
+	{
+		/* yours from byte 0: that byte is replaced unless a space, then the kernel goes on
+		as over a text that starts one byte later */
+		skip = code == 6 && first == 0 && len > 0 && !isspace((unsigned char)text[0]);
+		if (skip)
+			text[0] = 'Z';
+		if ((size_t)plugins[code]->kernel(text + skip, len - skip, text + skip, len - skip) != len - skip)
+			verdict = BATCH_FAILED;
+		else
+			plan_kernel(code, len, plan_now() - start);
+		plan_step_done(code, mode, predicted, start, verdict == ADMIT_OK);
+		return verdict;
+	}
+
+	if (mode == PLAN_PARALLEL)
+		verdict = run_document_parallel(code, text, *scratch, len, first, th, datagrams);
+	else
+		for (p = 0, next = first; p < len && verdict == ADMIT_OK; p += plen)
+		{
+			plen = document_piece(code, text, len, p, &next, piece, &pad);
+			n = run_step(code, piece, pad + plen, priority, deadline, th, &st);
+			(*datagrams)++;
+			if (n < 0)
+				verdict = n;
+			else if (n != pad + plen)
+				verdict = BATCH_FAILED;
+			else
+				memcpy(code == 2 ? *scratch + len - p - plen : text + p, piece + pad, plen);
+		}
+	plan_step_done(code, mode, predicted, start, verdict == ADMIT_OK);
+	if (verdict == ADMIT_OK && code == 2)
+	{
+		swap = *data;
+		*data = *scratch;
+		*scratch = swap;
+	}
+	return verdict;
+}
+
+/* Session: run chain over a whole stored document (client option 7), step by step with
+run_document_step() */
+int run_document(const char *chain, char **data, char **scratch, size_t len, int priority, uint64_t deadline,
+				 int *datagrams)
+{
+	struct trace_header th;
+	int c, verdict;
+
+	memset(&th, 0, sizeof(th));
+	th.magic = TRACE_MAGIC;
+	th.trace_id = next_trace_id();
+	*datagrams = 0;
+
+	for (c = 0; chain[c] >= '1' && chain[c] <= '0' + NUM_TRANSFORMS; c++)
+		if ((verdict = run_document_step(chain[c] - '0', data, scratch, len, 1, priority, deadline, &th, datagrams)) !=
+			ADMIT_OK)
+			return verdict;
+	return ADMIT_OK;
+}
+
+/* Session: client option 6, "6 <bytes>" and the document: store it and answer its handle.
+Returns -1 when the stream cannot be followed any more and the session should end. */
+int handle_upload(char *selin)
+{
+	char line[64], handle[24], *data;
+	unsigned char *index;
+	unsigned long bytes = 0;
+	uint64_t hash;
+	int r;
+
+	selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+	sscanf(selin + 1, "%lu", &bytes);
+	PROBE3(request, sessionseq, '6', bytes);
+
+	/* a document that is not taken still has to be read past, or the session ends */
+	if (bytes > DOCSTORE_MAX_BYTES || (data = bufpool_get(bytes + 1)) == NULL)
+	{
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+		return -1;
+	}
+	if ((r = session_recv_payload(data, bytes)) <= 0 && bytes > 0)
+	{
+		bufpool_put(data);
+		return -1;
+	}
+	capture_request("", 0, data, bytes);
+	if ((r = docstore_put(data, bytes, &hash)) == -1)
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+	else
+	{
+		/* a new document gets its yours index, for range reads (option 9) */
+		if (r == 1 && (index = bufpool_get(docindex_size(bytes) + 1)) != NULL)
+		{
+			docindex_build(data, bytes, index);
+			docstore_attach(hash, index, docindex_size(bytes));
+			bufpool_put(index);
+		}
+		snprintf(handle, sizeof(handle), "%016llx", (unsigned long long)hash);
+		BLOG(BL_INFO, EV_DOC_STORED, bytes, r, docs->inmemory << 32 | docs->spilled, handle);
+		snprintf(line, sizeof(line), "%s %s %lu\n", DOC_REPLY, handle, bytes);
+		session_send_all(line, strlen(line));
+	}
+	bufpool_put(data);
+	return 0;
+}
+
+/* Session: client option 7, "7 <handle> [priority deadline_ms]" and a chain: run the stored
+document through the chain and send it back. Returns -1 when the session should end. */
+int handle_document(char *selin, uint32_t clientip)
+{
+	char handle[MAX_MESSAGE_LENGTH] = "", chain[MAX_MESSAGE_LENGTH], line[64];
+	char *data = NULL, *scratch = NULL;
+	int priority = PRIO_NORMAL, deadlinems = 0, verdict = ADMIT_OK, datagrams = 0, zerocopy = 0, fd;
+	uint64_t hash, len = 0, deadline;
+	struct iovec iov[2];
+
+	selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+	sscanf(selin + 1, "%99s %d %d", handle, &priority, &deadlinems);
+	if (priority < PRIO_INTERACTIVE || priority > PRIO_BULK)
+		priority = PRIO_NORMAL;
+	if (session_recv_frame(chain) <= 0)
+		return -1;
+	capture_request(chain, MAX_MESSAGE_LENGTH, NULL, 0);
+	PROBE3(request, sessionseq, '7', strlen(chain));
+	deadline = deadlinems > 0 ? admission_now() + deadlinems * 1000000ULL : 0;
+	if (zc_nheld > 0 && !sessionuring)
+		zc_reap(childsockfd, 0);
+
+	if (docstore_parse(handle, &hash) == -1 || (fd = docstore_open(hash, &len)) == -1)
+	{
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+		return 0;
+	}
+	snprintf(line, sizeof(line), "%s %llu\n", DOC_REPLY, (unsigned long long)len);
+
+	/* no steps (and no codec, which needs the bytes in memory): the file goes from the page
+	cache to the socket */
+	if (!sessioncodec && (chain[0] < '1' || chain[0] > '0' + NUM_TRANSFORMS))
+	{
+		if (session_send_all(line, strlen(line)) == -1 || zc_send_file(childsockfd, fd, 0, len) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+		PROBE3(response, sessionseq, len, ADMIT_OK);
+	}
+	else
+	{
+		if ((data = bufpool_get(len + 1)) == NULL || (scratch = bufpool_get(len + 1)) == NULL ||
+			docstore_read(fd, data, 0, len) == -1)
+			verdict = BATCH_FAILED;
+		else if (admission_take_token(clientip) == -1)
+			verdict = ADMIT_BUSY;
+		else
+			verdict = run_document(chain, &data, &scratch, len, priority, deadline, &datagrams);
+		BLOG(BL_INFO, EV_DOC_RUN, len, datagrams, verdict, chain);
+
+		iov[0].iov_base = line;
+		iov[0].iov_len = strlen(line);
+		iov[1].iov_base = data;
+		iov[1].iov_len = len;
+		if (verdict == ADMIT_OK &&
+			(sessioncodec ? session_send_all(line, strlen(line)) == -1 || session_send_payload(data, len) == -1
+						  : session_sendv_all(iov, 2, &zerocopy) == -1))
+			verdict = BATCH_FAILED;
+	}
+	close(fd);
+
+	if (verdict == ADMIT_BUSY)
+		session_send_all(BUSY_MESSAGE, strlen(BUSY_MESSAGE));
+	else if (verdict == ADMIT_EXPIRED)
+		session_send_all(EXPIRED_MESSAGE, strlen(EXPIRED_MESSAGE));
+	else if (verdict != ADMIT_OK)
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+	if (data != NULL)
+		PROBE3(response, sessionseq, verdict == ADMIT_OK ? len : 0, verdict);
+	bufpool_put(scratch);
+	while (zerocopy && zc_hold(data) == -1)
+		session_zc_wait();
+	if (!zerocopy)
+		bufpool_put(data);
+	return 0;
+}
+
+/* Session: client option 9, "9 <handle> <from> <to> [priority deadline_ms]" and a chain: send
+bytes [from, to) of the stored document's result, running every step over the window of its
+input that range_plan() says it needs (see rangeread.h) instead of the whole document.
+Returns -1 when the session should end. */
+int handle_range(char *selin, uint32_t clientip)
+{
+	char handle[MAX_MESSAGE_LENGTH] = "", chain[MAX_MESSAGE_LENGTH], line[64];
+	char *data = NULL, *scratch = NULL;
+	unsigned long long from = 0, to = 0;
+	int priority = PRIO_NORMAL, deadlinems = 0, verdict = ADMIT_OK, datagrams = 0, zerocopy = 0;
+	int fd, indexfd, nsteps, i, code, first;
+	uint64_t hash, len = 0, deadline, outlo, work = 0;
+	size_t size;
+	struct range_window win[RANGE_MAX_STEPS + 1];
+	struct trace_header th;
+	struct iovec iov[2];
+
+	selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+	sscanf(selin + 1, "%99s %llu %llu %d %d", handle, &from, &to, &priority, &deadlinems);
+	if (priority < PRIO_INTERACTIVE || priority > PRIO_BULK)
+		priority = PRIO_NORMAL;
+	if (session_recv_frame(chain) <= 0)
+		return -1;
+	capture_request(chain, MAX_MESSAGE_LENGTH, NULL, 0);
+	PROBE3(request, sessionseq, '9', to > from ? to - from : 0);
+	deadline = deadlinems > 0 ? admission_now() + deadlinems * 1000000ULL : 0;
+	if (zc_nheld > 0 && !sessionuring)
+		zc_reap(childsockfd, 0);
+
+	if (docstore_parse(handle, &hash) == -1 || from > to || (fd = docstore_open(hash, &len)) == -1)
+	{
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+		return 0;
+	}
+	if (to > len)
+		to = len;
+	if (from > to)
+		from = to;
+	snprintf(line, sizeof(line), "%s %llu\n", DOC_REPLY, to - from);
+	nsteps = range_plan(chain, len, from, to, win);
+
+	/* no steps: that part of the file goes straight to the socket */
+	if (nsteps == 0 && !sessioncodec)
+	{
+		if (session_send_all(line, strlen(line)) == -1 || zc_send_file(childsockfd, fd, from, to - from) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		PROBE3(response, sessionseq, to - from, ADMIT_OK);
+		return 0;
+	}
+
+	memset(&th, 0, sizeof(th));
+	th.magic = TRACE_MAGIC;
+	th.trace_id = next_trace_id();
+	indexfd = docstore_open_sidecar(hash);
+	size = win[0].hi - win[0].lo;
+	if ((data = bufpool_get(size + 1)) == NULL || (scratch = bufpool_get(size + 1)) == NULL ||
+		docstore_read(fd, data, win[0].lo, size) == -1)
+		verdict = BATCH_FAILED;
+	else if (admission_take_token(clientip) == -1)
+		verdict = ADMIT_BUSY;
+
+	/* each step over its window; the next step's window is inside this one's output,
+	which is at the same place, or mirrored after reverse */
+	for (i = 0; verdict == ADMIT_OK && i < nsteps; i++)
+	{
+		code = chain[i] - '0';
+		size = win[i].hi - win[i].lo;
+		first = code == 6 && docindex_looked(fd, indexfd, len, win[i].mirrored, win[i].lo) ? 0 : 1;
+		verdict = run_document_step(code, &data, &scratch, size, first, priority, deadline, &th, &datagrams);
+		work += size;
+		outlo = code == 2 ? len - win[i].hi : win[i].lo;
+		memmove(data, data + (win[i + 1].lo - outlo), win[i + 1].hi - win[i + 1].lo);
+	}
+
+	if (indexfd != -1)
+		close(indexfd);
+	close(fd);
+	BLOG(BL_INFO, EV_DOC_RANGE, to - from, work, datagrams, chain);
+
+	iov[0].iov_base = line;
+	iov[0].iov_len = strlen(line);
+	iov[1].iov_base = data;
+	iov[1].iov_len = to - from;
+	if (verdict == ADMIT_OK &&
+		(sessioncodec ? session_send_all(line, strlen(line)) == -1 || session_send_payload(data, to - from) == -1
+					  : session_sendv_all(iov, 2, &zerocopy) == -1))
+		verdict = BATCH_FAILED;
+	if (verdict == ADMIT_BUSY)
+		session_send_all(BUSY_MESSAGE, strlen(BUSY_MESSAGE));
+	else if (verdict == ADMIT_EXPIRED)
+		session_send_all(EXPIRED_MESSAGE, strlen(EXPIRED_MESSAGE));
+	else if (verdict != ADMIT_OK)
+		session_send_all(DOC_ERROR_MESSAGE, strlen(DOC_ERROR_MESSAGE));
+	PROBE3(response, sessionseq, verdict == ADMIT_OK ? to - from : 0, verdict);
+	bufpool_put(scratch);
+	while (zerocopy && zc_hold(data) == -1)
+		session_zc_wait();
+	if (!zerocopy)
+		bufpool_put(data);
+	return 0;
+}
+
 /* This is a signal handler to do graceful exit if needed */
 void catcher(int sig)
 {
+	capture_flush();
+	lowlat_report(1);
 	close(childsockfd);
 	exit(0);
 }
 
 /* Main program for server */
-int main()
+int main(int argc, char *argv[])
 {
+	int opt;
+	int code;
+	int maxsessions = ADMISSION_MAX_SESSIONS, maxinflight = 0, maxqueue = 0;
+	int coalesceslots = 0;				//-J: 0, no coalescing
+	int flight;							//slot this request leads in the coalescing table, or COALESCE_*
+	double ratelimit = 0, burst = 0;
+	long docbudget = 0;					//-D: bytes of documents kept in memory; 0, no document store
+	char *spilldir = DOCSTORE_SPILL_DIR;	//-E
+	int planwindow = 0;					//-W: 0, no planner
+	int slot;							//admission slot of the session being forked
+	struct sockaddr_in clientaddr;		//for the per-client token bucket
+	socklen_t clientlen;
+	int verdict;						//ADMIT_OK, or why the current request is not run
+	int priority;						//class of the current request (option 3)
+	uint64_t deadline;					//its absolute deadline, 0: none
+
+	/* command line options; defaults keep the original single-box behaviour */
+	while ((opt = getopt(argc, argv, "p:u:s:g:t:T:S:F:Q:r:b:PL:X:C:I:c:z:N:J:R:A:Z:D:E:W:")) != -1)
+	{
+		if (opt == 'p')
+			port = atoi(optarg);
+		else if (opt == 'u')
+			udpport = atoi(optarg);
+		else if (opt == 's' && optarg[0] >= '1' && optarg[0] <= '0' + NUM_TRANSFORMS && optarg[1] == '=')
+			serviceport[optarg[0] - '0'] = atoi(optarg + 2);
+		else if (opt == 'g')
+			logfile = optarg;
+		else if (opt == 't')
+			tracerate = atof(optarg);
+		else if (opt == 'T')
+			tracefile = optarg;
+		else if (opt == 'S')
+			maxsessions = atoi(optarg);
+		else if (opt == 'F')
+			maxinflight = atoi(optarg);
+		else if (opt == 'Q')
+			maxqueue = atoi(optarg);
+		else if (opt == 'r')
+			ratelimit = atof(optarg);
+		else if (opt == 'b')
+			burst = atof(optarg);
+		else if (opt == 'P')
+			useuring = 0;
+		else if (opt == 'L')
+			plugin_load_dir(optarg);
+		else if (opt == 'C')
+			cache.cap = atol(optarg);
+		else if (opt == 'I')
+			incrchains = atoi(optarg);
+		else if (opt == 'c')
+			capturefile = optarg;
+		else if (opt == 'z')
+			codecthreshold = atoi(optarg);
+		else if (opt == 'N')
+			nodefile = optarg;
+		else if (opt == 'J')
+			coalesceslots = atoi(optarg);
+		else if (opt == 'R' && lowlat_parse(optarg) == 0)
+			useuring = 0;		//spinning receives need plain sockets
+		else if (opt == 'A' && autoscale_parse(optarg, NUM_TRANSFORMS) == 0)
+			;
+		else if (opt == 'Z')
+			zcthreshold = atol(optarg);
+		else if (opt == 'D')
+			docbudget = atol(optarg);
+		else if (opt == 'E')
+			spilldir = optarg;
+		else if (opt == 'W')
+			planwindow = atoi(optarg);
+		else if (opt == 'X')
+		{
+			for (char *c = optarg; *c != '\0'; c++)
+				if (*c >= '1' && *c <= '0' + NUM_TRANSFORMS)
+					isolated[*c - '0'] = 1;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-p tcpport] [-u udpport] [-s code=port ...] [-g logfile] [-t rate] [-T tracefile]\n"
+							"\t[-S sessions] [-F inflight] [-Q queue] [-r rate -b burst] [-P] [-L plugindir] [-X codes]\n"
+							"\t[-C bytes [-I chains]] [-c capturefile] [-z threshold] [-N nodefile] [-J slots] [-R spec]\n"
+							"\t[-A code=min:max[:latency_us[:depth]] ...] [-Z bytes] [-D bytes [-E spilldir]] [-W window]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* map the shared binary log before forking, so every child inherits it */
+	if (binlog_open(logfile) == -1)
+		fprintf(stderr, "master server: cannot open log %s, logging disabled\n", logfile);
+	if (tracerate > 0 && trace_file_open(tracefile) == -1)
+	{
+		fprintf(stderr, "master server: cannot create trace file %s, tracing disabled\n", tracefile);
+		tracerate = 0;
+	}
+	if (capturefile != NULL && capture_open(capturefile) == -1)
+		fprintf(stderr, "master server: cannot open capture file %s, capture disabled\n", capturefile);
+	if (nodefile != NULL && ((nodering = hashring_create()) == NULL || hashring_load(nodering, nodefile) == -1))
+	{
+		fprintf(stderr, "master server: cannot set up the node ring from %s!\n", nodefile);
+		exit(1);
+	}
+	if (coalesceslots > 0 && coalesce_init(coalesceslots) == -1)
+		fprintf(stderr, "master server: cannot set up request coalescing, disabled\n");
+	if (docbudget > 0 && docstore_init(docbudget, spilldir, port) == -1)
+		fprintf(stderr, "master server: cannot set up the document store in %s and %s, disabled\n", DOCSTORE_MEMORY_DIR, spilldir);
+	if (planwindow > 0 && plan_init(planwindow) == -1)
+		fprintf(stderr, "master server: cannot set up the planner, disabled\n");
+	if (admission_init(maxsessions, maxinflight, maxqueue, ratelimit, burst) == -1)
+	{
+		fprintf(stderr, "master server: cannot set up admission control!\n");
+		exit(1);
+	}
+	/* the controller and its zygotes: before lowlat_enter(), they are not on the hot path */
+	if (autoscale_start(msnames, logfile) == -1)
+	{
+		fprintf(stderr, "master server: cannot start the autoscaling controller!\n");
+		exit(1);
+	}
+	lowlat_enter(-1, "master");		//after the shared maps, so they are locked too
 	
 /////////////////////
 ////TCP setup///////
@@ -71,7 +1763,6 @@ int main()
 	char transformin[MAX_MESSAGE_LENGTH];//stores options that TCP client provides
 	int parentsockfd;					 //TCP listening socket for initial connection to client
 	int pid;
-	int mspid;							 //process id for forking microservers
 	static struct sigaction act;		 //for weird error handling in TCP setup
 
 
@@ -80,6 +1771,21 @@ int main()
 	sigfillset(&(act.sa_mask));
 	sigaction(SIGPIPE, &act, NULL);
 
+	/* finished sessions interrupt accept() (no SA_RESTART) so they can be reaped */
+	static struct sigaction chld;
+	chld.sa_handler = childdone;
+	sigemptyset(&chld.sa_mask);
+	sigaction(SIGCHLD, &chld, NULL);
+
+	/* kill -HUP re-reads the node list, also without SA_RESTART */
+	static struct sigaction hup;
+	if (nodering != NULL)
+	{
+		hup.sa_handler = nodeshup;
+		sigemptyset(&hup.sa_mask);
+		sigaction(SIGHUP, &hup, NULL);
+	}
+
 	/* 1a- Initialize server sockaddr structure */
 	memset(&serverTCP, 0, sizeof(serverTCP));	  //fill/clear in the memory area the server struct holds, with 0's
 	serverTCP.sin_family = AF_INET;				  //server attribute set as IPV4
@@ -101,7 +1807,8 @@ int main()
 	}
 
 	/*3- start listening for incoming connections from clients */
-	if (listen(parentsockfd, 5) == -1)
+	/* a short backlog only makes clients retry SYNs; over the session cap they get BUSY instead */
+	if (listen(parentsockfd, SOMAXCONN) == -1)
 	{
 		fprintf(stderr, "master server: listen() call failed!\n");
 		exit(1);
@@ -111,7 +1818,13 @@ int main()
 	bzero(messagein, MAX_MESSAGE_LENGTH);
 	bzero(messageout, MAX_MESSAGE_LENGTH);
 
-	fprintf(stderr, "Master server started!\n");
+	/* io_uring for accepts; every session sets up its own ring after the fork */
+	if (useuring && uring_init(&ring, 64) == 0)
+		arm_accept(parentsockfd);
+	else
+		useuring = 0;
+
+	fprintf(stderr, "Master server started (%s)!\n", useuring ? "io_uring" : "plain syscalls");
 	fprintf(stderr, "Server listening on TCP port %d...\n\n", port);
 /////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -122,19 +1835,21 @@ int main()
 /////////////////////
 
 	/*1A- UDP clients initial variables*/
-	#define SERVER_IP "127.0.0.1" 		/* loopback interface */ //; ip of master server to connect to
-	struct sockaddr_in si_server;		//server struct
-	struct sockaddr *server;			//ease of use pointer
-	int s; 								//listening socketid for server responses
-	int len = sizeof(si_server);
-	char buf[MAX_MESSAGE_LENGTH];		//sends to and receives from UDP microservices
+	char buf[MAX_MESSAGE_LENGTH + 1];	//sends to and receives from UDP microservices; room for the answer's newline
+	int len = 0;						//length of the sentence
+	int buflen;							//length of the text in buf
+	int chainlen;						//length of the current chain
 	int readBytes; 						//# of bytes received from microservices response
+	struct trace_header th;				//goes in front of buf in every datagram
+	struct trace_step steps[MAX_MESSAGE_LENGTH];	//per-step timing of the current request
+	char tracechain[MAX_MESSAGE_LENGTH];	//codes actually run, for the exported trace
+	uint64_t tracestart;
+	long long poolwarm = -1;			//pooled blocks the heap gave for the first request; -1 before it
 
 	//1B- set up server structures attributes
 	memset((char *)&si_server, 0, sizeof(si_server));
 	si_server.sin_family = AF_INET;							//IPv4
 	si_server.sin_port = htons(port);						//port that receives UDP responses
-	server = (struct sockaddr *)&si_server; 				//eas of use variable pointing to struct
 
 
 	/*
@@ -161,11 +1876,31 @@ int main()
 		/* TCP-accept a connection from client;
 		Store client port and IP info in childsockfd;
 		Can now use childsockfd to TCP send-rec between server and client */
-		if ((childsockfd = accept(parentsockfd, NULL, NULL)) == -1)
+		reap_sessions();
+		if (reloadnodes)
+		{
+			reloadnodes = 0;
+			hashring_load(nodering, nodefile);	//sessions see the new ring with their next step
+		}
+		clientlen = sizeof(clientaddr);
+		if (ring.fd != -1)
+			clientlen = 0;		//the session looks its client up with getpeername()
+		if ((childsockfd = ring.fd != -1 ? ring_accept(parentsockfd)
+										 : accept(parentsockfd, (struct sockaddr *)&clientaddr, &clientlen)) == -1)
 		{
+			if (errno == EINTR)
+				continue;		//a session ended
 			fprintf(stderr, "master server: accept() call failed!\n");
 			exit(1);
 		}
+		PROBE2(accept, sessionseq, childsockfd);
+
+		/* load shedding: over the session cap, answer BUSY without forking */
+		if ((slot = admission_session_start()) == -1)
+		{
+			reject_client(childsockfd);
+			continue;
+		}
 
 		/* try to create a child process to deal with this new client;
 		done once the client sucessfully connects to the TCP server;
@@ -189,195 +1924,294 @@ int main()
 			/* don't need the parent listener socket that was inherited;
 			but the parent process will still have it and listen for new clients */
 			close(parentsockfd);
+			uring_exit(&ring);			//the parent's accept ring
+			adm_slot = slot;
+			signal(SIGCHLD, SIG_IGN);	//microservers forked per step are reaped automatically
+			signal(SIGHUP, SIG_DFL);	//only the parent reloads the node list
+			traceseq = ((uint64_t)getpid() << 32) ^ trace_now();
+			if (clientlen == 0)
+			{
+				clientlen = sizeof(clientaddr);
+				getpeername(childsockfd, (struct sockaddr *)&clientaddr, &clientlen);
+			}
+			/*a batch answer is a line and then its payload: two sends that Nagle
+			would hold back for the client's delayed ACK*/
+			setsockopt(childsockfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+			/*one UDP socket for all of this session's chain steps;
+			AF_INET: IPv4 protocol/  /SOCK_DRAM: socket type is UDP/   /IPPROTO_UDP: UDP Protocol/*/
+			if ((udpsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+			{
+				printf("Could not set up a socket!\n");
+				return 1;
+			}
+			sessionuring = useuring && session_ring_start(udpsock) == 0;
+			lowlat_enter(sessionseq, "session");	//its own core; memory locks are not inherited
+			lowlat_socket(udpsock);
+			lowlat_socket(childsockfd);
+			if (zcthreshold > 0)
+				zc_init(childsockfd, zcthreshold);
+			capture_session(sessionseq);
 
 
 			/*receive option selection from main client*/
 			char selin[MAX_MESSAGE_LENGTH];
-			while( (recv(childsockfd, selin, MAX_MESSAGE_LENGTH,0)) > 0 )
+			while( (session_recv_frame(selin)) > 0 )
 			{
+								capture_select(selin);
 								
 								//client chose to enter a sentence
 								if(selin[0] == '1')
 								{
-									//clear old buffers
-									bzero(messagein, MAX_MESSAGE_LENGTH);									
-									bzero(selin, MAX_MESSAGE_LENGTH);
-
-									//receive sentence from client; store in messagei
-									printf("Child process gets ready for sentence from client...\n");
-									recv(childsockfd, messagein, MAX_MESSAGE_LENGTH,0);
-									strncpy(buf, messagein, MAX_MESSAGE_LENGTH);							//make a copy of sentence to maintain original sentence
-									printf("Sentence received...\n");
+									//receive sentence from client; store in messagein, which keeps the original sentence
+									session_recv_frame(messagein);
+									capture_request(messagein, MAX_MESSAGE_LENGTH, NULL, 0);
+									len = strlen(messagein);
+									PROBE3(request, sessionseq, '1', len);
+									if (incrchains > 0 && cache.root != NULL)
+									{
+										/*an edited sentence: carry the last chains over instead of starting again*/
+										rebasesteps = rebasebytes = fullbytes = 0;
+										rebase_children(cache.root, messagein, len,
+														cache.clock >= (uint64_t)incrchains ? cache.clock - incrchains + 1 : 0);
+										if (cache.root != NULL)
+											chaincache_retext(&cache, cache.root, messagein, len);
+										chaincache_trim(&cache, 0, cache.root);
+										BLOG(BL_INFO, EV_REBASE, rebasesteps, rebasebytes, fullbytes, NULL);
+									}
+									else
+										chaincache_reset(&cache, messagein, len);	//cached prefixes were for the old sentence
+									BLOG(BL_INFO, EV_SENTENCE, len, 0, 0, messagein);
 									
 									continue;	//read in next option selection from user			
 								}
 								
 
-								//client chose to transform current message
-								if(selin[0] == '2')
+								//client chose to transform current message;
+								//option 3 also carries "priority deadline_ms" after the option character
+								if(selin[0] == '2' || selin[0] == '3')
 								{
-										//clear option buffer just in case
-										bzero(selin, MAX_MESSAGE_LENGTH);
-
-
+										int deadlinems = 0;
 
+										priority = PRIO_NORMAL;
+										if (selin[0] == '3')
+										{
+											selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+											sscanf(selin + 1, "%d %d", &priority, &deadlinems);
+											if (priority < PRIO_INTERACTIVE || priority > PRIO_BULK)
+												priority = PRIO_NORMAL;
+										}
 
 										/* obtain the null-terminated transform
 										key message from this client; store in transformin;
 										recv is blocking syscall- waits at this
 										line until message is recieved from client;
 										*/
-										recv(childsockfd, transformin, MAX_MESSAGE_LENGTH, 0);		//receiving transform key's
+										session_recv_frame(transformin);		//receiving transform key's
+										capture_request(transformin, MAX_MESSAGE_LENGTH, NULL, 0);
+										chainlen = strlen(transformin);
+										PROBE3(request, sessionseq, selin[0], chainlen);
+										deadline = deadlinems > 0 ? admission_now() + deadlinems * 1000000ULL : 0;
 										
 
 
 
-												printf("Child process received requested transformation: %s\n", transformin);
+												BLOG(BL_INFO, EV_CHAIN, chainlen, 0, 0, transformin);
 
-												/*perform concatenated or single transformations to messagein*/
-												for(int i = 0; i < strlen(transformin); i++)
+												/*every request gets a trace id; a sampled fraction is exported*/
+												memset(&th, 0, sizeof(th));
+												th.magic = TRACE_MAGIC;
+												th.trace_id = next_trace_id();
+												if (tracerate > 0 && (th.trace_id % 1000000) < tracerate * 1000000)
+													th.flags |= TRACE_SAMPLED;
+												tracestart = trace_now();
+
+												/*per-client rate limit: an empty token bucket sheds the request*/
+												verdict = admission_take_token(clientaddr.sin_addr.s_addr) == -1 ? ADMIT_BUSY : ADMIT_OK;
+
+												/*resume from the longest chain prefix already computed for this sentence
+												(or from the sentence itself): the one copy of the request, the steps
+												then work on buf in place; the reused steps show up in the trace with
+												zero duration*/
+												struct chain_node *node;
+												int reused = chaincache_lookup(&cache, transformin, &node);
+												if (node != NULL)
+												{
+													buflen = node->len;
+													memcpy(buf, node->text, buflen + 1);
+												}
+												else
 												{
+													buflen = len;
+													memcpy(buf, messagein, buflen + 1);
+												}
+												for (int i = 0; i < reused; i++)
+												{
+													memset(&steps[i], 0, sizeof(steps[i]));
+													steps[i].code = transformin[i] - '0';
+													steps[i].t_send = steps[i].t_recv = tracestart;
+												}
+												if (reused > 0)
+													BLOG(BL_INFO, EV_CACHE_HIT, reused, chainlen, 0, transformin);
+												PROBE4(chain, sessionseq, chainlen, reused, th.trace_id);
+
+												/*the same sentence and chain in flight in another session:
+												wait for its answer instead of dispatching the steps again (-J)*/
+												flight = COALESCE_ALONE;
+												if (verdict == ADMIT_OK && reused < chainlen)
+												{
+													flight = coalesce_begin(messagein, transformin, deadline, buf);
+													if (flight == COALESCE_JOINED)
+													{
+														reused = chainlen;
+														buflen = strlen(buf);
+														th.flags &= ~TRACE_SAMPLED;		//no steps of its own to show
+														BLOG(BL_INFO, EV_COALESCED, coal->joined, coal->led, coal->stepssaved, transformin);
+													}
+													else if (flight == COALESCE_EXPIRED)
+														verdict = ADMIT_EXPIRED;
+												}
 
-														
-														char *mname;					//exec filepath
-
-														if( transformin[i] == '1')
-															{
-																/*Identity*/
-																mname = "./identity.out";
-																
-															}
-															else if( transformin[i] == '2')
-															{
-																/*Reverse*/
-																mname = "./reverse.out";
-																
-															}
-															else if( transformin[i] == '3')
-															{
-																/*Upper*/
-																mname = "./upper.out";
-																
-															}
-															else if( transformin[i] == '4')
-															{
-																/*Lower*/
-																mname = "./lower.out";
-																
-															}
-															else if( transformin[i] == '5')
-															{
-																/*Caesar*/
-																mname = "./caesar.out";
-																
-															}
-															else if( transformin[i] == '6')
-															{
-																/*Yours*/
-																mname = "./yours.out";
-																
-															}
-															else
-															{
-																break;
-															}
-
-															/*set port (in master server UDP struct)for communiation with microserver*/
-															si_server.sin_port = htons(udpport);
-
-
-
-
-															/*start remote microserver in a forked process*/
-															mspid = fork();
-															if( mspid  == 0)
-															{
-																	//child
-																	
-																	char *args[] = {mname, NULL};
-																	//execute microserver
-																	if (execvp(args[0],args) == -1)			//child terminates this process and is running server now;
-																	{
-																		printf("\nerror reached\n");
-																	}										
-															}
-															else
-															{
-																//parent waits for child to finish, otherwise parent will be 'sending' before microserver child is listening
-																sleep(1);
-															}
-
-																		/*microserver now waiting - Back to parent process*/
-
-
-
-
-
-
-															/*create listening socket descriptor id for responses*/
-															/*AF_INET: IPv4 protocol/  /SOCK_DRAM: socket type is UDP/   /IPPROTO_UDP: UDP Protocol/*/
-															if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
-															{
-																printf("Could not set up a socket!\n");
-																return 1;
-															}
-
-															fprintf(stderr, "UDP client online in master server!\n\n");
-														
-
-
-															/*send messagein from master server client  to microserver server;*/
-															if (sendto(s, buf, strlen(messagein), 0, server, sizeof(si_server)) == -1)
-															{
-															printf("sendto failed\n");
-															return 1;
-															}
-
-															/*clear buffer before receiving message back*/
-															bzero(buf, MAX_MESSAGE_LENGTH);
-
-															/*receive message from microservice into buf of master server*/
-															if ((readBytes=recvfrom(s, buf, MAX_MESSAGE_LENGTH, 0, server, &len))==-1)
-															{
-															printf("Read error!\n");
-															return -1;
-															}
-
-															//proper null-termination of string so it can be used further if needed
-															buf[readBytes] = '\0';    
-
-															//print to output in master server
-															printf("Answer from microserver received by master server: %s\n", buf);							
-
-													
+												/*perform concatenated or single transformations to messagein*/
+												for(int i = reused; verdict == ADMIT_OK && i < chainlen; i++)
+												{
+														code = transformin[i] - '0';
+														if (code < 1 || code > NUM_TRANSFORMS)
+															break;
+
+														th.span_id = i;
+														readBytes = run_planned_step(code, buf, buflen, priority, deadline, &th, &steps[i]);
+														if (readBytes < 0)
+														{
+															verdict = readBytes;		//ADMIT_BUSY or ADMIT_EXPIRED
+															break;
+														}
+														buflen = readBytes;
+														node = chaincache_insert(&cache, node, code, buf, readBytes);
 												}//end for
+												coalesce_end(flight, buf, verdict == ADMIT_OK);
+
+												/*export the whole chain's trace if this request was sampled*/
+												if ((th.flags & TRACE_SAMPLED) && verdict == ADMIT_OK)
+												{
+													int nsteps = 0;
+													while (nsteps < MAX_MESSAGE_LENGTH - 1 && transformin[nsteps] >= '1' && transformin[nsteps] <= '0' + NUM_TRANSFORMS)
+														nsteps++;
+													memcpy(tracechain, transformin, nsteps);
+													tracechain[nsteps] = '\0';
+													trace_export(tracefile, th.trace_id, tracechain, tracestart, trace_now(), steps, nsteps);
+												}
 												
 												
-												/* create the message that goes from
-												master server to TCP client (as an ASCII string) */
-												sprintf(messageout, "%s\n", buf);
-												printf("Child about to send message to TCP client: %s\n", messageout);
+												/* the message that goes from master server to TCP client
+												(as an ASCII line): the result gets its newline right in buf */
+												const char *answer = buf;
+												int answerlen = buflen + 1;
+												if (verdict == ADMIT_BUSY)
+												{
+													answer = BUSY_MESSAGE;
+													answerlen = sizeof(BUSY_MESSAGE) - 1;
+												}
+												else if (verdict == ADMIT_EXPIRED)
+												{
+													answer = EXPIRED_MESSAGE;
+													answerlen = sizeof(EXPIRED_MESSAGE) - 1;
+												}
+												else
+												{
+													buf[buflen] = '\n';
+													buf[buflen + 1] = '\0';
+												}
+												BLOG(BL_INFO, EV_RESPONSE, answerlen, 0, 0, answer);
 											
 												/* send the result message back to the client */
-												send(childsockfd, messageout, strlen(messageout), 0);
-
-												/* clear out message strings again to be safe */
-												bzero(transformin, MAX_MESSAGE_LENGTH);
-												bzero(buf, MAX_MESSAGE_LENGTH);
-												bzero(messageout, MAX_MESSAGE_LENGTH);
-
+												session_send(answer, answerlen);
+												PROBE3(response, sessionseq, answerlen, verdict);
+												if (poolwarm == -1)
+													poolwarm = bufpool_stats.heap;		//what the first request needed
 
 												//continue looping for user to try further transformations on original string
-												strncpy(buf, messagein, MAX_MESSAGE_LENGTH);
 												continue;
 
 										
 								}//end option 2 if
+
+								//client asks for compressed batch payloads: "5 lz4"
+								if(selin[0] == '5')
+								{
+									char codec[16] = "";
+
+									selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+									sscanf(selin + 1, "%15s", codec);
+									capture_request("", 0, NULL, 0);
+									PROBE3(request, sessionseq, '5', strlen(codec));
+									sessioncodec = codecthreshold >= 0 && strcmp(codec, CODEC_NAME) == 0;
+									if (sessioncodec)
+										snprintf(messageout, MAX_MESSAGE_LENGTH, "%s %s %d\n", CODEC_REPLY, CODEC_NAME, codecthreshold);
+									else
+										snprintf(messageout, MAX_MESSAGE_LENGTH, "%s none\n", CODEC_REPLY);
+									session_send(messageout, strlen(messageout));
+									continue;
+								}
+
+								//client sent a batch of documents for one chain
+								if(selin[0] == '4')
+								{
+									if (handle_batch(selin, clientaddr.sin_addr.s_addr) == -1)
+										break;
+									if (poolwarm == -1)
+										poolwarm = bufpool_stats.heap;
+									continue;
+								}
+
+								//client uploads a document to the store, or transforms one (or a range of the result) by its handle
+								if(selin[0] == '6' || selin[0] == '7' || selin[0] == '9')
+								{
+									if ((selin[0] == '6'   ? handle_upload(selin)
+										 : selin[0] == '7' ? handle_document(selin, clientaddr.sin_addr.s_addr)
+														   : handle_range(selin, clientaddr.sin_addr.s_addr)) == -1)
+										break;
+									continue;
+								}
+
+								//client gives up its reference to a stored document: "8 <handle>"
+								if(selin[0] == '8')
+								{
+									char handle[MAX_MESSAGE_LENGTH] = "";
+									uint64_t hash;
+									int refs = -1;
+
+									selin[MAX_MESSAGE_LENGTH - 1] = '\0';
+									sscanf(selin + 1, "%99s", handle);
+									capture_request("", 0, NULL, 0);
+									PROBE3(request, sessionseq, '8', strlen(handle));
+									if (docstore_parse(handle, &hash) == 0)
+										refs = docstore_release(hash);
+									if (refs >= 0)
+										snprintf(messageout, MAX_MESSAGE_LENGTH, "%s %016llx %d\n", DOC_REPLY, (unsigned long long)hash, refs);
+									else
+										strcpy(messageout, DOC_ERROR_MESSAGE);
+									session_send(messageout, strlen(messageout));
+									continue;
+								}
 			} //end while
 
 
 			/* when client is no longer sending information to us, */
 			/* the socket can be closed and the child process terminated */
+			capture_flush();
+			if (poolwarm != -1)
+				BLOG(BL_INFO, EV_POOL, bufpool_stats.heap, bufpool_stats.heap - poolwarm, bufpool_stats.gets, NULL);
+			if (zc_stats.sends > 0)
+				BLOG(BL_INFO, EV_ZEROCOPY, zc_stats.sends, zc_stats.bytes, zc_stats.copied, NULL);
+			for (int m = 0; m < PLAN_MODES; m++)
+				if (plan_session[m].decisions > 0)
+					BLOG(BL_INFO, EV_PLAN, plan_session[m].decisions, plan_session[m].actual_ns, plan_session[m].error_ns,
+						 plan_mode_names[m]);
+			if (plansock != -1)
+				close(plansock);
+			lowlat_report(1);
+			close(udpsock);
 			close(childsockfd);
 			exit(0);
 		} /* end of then part for child */
@@ -393,8 +2227,9 @@ int main()
 
 
 
-			fprintf(stderr, "Master Server Created child process %d to handle new client\n", pid);
-			fprintf(stderr, "Parent going back to job of listening...\n\n");
+			admission_session_pid(slot, pid);
+			sessionseq++;
+			BLOG(BL_INFO, EV_SESSION_START, pid, 0, 0, NULL);
 
 			/* parent doesn't need the childsockfd */
 			close(childsockfd);
@@ -0,0 +1,229 @@
+/*
+Author Sajid Choudhry	Feb 2020
+Based on Dr.Carey Williamson's code
+
+Shared UDP microserver loop.
+Every microserver (identity, reverse, upper, lower, caesar, yours)
+receives a message from the master server through UDP,
+manipulates the text with its own kernel, and sends it back.
+Only the kernel differs, so the socket handling lives here.
+Built with -DTRANSFORM_PLUGIN, a microserver source is the in-process
+plugin of its kernel instead (see plugin.h) and this loop is left out.
+
+Usage (from a microserver's main):
+	return microserver_main(argc, argv, "Upper", upper_kernel);
+
+Command line of every microserver:
+	./upper.out [-p port] [-a address] [-l] [-g logfile] [-R spec] [-Z fd]
+		-p port	UDP port to listen on (default 8081)
+		-a address	IPv4 address to listen on (default all); loopback
+			addresses such as 127.0.0.2 and 127.0.0.3 stand in for
+			separate hosts of a node list (mainserver -N, see hashring.h)
+		-l	stay online and keep serving messages, instead of
+			answering a single message and exiting (used when the
+			microserver is started once, e.g. by the bench harness,
+			and the master is told its port with -s)
+		-g logfile	binary log to write to (default servers.blog, see binlog.h)
+		-R spec	low-latency mode: cpu pinning, busy polling, spinning
+			receives, locked memory, SCHED_FIFO (see lowlatency.h)
+		-Z fd	run as the zygote of an elastic pool: serve nothing,
+			fork replicas (each on its own free port) when the
+			master's controller asks on fd (see zygote.h)
+*/
+
+#ifndef MICROSERVER_H
+#define MICROSERVER_H
+
+#include "plugin.h"          //kernel signature, plugin export
+
+#ifndef TRANSFORM_PLUGIN
+/* Include files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "binlog.h"          //hot-path logging, see logdecode.c
+#include "trace.h"           //trace header in front of every datagram
+#include "lowlatency.h"      //-R: pinned, spinning, locked
+#include "zygote.h"          //-Z: fork ready replicas for the master
+#include "probes.h"          //USDT probes for perf and bpftrace
+
+/* Manifest constants */
+#define MAX_BUFFER_SIZE 100  /*max sentence size*/
+#define PORT 8081           /*client sends to this port and receives from this port*/
+                            /*client has its own dynamic port number*/
+#define DEBUG 1             /* Verbose debugging */
+
+
+/* Answer messages on the bound socket s with kernel: one, or until killed (stayonline) */
+static int microserver_serve(int s, transform_kernel kernel, int stayonline)
+{
+    struct sockaddr_in si_client;                 //server will store client IP and port in struct si_client when it receives a message
+    struct sockaddr *client = (struct sockaddr *) &si_client;
+    socklen_t len;
+    char messagein[MAX_BUFFER_SIZE];              //store messages received by client
+    char messageout[MAX_BUFFER_SIZE];             //store messages that will be sent to client
+    char datagram[sizeof(struct trace_header) + MAX_BUFFER_SIZE];   //trace header + message as received
+    struct trace_header th;                       //trace header of the current message
+    int traced;                                   //message came with a trace header
+    struct iovec iov[2];
+    struct msghdr mh;
+    pid_t mypid = getpid();
+    int readBytes;
+    size_t outBytes;
+
+    /* big loop, looking for incoming messages from clients */      //reloop back here after sending client answer; port remains the same
+    do
+    {
+                /* clear out message buffers to be safe */
+                bzero(messagein, MAX_BUFFER_SIZE);
+                bzero(messageout, MAX_BUFFER_SIZE);
+
+                /* see what comes in from a client, if anything */
+                len = sizeof(si_client);
+                if ((readBytes=lowlat_recvfrom(s, datagram, sizeof(datagram), 0, client, &len)) < 0)
+                  {
+                    printf("Read error!\n");
+                    return -1;
+                  }
+
+                /* strip the trace header, if the master sent one; keep room for the null */
+                traced = readBytes >= (int)sizeof(th) && ((struct trace_header *)datagram)->magic == TRACE_MAGIC;
+                if (traced)
+                  {
+                    memcpy(&th, datagram, sizeof(th));
+                    th.t_recv = trace_now();
+                    readBytes -= sizeof(th);
+                  }
+                if (readBytes > MAX_BUFFER_SIZE - 1)
+                    readBytes = MAX_BUFFER_SIZE - 1;
+                memcpy(messagein, datagram + (traced ? sizeof(th) : 0), readBytes);
+
+                //get client IP and port from client struct; the decoder formats them
+                BLOG(BL_INFO, EV_MS_RECEIVED, readBytes, si_client.sin_addr.s_addr, ntohs(si_client.sin_port), messagein);
+                PROBE2(ms_receive, traced ? th.trace_id : 0, readBytes);
+
+                /*manipulate the message*/
+                if (traced)
+                    th.t_transform_start = trace_now();
+                /* the kernel writes the outgoing message; by length, as a document piece may hold a null */
+                outBytes = kernel(messagein, readBytes, messageout, MAX_BUFFER_SIZE - 1);
+                messageout[outBytes] = '\0';
+                if (traced)
+                    th.t_transform_end = trace_now();
+                PROBE4(ms_transform, traced ? th.trace_id : 0, readBytes, outBytes, traced ? th.t_transform_end - th.t_transform_start : 0);
+
+                BLOG(BL_DEBUG, EV_MS_SENT, outBytes, 0, 0, messageout);
+
+                /* send the result message back to the client, behind the stamped trace header */
+                if (traced)
+                  {
+                    th.pid = mypid;
+                    th.t_send = trace_now();
+                    iov[0].iov_base = &th;
+                    iov[0].iov_len = sizeof(th);
+                    iov[1].iov_base = messageout;
+                    iov[1].iov_len = outBytes;
+                    memset(&mh, 0, sizeof(mh));
+                    mh.msg_name = client;
+                    mh.msg_namelen = len;
+                    mh.msg_iov = iov;
+                    mh.msg_iovlen = 2;
+                    sendmsg(s, &mh, 0);
+                  }
+                else
+                    sendto(s, messageout, outBytes, 0, client, len);
+                PROBE2(ms_send, traced ? th.trace_id : 0, outBytes);
+    } while (stayonline);
+
+    lowlat_report(1);
+    close(s);
+    return 0;
+}
+
+/* Run a microserver around a transform kernel */
+static int microserver_main(int argc, char *argv[], const char *name, transform_kernel kernel)
+{
+    struct sockaddr_in si_server;                 //struct object of type sockaddr_in called si_server
+    struct sockaddr *server;                      //pointer for ease of use in methods
+    int s;                                        //listening socket id
+    int port = PORT;                              //UDP port, -p overrides
+    int stayonline = 0;                           //-l: keep looping instead of one message
+    int zygotefd = -1;                            //-Z: the controller's socket
+    int opt;
+    char *logfile = BINLOG_DEFAULT_FILE;
+    struct in_addr address = {htonl(INADDR_ANY)};     //-a: listen on this address only
+
+    //0- command line options
+    while ((opt = getopt(argc, argv, "p:a:lg:R:Z:")) != -1)
+    {
+        if (opt == 'p')
+            port = atoi(optarg);
+        else if (opt == 'a' && inet_pton(AF_INET, optarg, &address) == 1)
+            ;
+        else if (opt == 'l')
+            stayonline = 1;
+        else if (opt == 'g')
+            logfile = optarg;
+        else if (opt == 'R' && lowlat_parse(optarg) == 0)
+            ;
+        else if (opt == 'Z')
+            zygotefd = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-p port] [-a address] [-l] [-g logfile] [-R spec] [-Z fd]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (binlog_open(logfile) == -1)
+        fprintf(stderr, "Could not open log %s, logging disabled\n", logfile);
+
+    //zygote: serve nothing here; zygote_main() returns in each replica, with its bound socket
+    if (zygotefd >= 0)
+    {
+        fprintf(stderr, "%s zygote online!\n", name);
+        s = zygote_main(zygotefd, address);
+        lowlat_enter(-1, name);
+        lowlat_socket(s);
+        lowlat_report_on_signal();
+        return microserver_serve(s, kernel, 1);
+    }
+
+    //1a- set up listening socket
+    //AF_INET: IPv4 protocol, SOCK_DGRAM: socket type UDP, IPPROTO_UDP: use UDP protocol
+    if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
+    {
+        printf("Could not setup a socket for UDP!\n");
+        return 1;
+    }
+   //1b- Initialize attributes of si_server struct
+    memset((char *) &si_server, 0, sizeof(si_server));    //fill in the memory area the si_server struct holds, with 0's
+    si_server.sin_family = AF_INET;                 //server attribute set as IPV4
+    si_server.sin_port = htons(port);               //PORT
+    si_server.sin_addr = address;
+    server = (struct sockaddr *) &si_server;        //set pointer to point to struct si_server
+
+
+    //2 bind listening socket (s) port # and IP # (from struct server)
+    if (bind(s, server, sizeof(si_server))==-1)
+      {
+            printf("Could not bind to port %d!\n", port);
+            return 1;
+      }
+
+    //3 low-latency mode: pin, lock, real-time class, busy polling on s
+    lowlat_enter(-1, name);
+    lowlat_socket(s);
+    lowlat_report_on_signal();
+
+    fprintf(stderr, "%s microserver online!\n", name);
+    printf("Microserver now listening on UDP port %d...\n", port);
+
+    return microserver_serve(s, kernel, stayonline);
+}
+#endif /* !TRANSFORM_PLUGIN */
+
+#endif /* MICROSERVER_H */
@@ -0,0 +1,261 @@
+/*
+Cost-based planner: where each step of a request runs (mainserver -W).
+
+A code that has an in-process plugin (-L) and also a microserver to go
+to (-s, the node ring -N or an elastic pool -A) can run either way, and
+which is cheaper depends on the request: a step on a sentence costs a
+kernel call in the session or one round trip, a step on a stored
+document (options 7 and 9) costs one kernel call over all of it or one
+round trip per datagram-sized piece. Without -W such a code always goes
+to its microserver. With -W the planner picks, per step:
+
+	local		the plugin's kernel, in the session
+	remote		the microserver, one piece at a time (run_step())
+	parallel	the microserver, with up to -W pieces in flight at once
+			(documents only, and only without an in-flight cap -F,
+			which counts one step per session); a pool spreads
+			them over its replicas
+
+from a cost model that every session keeps up to date, for every code,
+in one shared memory block mapped before the first fork (like the pool
+counters of autoscale.h, with atomic loads and stores and no lock; an
+update lost to a race only slows the averages down a little):
+
+	kernel		ns per call and ps per byte of the plugin, fitted
+			from every in-process run (small runs update the
+			per-call cost, large ones the per-byte cost)
+	hop		ns per datagram between the master and the
+			microserver, the round trip less the microserver's
+			own time (from the trace header it stamps)
+	service		the microserver's own ns per datagram
+	depth		remote steps of the code other sessions are running
+			right now; each one is a datagram ahead of ours
+
+Predicted costs, for n datagrams of bytes in all:
+	local		kernel per call + bytes * kernel per byte
+	remote		n * (hop + service) * (1 + depth)
+	parallel	ceil(n / window) * hop + n * service * (1 + depth)
+The cheapest wins. Until a code has run both in-process and remotely the
+missing one is tried first, and every PLAN_EXPLORE-th decision for a code
+takes the runner-up, so the model keeps following the load. Every decision is timed and
+counted per mode with its predicted and actual time: the sessions log
+their counters when they end (EV_PLAN), and the USDT probes plan and
+plan_done (probes.h) show every decision as it happens.
+
+Usage:
+	plan_init(window);							//parent, before forking; 0 or -1
+	mode = plan_choose(code, bytes, datagrams, parallel_ok, &predicted);
+	t = plan_now(); ...run...; plan_done(mode, predicted, plan_now() - t);
+	plan_kernel(code, bytes, ns);				//every in-process run
+	plan_hop(code, roundtrip_ns, service_ns);	//every datagram answered one at a time
+	plan_service(code, service_ns);				//every datagram answered in a parallel run
+	plan_busy(code, 1); ... plan_busy(code, -1);	//around remote runs
+*/
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Manifest constants */
+#define PLAN_CODES 10						/* indexed by transform code '0'..'9' */
+#define PLAN_MAX_WINDOW 64					/* pieces in flight, upper bound of -W */
+#define PLAN_SMALL 256						/* runs up to this many bytes fit the per-call cost */
+#define PLAN_SHIFT 3						/* EWMA weight of a new measurement: 1/8 */
+#define PLAN_EXPLORE 32						/* every this many decisions a code tries the runner-up */
+
+/* Modes */
+#define PLAN_LOCAL 0
+#define PLAN_REMOTE 1
+#define PLAN_PARALLEL 2
+#define PLAN_MODES 3
+
+static const char *plan_mode_names[PLAN_MODES] = {"local", "remote", "parallel"};
+
+/* Cost model of one code; all times in ns except the per-byte cost */
+struct plan_cost
+{
+	uint64_t call_ns, byte_ps;				//plugin kernel
+	uint64_t kernel_runs;
+	uint64_t hop_ns, service_ns;			//per datagram, to the microserver and at it
+	uint64_t hops;
+	int64_t depth;							//remote runs of the code in progress
+	uint64_t decisions;
+};
+
+/* Per mode: how good the predictions were */
+struct plan_counters
+{
+	uint64_t decisions;
+	uint64_t predicted_ns, actual_ns;
+	uint64_t error_ns;						//sum of |actual - predicted|
+};
+
+struct planner
+{
+	int window;
+	struct plan_cost cost[PLAN_CODES];
+	struct plan_counters mode[PLAN_MODES];	//all sessions
+};
+
+static struct planner *plan;				//shared by the parent and every session; NULL: off
+static struct plan_counters plan_session[PLAN_MODES];	//this session's, for its EV_PLAN records
+
+static inline uint64_t plan_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Map the shared model; window: pieces in flight for parallel runs. Once, before forking. */
+static inline int plan_init(int window)
+{
+	plan = mmap(NULL, sizeof(struct planner), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (plan == MAP_FAILED)
+	{
+		plan = NULL;
+		return -1;
+	}
+	memset(plan, 0, sizeof(*plan));
+	plan->window = window < 1 ? 1 : window > PLAN_MAX_WINDOW ? PLAN_MAX_WINDOW : window;
+	return 0;
+}
+
+static inline uint64_t plan_load(uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* *avg moves 1/8 of the way to x; the first measurement is taken as it is */
+static inline void plan_ewma(uint64_t *avg, uint64_t x, uint64_t samples)
+{
+	int64_t a = plan_load(avg);
+
+	__atomic_store_n(avg, samples == 0 ? x : (uint64_t)(a + (((int64_t)x - a) >> PLAN_SHIFT)), __ATOMIC_RELAXED);
+}
+
+/* An in-process run of code over bytes took ns */
+static inline void plan_kernel(int code, uint64_t bytes, uint64_t ns)
+{
+	struct plan_cost *c;
+	uint64_t n, base;
+
+	if (plan == NULL)
+		return;
+	c = &plan->cost[code];
+	n = __atomic_fetch_add(&c->kernel_runs, 1, __ATOMIC_RELAXED);
+	if (bytes <= PLAN_SMALL)
+		plan_ewma(&c->call_ns, ns > plan_load(&c->byte_ps) * bytes / 1000 ? ns - plan_load(&c->byte_ps) * bytes / 1000 : 0, n);
+	else
+	{
+		base = plan_load(&c->call_ns);
+		plan_ewma(&c->byte_ps, ns > base ? (ns - base) * 1000 / bytes : 0, n);
+	}
+}
+
+/* A datagram of code came back roundtrip_ns after it went out, service_ns of that at the microserver */
+static inline void plan_hop(int code, uint64_t roundtrip_ns, uint64_t service_ns)
+{
+	struct plan_cost *c;
+	uint64_t n;
+
+	if (plan == NULL)
+		return;
+	c = &plan->cost[code];
+	n = __atomic_fetch_add(&c->hops, 1, __ATOMIC_RELAXED);
+	if (service_ns > roundtrip_ns)
+		service_ns = roundtrip_ns;			//clocks of the same host; guards against a bad stamp
+	plan_ewma(&c->hop_ns, roundtrip_ns - service_ns, n);
+	plan_ewma(&c->service_ns, service_ns, n);
+}
+
+/* A datagram of code answered in a parallel run: its round trip also waited behind the
+other pieces, so only the microserver's own time is a measurement */
+static inline void plan_service(int code, uint64_t service_ns)
+{
+	struct plan_cost *c;
+
+	if (plan == NULL)
+		return;
+	c = &plan->cost[code];
+	plan_ewma(&c->service_ns, service_ns, plan_load(&c->hops));
+}
+
+/* A remote run of code starts (1) or ends (-1) */
+static inline void plan_busy(int code, int delta)
+{
+	if (plan != NULL)
+		__atomic_add_fetch(&plan->cost[code].depth, delta, __ATOMIC_RELAXED);
+}
+
+/* Predicted ns of running code over bytes (n datagrams remotely) in mode */
+static inline uint64_t plan_predict(int code, int mode, uint64_t bytes, uint64_t n)
+{
+	struct plan_cost *c = &plan->cost[code];
+	int64_t depth = plan_load((uint64_t *)&c->depth);
+	uint64_t hop = plan_load(&c->hop_ns), service = plan_load(&c->service_ns), w = plan->window;
+
+	if (depth < 0)
+		depth = 0;
+	if (mode == PLAN_LOCAL)
+		return plan_load(&c->call_ns) + plan_load(&c->byte_ps) * bytes / 1000;
+	if (mode == PLAN_REMOTE)
+		return n * (hop + service) * (1 + depth);
+	return (n + w - 1) / w * hop + n * service * (1 + depth);
+}
+
+/* Where to run code over bytes (n datagrams remotely); parallel_ok: the caller can run
+pieces in parallel. Sets *predicted to the predicted ns. */
+static inline int plan_choose(int code, uint64_t bytes, uint64_t n, int parallel_ok, uint64_t *predicted)
+{
+	struct plan_cost *c = &plan->cost[code];
+	uint64_t cost[PLAN_MODES], d;
+	int m, best = PLAN_LOCAL, second = -1, modes = parallel_ok && n > 1 ? PLAN_MODES : PLAN_PARALLEL;
+
+	/* measure each way once before trusting the model */
+	if (plan_load(&c->kernel_runs) == 0)
+		best = PLAN_LOCAL;
+	else if (plan_load(&c->hops) == 0)
+		best = PLAN_REMOTE;
+	else
+	{
+		for (m = 0; m < modes; m++)
+			cost[m] = plan_predict(code, m, bytes, n);
+		for (m = 1; m < modes; m++)
+			if (cost[m] < cost[best])
+				best = m;
+		for (m = 0; m < modes; m++)
+			if (m != best && (second == -1 || cost[m] < cost[second]))
+				second = m;
+		d = __atomic_fetch_add(&c->decisions, 1, __ATOMIC_RELAXED);
+		if (d % PLAN_EXPLORE == PLAN_EXPLORE - 1 && second != -1)
+			best = second;
+	}
+	*predicted = plan_predict(code, best, bytes, n);
+	return best;
+}
+
+/* A run planned as mode with predicted ns took actual ns */
+static inline void plan_done(int mode, uint64_t predicted, uint64_t actual)
+{
+	uint64_t err = actual > predicted ? actual - predicted : predicted - actual;
+	struct plan_counters *s = &plan_session[mode], *g;
+
+	if (plan == NULL)
+		return;
+	g = &plan->mode[mode];
+	__atomic_add_fetch(&g->decisions, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g->predicted_ns, predicted, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g->actual_ns, actual, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g->error_ns, err, __ATOMIC_RELAXED);
+	s->decisions++;
+	s->predicted_ns += predicted;
+	s->actual_ns += actual;
+	s->error_ns += err;
+}
+
+#endif /* PLANNER_H */
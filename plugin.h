@@ -0,0 +1,102 @@
+/*
+In-process transform plugins.
+
+A transform is a length-based kernel: it reads len bytes of in, writes
+the result to out (at most cap bytes; out may be the same buffer as in)
+and returns the result's length. Every microserver source file defines
+its kernel once and is built two ways:
+
+	gcc upper.c -o upper.out					//UDP microserver
+	gcc -shared -fPIC -DTRANSFORM_PLUGIN upper.c -o plugins/upper.so
+
+The shared object exports one struct transform_plugin under the name
+"transform_plugin". The master (mainserver -L dir) dlopens every *.so
+in dir at startup and runs those codes inside the session process, with
+no datagram, no microserver and no admission slot. A code that needs
+isolation still goes out of process: -s code=port sends it to a running
+microserver and -X codes makes the master fork the microserver as before.
+
+A plugin from another source only has to include this header and say
+	TRANSFORM_PLUGIN_EXPORT(code, "name", kernel)
+*/
+
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+/* Manifest constants */
+#define TRANSFORM_ABI_VERSION 1
+#define TRANSFORM_PLUGIN_SYMBOL "transform_plugin"
+#define PLUGIN_MAX_CODE 6					/* codes 1..6, same as the microservers */
+
+/* The kernel every transform implements */
+typedef size_t (*transform_kernel)(const char *in, size_t len, char *out, size_t cap);
+
+/* What a plugin exports */
+struct transform_plugin
+{
+	uint32_t abi;							//TRANSFORM_ABI_VERSION the plugin was built with
+	int code;								//transform code it serves
+	const char *name;
+	transform_kernel kernel;
+};
+
+#define TRANSFORM_PLUGIN_EXPORT(code, name, kernel) \
+	const struct transform_plugin transform_plugin = {TRANSFORM_ABI_VERSION, (code), (name), (kernel)};
+
+#ifndef TRANSFORM_PLUGIN
+/* Host side (the master): loaded plugins by code, NULL: none */
+#include <dirent.h>
+#include <dlfcn.h>
+
+static const struct transform_plugin *plugins[PLUGIN_MAX_CODE + 1];
+
+/* dlopen every *.so in dir and register its transform; returns how many were loaded */
+static inline int plugin_load_dir(const char *dir)
+{
+	DIR *d;
+	struct dirent *e;
+	char path[1024];
+	const struct transform_plugin *p;
+	void *handle;
+	size_t n;
+	int loaded = 0;
+
+	if ((d = opendir(dir)) == NULL)
+	{
+		fprintf(stderr, "plugins: cannot open directory %s\n", dir);
+		return 0;
+	}
+	while ((e = readdir(d)) != NULL)
+	{
+		n = strlen(e->d_name);
+		if (n < 4 || strcmp(e->d_name + n - 3, ".so") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+		{
+			fprintf(stderr, "plugins: %s\n", dlerror());
+			continue;
+		}
+		p = dlsym(handle, TRANSFORM_PLUGIN_SYMBOL);
+		if (p == NULL || p->abi != TRANSFORM_ABI_VERSION || p->code < 1 || p->code > PLUGIN_MAX_CODE ||
+			p->kernel == NULL || plugins[p->code] != NULL)
+		{
+			fprintf(stderr, "plugins: skipping %s (no symbol, wrong ABI or code, or code already taken)\n", path);
+			dlclose(handle);
+			continue;
+		}
+		plugins[p->code] = p;
+		loaded++;
+		fprintf(stderr, "plugins: %s serves code %d in-process\n", p->name, p->code);
+	}
+	closedir(d);
+	return loaded;
+}
+#endif /* !TRANSFORM_PLUGIN */
+
+#endif /* PLUGIN_H */
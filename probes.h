@@ -0,0 +1,89 @@
+/*
+USDT (user-level statically defined tracing) probes for perf and bpftrace.
+
+A probe is one nop in the code plus an ELF note (.note.stapsdt, the
+SystemTap SDT v3 layout that perf, bpftrace and bcc read) that records
+the nop's address, the probe's provider and name, and where each
+argument is at that point (register, stack slot or constant). Nothing
+runs when no tracer is attached: the arguments are values the code has
+at hand anyway, so the cost is the nop. Attaching a tracer turns the
+nop into a breakpoint, in running processes, without a restart:
+
+	bpftrace -e 'usdt:./mainserver.out:transform:step_done { @[arg1] = hist(arg3); }'
+	perf buildid-cache --add ./mainserver.out; perf record -e sdt_transform:step_done -a
+
+No semaphores: perf does not set them, and the probes cost nothing to
+skip. This header writes the notes itself, so <sys/sdt.h> (systemtap)
+is not needed to build; every argument is passed as a signed 64-bit
+value. Ready-made scripts are in bpftrace/.
+
+Probes of provider "transform" (arguments in order):
+	master		accept			session, client socket
+	session		request			session, option ('1'..'9'), bytes of the request
+				chain			session, chain length, steps taken from the cache, trace id
+				step_start		session, transform code, bytes, trace id
+				step_done		session, transform code, bytes (< 0: BUSY/EXPIRED), ns
+				response		session, bytes, verdict (0 ok, < 0 BUSY/EXPIRED/failed)
+				plan			session, transform code, mode (0 local, 1 remote, 2 parallel), predicted ns
+				plan_done		session, transform code, mode, ns the step took
+	microserver	ms_receive		trace id, bytes
+				ms_transform	trace id, bytes in, bytes out, ns
+				ms_send			trace id, bytes
+
+Usage:
+	PROBE2(accept, sessionseq, childsockfd);		//PROBE1 .. PROBE4
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+/* Manifest constants */
+#define PROBE_PROVIDER "transform"
+#if defined(__LP64__)
+#define PROBE_ADDR ".8byte"
+#else
+#define PROBE_ADDR ".4byte"
+#endif
+
+/* The nop, its note, and once per object the .stapsdt.base section tracers use to
+find where the object was loaded */
+#define PROBE_ASM(name, args, ...) \
+	__asm__ __volatile__( \
+		"990:	nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991:	.asciz \"stapsdt\"\n" \
+		"992:	.balign 4\n" \
+		"993:	" PROBE_ADDR " 990b\n" \
+		PROBE_ADDR " _.stapsdt.base\n" \
+		PROBE_ADDR " 0\n" \
+		".asciz \"" PROBE_PROVIDER "\"\n" \
+		".asciz \"" #name "\"\n" \
+		".asciz \"" args "\"\n" \
+		"994:	.balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		: : __VA_ARGS__)
+
+/* One argument: signed, 8 bytes, wherever the compiler has it */
+#define PROBE_OP(n, x) [a##n] "nor"((int64_t)(x))
+
+#define PROBE1(name, a1) PROBE_ASM(name, "-8@%[a1]", PROBE_OP(1, a1))
+#define PROBE2(name, a1, a2) PROBE_ASM(name, "-8@%[a1] -8@%[a2]", PROBE_OP(1, a1), PROBE_OP(2, a2))
+#define PROBE3(name, a1, a2, a3) \
+	PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3]", PROBE_OP(1, a1), PROBE_OP(2, a2), PROBE_OP(3, a3))
+#define PROBE4(name, a1, a2, a3, a4) \
+	PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]", PROBE_OP(1, a1), PROBE_OP(2, a2), PROBE_OP(3, a3), \
+			  PROBE_OP(4, a4))
+
+#endif /* PROBES_H */
@@ -0,0 +1,171 @@
+/*
+Range reads of a stored document's transform (client option 9, see
+docstore.h): bytes [from, to) of chain(document), computed from as
+little of the document as the chain allows.
+
+Every transform keeps the length of its input, so a range of a result is
+a range of the same size of the step's output, and it needs a range of
+the step's input not much larger:
+	identity, upper, lower, caesar	the same range, one byte wider on
+				each side: a two-byte character cut by the edge
+				is then whole (utf8.h maps whole characters and
+				copies the bytes of anything else)
+	reverse		the mirrored range [len - to, len - from), three bytes
+				wider on each side: utf8.h groups a character from its
+				lead byte forward, so a character of up to four bytes cut
+				by the edge only reads differently inside the margin
+	yours		the same range, plus where the kernel starts in it: every
+				second character becomes Z, so whether it looks at the
+				range's first byte depends on everything before it
+The windows are worked out back to front from the range asked for
+(range_plan()), the first one is read from the document, and each step
+runs on its window only: the work is the range plus a few bytes per step,
+however large the document.
+
+For yours, no transform moves a whitespace byte or makes one (byte maps
+leave them alone, yours replaces non-spaces only, reverse mirrors them),
+so which bytes the yours kernel looks at is the same for every step's
+input as for the document, or for the document back to front after an
+odd number of reverses. When a document is stored, the master scans it
+once in both directions and keeps one bit per DOCINDEX_STEP bytes:
+whether the kernel looks at that byte (if it does not, it looks at the
+next one). The sidecar file of the document (docstore_attach()) holds
+both bit arrays; finding where the kernel starts in a window is then a
+lookup and a scan of at most DOCINDEX_STEP bytes of the document.
+
+Usage:
+	docindex_build(text, len, bits);			//docindex_size(len) bytes, at upload
+	nsteps = range_plan(chain, len, from, to, win);	//win[0]: what to read, win[nsteps]: the range
+	first = docindex_looked(docfd, indexfd, len, mirrored, pos) ? 0 : 1;
+*/
+
+#ifndef RANGEREAD_H
+#define RANGEREAD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+/* Manifest constants */
+#define DOCINDEX_STEP 4096					/* bytes between the checkpoints of the yours index */
+#define DOCINDEX_SCAN 4096					/* document bytes read at a time without an index */
+#define RANGE_MAX_STEPS 100					/* a chain, as a frame */
+
+/* Window of one step's input (and of its output, by the same rule) */
+struct range_window
+{
+	uint64_t lo, hi;
+	int mirrored;							//an odd number of reverses came before
+};
+
+/* Checkpoints of a document of len bytes */
+static inline uint64_t docindex_points(uint64_t len)
+{
+	return (len + DOCINDEX_STEP - 1) / DOCINDEX_STEP;
+}
+
+/* Bytes of the index: a bit array for each direction */
+static inline uint64_t docindex_size(uint64_t len)
+{
+	return 2 * ((docindex_points(len) + 7) / 8);
+}
+
+/* Byte i of text, read front to back or back to front */
+static inline unsigned char docindex_at(const char *text, uint64_t len, int mirrored, uint64_t i)
+{
+	return text[mirrored ? len - 1 - i : i];
+}
+
+/* Index of the len bytes of text into bits (docindex_size(len) bytes) */
+static inline void docindex_build(const char *text, uint64_t len, unsigned char *bits)
+{
+	uint64_t n, c, half = docindex_size(len) / 2;
+	unsigned char *b;
+	int mirrored;
+
+	memset(bits, 0, 2 * half);
+	for (mirrored = 0; mirrored < 2; mirrored++)
+	{
+		b = bits + mirrored * half;
+		for (n = 1, c = 0; c < len; c += DOCINDEX_STEP)
+		{
+			while (n < c)
+				n += isspace(docindex_at(text, len, mirrored, n)) ? 1 : 2;
+			if (n == c)
+				b[c / DOCINDEX_STEP / 8] |= 1 << (c / DOCINDEX_STEP % 8);
+		}
+	}
+}
+
+/* Does the yours kernel look at byte pos of the document (back to front when mirrored)?
+indexfd: the document's index, or -1 to scan from the start */
+static inline int docindex_looked(int docfd, int indexfd, uint64_t len, int mirrored, uint64_t pos)
+{
+	unsigned char bits = 0, buf[DOCINDEX_SCAN];
+	uint64_t c = 0, n = 1, at, k;
+	size_t chunk;
+
+	if (pos == 0)
+		return 0;
+	if (indexfd != -1)
+	{
+		c = pos / DOCINDEX_STEP * DOCINDEX_STEP;
+		k = c / DOCINDEX_STEP;
+		if (pread(indexfd, &bits, 1, mirrored * (docindex_size(len) / 2) + k / 8) != 1)
+			c = 0;
+		else
+			n = bits >> (k % 8) & 1 ? c : c + 1;
+		if (c == 0)
+			n = 1;
+	}
+
+	/* the scan from there, over the document's bytes in [c, pos) in that direction */
+	for (at = c; n < pos; at += chunk)
+	{
+		chunk = pos - at < DOCINDEX_SCAN ? pos - at : DOCINDEX_SCAN;
+		if (pread(docfd, buf, chunk, mirrored ? len - at - chunk : at) != (ssize_t)chunk)
+			return 0;
+		while (n < pos && n < at + chunk)
+			n += isspace(buf[mirrored ? at + chunk - 1 - n : n - at]) ? 1 : 2;
+	}
+	return n == pos;
+}
+
+/* The input window a step needs for its output window w; len: the document's */
+static inline void range_window_in(int code, uint64_t len, const struct range_window *w, struct range_window *in)
+{
+	uint64_t margin = code == 2 ? 3 : code == 6 ? 0 : 1;
+
+	in->mirrored = w->mirrored ^ (code == 2);
+	if (code == 2)
+	{
+		in->lo = len - w->hi;
+		in->hi = len - w->lo;
+	}
+	else
+	{
+		in->lo = w->lo;
+		in->hi = w->hi;
+	}
+	in->lo = in->lo > margin ? in->lo - margin : 0;
+	in->hi = in->hi + margin < len ? in->hi + margin : len;
+}
+
+/* Windows of the chain's steps for the result's bytes [from, to): win[i] is what step i
+reads (win[0] from the document), win[nsteps] is [from, to) itself; the number of steps */
+static inline int range_plan(const char *chain, uint64_t len, uint64_t from, uint64_t to, struct range_window *win)
+{
+	int n, i, reverses = 0;
+
+	for (n = 0; n < RANGE_MAX_STEPS && chain[n] >= '1' && chain[n] <= '6'; n++)
+		reverses += chain[n] == '2';
+	win[n].lo = from;
+	win[n].hi = to;
+	win[n].mirrored = reverses & 1;
+	for (i = n - 1; i >= 0; i--)
+		range_window_in(chain[i] - '0', len, &win[i + 1], &win[i]);
+	return n;
+}
+
+#endif /* RANGEREAD_H */
@@ -0,0 +1,432 @@
+/*
+Replay tool.
+Re-drives a traffic capture (mainserver -c file, see capture.h) against
+a running master and measures every request's latency, so two builds can
+be compared on the same recorded workload.
+
+Every captured session becomes one client connection, opened when the
+session sent its first request. Its requests are sent at their captured
+times, scaled by the speed factor: 1 replays in real time, 10 ten times
+faster, 0 as fast as possible (every session sends its next request as
+soon as the previous answer is back). Like the original client a session
+waits for each answer before it sends the next request, so a slow master
+pushes the session behind schedule; the lag column says by how much.
+
+Usage:
+	./replay.out [-p tcpport] [-a address] [-x speed] capturefile
+		-p tcpport	port of the master (default 8080)
+		-a address	IPv4 address of the master (default 127.0.0.1)
+		-x speed	time scale: 1 real time (default), N N times faster, 0 max speed
+
+It prints one row per request type: how many were replayed, how many came
+back BUSY, EXPIRED or failed (no answer, or ERROR), the rate, the latency
+percentiles of the answered ones in microseconds and the worst lag behind
+schedule in ms. Sentences (option 1) have no answer and only count and lag.
+
+Document requests (options 6 to 9) replay against the master's document
+store (-D): an upload gets the handle it got when it was captured, so the
+transforms and releases that follow find their document. A session that
+asked for the codec (option 5) and got it sends its batches and uploads
+compressed and reads its answers' codec frames, as the client did.
+*/
+
+/* Include files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "capture.h"
+#include "codec.h"
+
+/* Manifest constants */
+#define MAX_MESSAGE_LENGTH 100		/* must match the master server's frames */
+#define BUSY_MESSAGE "BUSY\n"		/* must match the server's admission.h */
+#define EXPIRED_MESSAGE "EXPIRED\n"
+#define LAT_FAILED -1				/* latencies[] markers for requests without a result */
+#define LAT_BUSY -2
+#define LAT_EXPIRED -3
+#define LAT_NONE -4					/* option 1: nothing to wait for */
+#define LAT_ERROR -5				/* answered ERROR; the session goes on */
+#define ERROR_MESSAGE "ERROR\n"		/* the server's batch.h and docstore.h */
+
+/* One captured request, pointing into the loaded file */
+struct request
+{
+	const struct capture_record *rec;
+	const char *sel, *arg, *payload;
+	long order;						//position in the file, breaks ties between equal times
+};
+
+/* Monotonic clock in nanoseconds */
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleep until the monotonic clock reads t */
+static void sleep_until(long long t)
+{
+	struct timespec ts = {t / 1000000000LL, t % 1000000000LL};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+/* Session by session, each in captured order */
+static int cmp_session(const void *a, const void *b)
+{
+	const struct request *x = a, *y = b;
+
+	if (x->rec->session != y->rec->session)
+		return x->rec->session < y->rec->session ? -1 : 1;
+	if (x->rec->t_ns != y->rec->t_ns)
+		return x->rec->t_ns < y->rec->t_ns ? -1 : 1;
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Read a capture file into memory; returns the requests in it (-1: not a capture) */
+static long load_capture(const char *path, char **file, struct request **requests)
+{
+	const struct capture_header *h;
+	struct capture_record *r;
+	struct stat st;
+	size_t off, size;
+	long n = 0, max = 1024;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h))
+		return -1;
+	*file = malloc(st.st_size);
+	if (*file == NULL || read(fd, *file, st.st_size) != st.st_size)
+		return -1;
+	close(fd);
+	h = (const struct capture_header *)*file;
+	if (h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION)
+		return -1;
+
+	*requests = malloc(max * sizeof(struct request));
+	for (off = sizeof(*h); off + sizeof(*r) <= (size_t)st.st_size; off += size)
+	{
+		r = (struct capture_record *)(*file + off);
+		size = sizeof(*r) + r->sellen + r->arglen + r->paylen;
+		if (off + size > (size_t)st.st_size)
+			break;			//cut off while the master was writing it
+		if (n == max)
+			*requests = realloc(*requests, (max *= 2) * sizeof(struct request));
+		(*requests)[n].rec = r;
+		(*requests)[n].sel = (char *)(r + 1);
+		(*requests)[n].arg = (*requests)[n].sel + r->sellen;
+		(*requests)[n].payload = (*requests)[n].arg + r->arglen;
+		(*requests)[n].order = n;
+		n++;
+	}
+	return n;
+}
+
+/* Connect a TCP client to the master */
+static int connect_master(struct sockaddr_in *sa)
+{
+	int fd, one = 1;
+
+	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)sa, sizeof(*sa)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	/* request frames are small; don't let Nagle hold them back */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/* Send the request as the client did: the zero-padded frames, then the payload of a batch
+or an upload, in a codec frame when the session has the codec (codec: its threshold, -1 off) */
+static int send_request(int fd, const struct request *q, int codec)
+{
+	size_t nframes = capture_has_arg(q->sel[0]) ? 2 : 1, paylen = q->rec->paylen, size, sent = 0;
+	char *frames = calloc(1, nframes * MAX_MESSAGE_LENGTH + (codec >= 0 ? CODEC_FRAME_MAX(paylen) : paylen));
+	struct codec_stats stats;
+	ssize_t n = 0;
+
+	if (frames == NULL)
+		return -1;
+	memcpy(frames, q->sel, q->rec->sellen);
+	memcpy(frames + MAX_MESSAGE_LENGTH, q->arg, q->rec->arglen);
+	size = nframes * MAX_MESSAGE_LENGTH;
+	if (codec >= 0 && (q->sel[0] == '4' || q->sel[0] == '6'))
+		size += codec_encode(q->payload, paylen, codec, frames + size, &stats);
+	else
+	{
+		memcpy(frames + size, q->payload, paylen);
+		size += paylen;
+	}
+	while (sent < size && (n = send(fd, frames + sent, size - sent, 0)) > 0)
+		sent += n;
+	free(frames);
+	return sent == size ? 0 : -1;
+}
+
+/* Receive exactly len bytes (NULL buf: discard them) */
+static int recv_all(int fd, char *buf, size_t len)
+{
+	char skip[4096];
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = recv(fd, buf != NULL ? buf : skip, buf != NULL || len < sizeof(skip) ? len : sizeof(skip), 0)) <= 0)
+			return -1;
+		len -= n;
+		if (buf != NULL)
+			buf += n;
+	}
+	return 0;
+}
+
+/* Read past the rawlen-byte payload that follows an answer line, have bytes of which (at p)
+came in with the line; a codec frame when the session has the codec */
+static int skip_payload(int fd, const char *p, size_t have, size_t rawlen, int codec)
+{
+	char header[CODEC_HEADER];
+	size_t raw, stored;
+
+	if (codec < 0)
+		return have > rawlen ? -1 : recv_all(fd, NULL, rawlen - have);
+	memcpy(header, p, have < CODEC_HEADER ? have : CODEC_HEADER);
+	if (have < CODEC_HEADER && recv_all(fd, header + have, CODEC_HEADER - have) == -1)
+		return -1;
+	if (codec_header(header, rawlen, &raw, &stored) == -1 || raw != rawlen)
+		return -1;
+	have = have > CODEC_HEADER ? have - CODEC_HEADER : 0;
+	return have > stored ? -1 : recv_all(fd, NULL, stored - have);
+}
+
+/* Wait for the answer to q; returns its latency marker when there is no result. *codec
+follows the session's codec (option 5). The session sends nothing before the answer is
+in, so all it receives belongs to it. */
+static long long recv_answer(int fd, const struct request *q, int *codec)
+{
+	char line[4096], *nl = NULL;
+	unsigned n, bytes;
+	unsigned long long doc;
+	int got = 0, k, threshold;
+
+	if (q->sel[0] == '1')
+		return LAT_NONE;
+	while (nl == NULL && got < (int)sizeof(line) - 1)
+	{
+		if ((k = recv(fd, line + got, sizeof(line) - 1 - got, 0)) <= 0)
+			return LAT_FAILED;
+		got += k;
+		line[got] = '\0';
+		nl = strchr(line, '\n');
+	}
+	if (nl == NULL)
+		return LAT_FAILED;
+	if (strncmp(line, BUSY_MESSAGE, got) == 0)
+		return LAT_BUSY;
+	if (strncmp(line, EXPIRED_MESSAGE, got) == 0)
+		return LAT_EXPIRED;
+	if (strncmp(line, ERROR_MESSAGE, got) == 0)
+		return LAT_ERROR;
+
+	/* the results follow the "BATCH n bytes" or "DOC bytes" line; part of them may be in already */
+	if (q->sel[0] == '4' && (sscanf(line, "BATCH %u %u", &n, &bytes) != 2 ||
+							 skip_payload(fd, nl + 1, got - (nl + 1 - line), (n + 1) * sizeof(uint32_t) + bytes, *codec) == -1))
+		return LAT_FAILED;
+	if ((q->sel[0] == '7' || q->sel[0] == '9') &&
+		(sscanf(line, "DOC %llu", &doc) != 1 || skip_payload(fd, nl + 1, got - (nl + 1 - line), doc, *codec) == -1))
+		return LAT_FAILED;
+	if (q->sel[0] == '5')
+		*codec = sscanf(line, "CODEC " CODEC_NAME " %d", &threshold) == 1 ? threshold : -1;
+	return 0;
+}
+
+/* One captured session: send its requests on schedule; latencies[i] and lags[i] per request */
+static void run_session(struct sockaddr_in *sa, struct request *q, long n, long long t0, long long start,
+						double speed, long long *latencies, long long *lags)
+{
+	long long due, sent, result;
+	long i;
+	int fd = -1, codec = -1;
+
+	for (i = 0; i < n; i++)
+		latencies[i] = LAT_FAILED;
+	for (i = 0; i < n; i++)
+	{
+		due = speed > 0 ? start + (long long)((q[i].rec->t_ns - t0) / speed) : now_ns();
+		if (due > now_ns())
+			sleep_until(due);
+		if (fd == -1 && (fd = connect_master(sa)) == -1)
+			return;
+		sent = now_ns();
+		lags[i] = sent - due;
+		if (send_request(fd, &q[i], codec) == -1 || (result = recv_answer(fd, &q[i], &codec)) == LAT_FAILED)
+			break;
+		latencies[i] = result == 0 ? now_ns() - sent : result;
+	}
+	close(fd);
+}
+
+/* Print one table row for the requests of one option ('\0': all of them) */
+static void print_row(const char *name, struct request *q, long n, char option, long long *latencies,
+					  long long *lags, long long wall)
+{
+	long long *ok = malloc((n + 1) * sizeof(long long)), sum = 0, maxlag = 0;
+	long i, total = 0, nok = 0, nbusy = 0, nexpired = 0, nfailed = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (option != '\0' && q[i].sel[0] != option)
+			continue;
+		total++;
+		if (latencies[i] >= 0)
+		{
+			ok[nok++] = latencies[i];
+			sum += latencies[i];
+		}
+		else if (latencies[i] == LAT_BUSY)
+			nbusy++;
+		else if (latencies[i] == LAT_EXPIRED)
+			nexpired++;
+		else if (latencies[i] == LAT_FAILED || latencies[i] == LAT_ERROR)
+			nfailed++;
+		if (latencies[i] != LAT_FAILED && lags[i] > maxlag)
+			maxlag = lags[i];
+	}
+	if (total == 0)
+	{
+		free(ok);
+		return;
+	}
+	qsort(ok, nok, sizeof(long long), cmp_ll);
+
+	printf("%-10s %8ld %6ld %7ld %6ld %10.0f", name, total, nbusy, nexpired, nfailed, total / (wall / 1e9));
+	if (nok > 0)
+		printf(" %9.1f %9.1f %9.1f %9.1f %9.1f", sum / (double)nok / 1e3, ok[nok / 2] / 1e3,
+			   ok[(long)(nok * 0.90)] / 1e3, ok[(long)(nok * 0.99)] / 1e3, ok[nok - 1] / 1e3);
+	else
+		printf(" %9s %9s %9s %9s %9s", "-", "-", "-", "-", "-");
+	printf(" %9.1f\n", maxlag / 1e6);
+	free(ok);
+}
+
+/* Main program of the replay tool */
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in sa;
+	struct request *q;
+	char *file, *address = "127.0.0.1";
+	double speed = 1;
+	long long *latencies, *lags, t0, start, wall;
+	long n, i, j, sessions = 0;
+	int opt, port = 8080;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "p:a:x:")) != -1)
+	{
+		if (opt == 'p')
+			port = atoi(optarg);
+		else if (opt == 'a')
+			address = optarg;
+		else if (opt == 'x')
+			speed = atof(optarg);
+		else
+			optind = argc + 1;
+	}
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "usage: %s [-p tcpport] [-a address] [-x speed] capturefile\n", argv[0]);
+		exit(1);
+	}
+	if ((n = load_capture(argv[optind], &file, &q)) <= 0)
+	{
+		fprintf(stderr, "replay: %s is not a capture file or has no requests\n", argv[optind]);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &sa.sin_addr) != 1)
+	{
+		fprintf(stderr, "replay: bad address %s\n", address);
+		exit(1);
+	}
+
+	/* the requests grouped by session, each session in time order */
+	qsort(q, n, sizeof(struct request), cmp_session);
+	for (i = 0, t0 = q[0].rec->t_ns; i < n; i++)
+		if ((long long)q[i].rec->t_ns < t0)
+			t0 = q[i].rec->t_ns;
+	latencies = mmap(NULL, n * sizeof(long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	lags = mmap(NULL, n * sizeof(long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latencies == MAP_FAILED || lags == MAP_FAILED)
+	{
+		fprintf(stderr, "replay: mmap() failed\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		latencies[i] = LAT_FAILED;
+
+	/* one forked client per captured session */
+	start = now_ns();
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i; j < n && q[j].rec->session == q[i].rec->session; j++)
+			;
+		sessions++;
+		if ((pid = fork()) == 0)
+		{
+			run_session(&sa, q + i, j - i, t0, start, speed, latencies + i, lags + i);
+			_exit(0);
+		}
+		else if (pid < 0)
+			fprintf(stderr, "replay: fork() failed, session %u not replayed\n", q[i].rec->session);
+	}
+	while (wait(NULL) > 0)
+		;
+	wall = now_ns() - start;
+
+	if (speed > 0)
+		printf("%ld requests in %ld sessions at %gx speed, %.2f s\n\n", n, sessions, speed, wall / 1e9);
+	else
+		printf("%ld requests in %ld sessions at max speed, %.2f s\n\n", n, sessions, wall / 1e9);
+	printf("%-10s %8s %6s %7s %6s %10s %9s %9s %9s %9s %9s %9s\n", "request", "count", "busy", "expired",
+		   "failed", "req/s", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)", "lag(ms)");
+	print_row("sentence", q, n, '1', latencies, lags, wall);
+	print_row("transform", q, n, '2', latencies, lags, wall);
+	print_row("priority", q, n, '3', latencies, lags, wall);
+	print_row("batch", q, n, '4', latencies, lags, wall);
+	print_row("codec", q, n, '5', latencies, lags, wall);
+	print_row("upload", q, n, '6', latencies, lags, wall);
+	print_row("document", q, n, '7', latencies, lags, wall);
+	print_row("release", q, n, '8', latencies, lags, wall);
+	print_row("range", q, n, '9', latencies, lags, wall);
+	print_row("all", q, n, '\0', latencies, lags, wall);
+
+	munmap(latencies, n * sizeof(long long));
+	munmap(lags, n * sizeof(long long));
+	free(q);
+	free(file);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+Request tracing across the master server and the microservers.
+
+Every datagram the master sends to a microserver starts with a
+trace_header: the trace id of the client request and the span (step)
+index. The microserver stamps when it received the datagram, when its
+transform started and ended and when it sent the answer, and returns
+the header in front of the answer. The master adds its own send/receive
+times per step, so for every request it knows where each hop's time went.
+
+A sampled fraction of requests (mainserver -t) is exported in Chrome
+trace-event format to one JSON file (mainserver -T) that can be opened
+in chrome://tracing or ui.perfetto.dev. All processes use
+CLOCK_MONOTONIC, so timestamps from the master and the microservers on
+the same host line up.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Manifest constants */
+#define TRACE_MAGIC 0x31435254			/* "TRC1" */
+#define TRACE_SAMPLED 0x1				/* flags: export this request */
+#define TRACE_DEFAULT_FILE "traces.json"
+
+/* Prefix of every master <-> microserver datagram; the text follows it */
+struct trace_header
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t trace_id;
+	uint32_t span_id;				//chain step index
+	uint32_t pid;					//microserver pid, filled in by the microserver
+	uint64_t t_recv;				//microserver timestamps, CLOCK_MONOTONIC ns
+	uint64_t t_transform_start;
+	uint64_t t_transform_end;
+	uint64_t t_send;
+};
+
+/* What the master keeps per chain step of a traced request */
+struct trace_step
+{
+	int code;						//transform code 1-6
+	int bytes;
+	uint64_t t_send;				//master: before sendto
+	uint64_t t_recv;				//master: after recvfrom
+	struct trace_header ms;			//as returned by the microserver
+};
+
+/* Names of the transform codes, index 0 unused */
+static const char *trace_service_names[] = {"?", "identity", "reverse", "upper", "lower", "caesar", "yours"};
+
+static inline uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Start the trace file as a JSON array; events are appended one request at a time */
+static inline int trace_file_open(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (fp == NULL)
+		return -1;
+	fputs("[\n", fp);
+	fclose(fp);
+	return 0;
+}
+
+/* Append the events of one traced request with a single O_APPEND write,
+so requests from concurrent sessions never interleave. The array is left
+open (",\n" after each event), which the trace viewers accept. */
+static inline void trace_export(const char *path, uint64_t trace_id, const char *chain,
+								uint64_t t_start, uint64_t t_end, const struct trace_step *steps, int nsteps)
+{
+	char out[98304];
+	int n = 0, i, fd, pid = getpid();
+
+#define TRACE_EMIT(...)                                                   \
+	do                                                                    \
+	{                                                                     \
+		if (n < (int)sizeof(out))                                         \
+			n += snprintf(out + n, sizeof(out) - n, __VA_ARGS__);         \
+	} while (0)
+
+	TRACE_EMIT("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"master session %d\"}},\n", pid, pid);
+	TRACE_EMIT("{\"name\":\"request %s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,"
+			   "\"args\":{\"trace_id\":\"%016llx\",\"chain\":\"%s\"}},\n",
+			   chain, pid, t_start / 1e3, (t_end - t_start) / 1e3, (unsigned long long)trace_id, chain);
+
+	for (i = 0; i < nsteps; i++)
+	{
+		const struct trace_step *st = &steps[i];
+		const char *name = trace_service_names[st->code];
+
+		/* master's view of the hop: sendto until the answer is back */
+		TRACE_EMIT("{\"name\":\"step %d %s\",\"cat\":\"step\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+				   "\"args\":{\"trace_id\":\"%016llx\",\"bytes\":%d}},\n",
+				   i, name, pid, st->t_send / 1e3, (st->t_recv - st->t_send) / 1e3, (unsigned long long)trace_id, st->bytes);
+		if (st->ms.magic != TRACE_MAGIC || st->ms.t_recv == 0)
+			continue;
+
+		/* microserver's view: time in the service, and the transform inside it */
+		TRACE_EMIT("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s microserver\"}},\n",
+				   st->ms.pid, name);
+		TRACE_EMIT("{\"name\":\"%s service\",\"cat\":\"microserver\",\"ph\":\"X\",\"pid\":%u,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,"
+				   "\"args\":{\"trace_id\":\"%016llx\",\"span\":%u,\"send_to_recv_us\":%.3f,\"reply_us\":%.3f}},\n",
+				   name, st->ms.pid, st->ms.t_recv / 1e3, (st->ms.t_send - st->ms.t_recv) / 1e3,
+				   (unsigned long long)trace_id, st->ms.span_id,
+				   (st->ms.t_recv - st->t_send) / 1e3, (st->t_recv - st->ms.t_send) / 1e3);
+		TRACE_EMIT("{\"name\":\"%s transform\",\"cat\":\"microserver\",\"ph\":\"X\",\"pid\":%u,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f},\n",
+				   name, st->ms.pid, st->ms.t_transform_start / 1e3,
+				   (st->ms.t_transform_end - st->ms.t_transform_start) / 1e3);
+	}
+#undef TRACE_EMIT
+
+	if (n > (int)sizeof(out))
+		return;						//chain too long to export; drop rather than write half an event
+	if ((fd = open(path, O_WRONLY | O_APPEND)) == -1)
+		return;
+	write(fd, out, n);
+	close(fd);
+}
+
+#endif /* TRACE_H */
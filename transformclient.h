@@ -0,0 +1,861 @@
+/*
+Client library for programs that call the transform service (the master
+server) at a high rate, instead of a person at mainclient.
+
+Requests are submitted from any thread and never block on the network:
+tc_transform() queues the request and returns, and its callback runs
+later with the answer; tc_future_wait() is there for a caller that
+prefers to wait for one answer. One I/O thread per pool owns every
+socket:
+
+	- a pool of persistent TCP connections to the master, each one a
+	  session on the master (one forked child there);
+	- a connection carries one exchange at a time, because a session
+	  answers its frames in order; the pool multiplexes the requests of
+	  all callers over the connections, the idlest first;
+	- requests that queue up for the same chain and priority while the
+	  connections are busy go out together as one batch (option 4, see
+	  batch.h), up to batchmax documents; with linger set, a lone
+	  request waits that long for company first;
+	- a connection that fails is reopened with backoff (50 ms doubling
+	  up to 2 s); what it had in flight goes back to the queue, up to
+	  retries times per request, and is answered TC_ERROR after that.
+
+A callback gets the status (TC_OK, TC_BUSY, TC_EXPIRED, TC_ERROR) and
+the null-terminated result. Callbacks run on the I/O thread, so they
+should be short and must not call tc_close().
+
+Usage:
+	struct tc_options o = {.connections = 4, .linger_us = 200};
+	struct tc_pool *p = tc_open("127.0.0.1", 8080, &o);		//NULL: cannot resolve
+	tc_transform(p, "Hello world", "352", PRIO_NORMAL, 0, done, arg);	//0, or -1 (errno)
+	tc_transform_future(p, sentence, chain, priority, deadline_ms, &f);
+	status = tc_future_wait(&f);							//result in f.result
+	tc_flush(p);											//wait for every answer
+	tc_close(p);											//unanswered requests get TC_ERROR
+*/
+
+#ifndef TRANSFORMCLIENT_H
+#define TRANSFORMCLIENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "batch.h"			//option 4 payload layout
+
+/* Manifest constants */
+#define TC_FRAME 100							/* client frame, as MAX_MESSAGE_LENGTH on the master */
+#define TC_MAX_TEXT (TC_FRAME - 1)				/* longest sentence, chain or result */
+#define TC_DEFAULT_CONNECTIONS 4
+#define TC_DEFAULT_BATCHMAX 64
+#define TC_DEFAULT_RETRIES 2
+#define TC_DEFAULT_QUEUEMAX 65536
+#define TC_BACKOFF_MIN_MS 50
+#define TC_BACKOFF_MAX_MS 2000
+#define TC_MAX_CONNECTIONS 256
+
+/* Request status given to the callback */
+#define TC_OK 0
+#define TC_BUSY 1								/* the master shed it ("BUSY") */
+#define TC_EXPIRED 2							/* its deadline passed ("EXPIRED") */
+#define TC_ERROR 3								/* rejected, or no answer after the retries */
+
+#ifndef PRIO_NORMAL
+#define PRIO_INTERACTIVE 0						/* as in admission.h */
+#define PRIO_NORMAL 1
+#define PRIO_BULK 2
+#endif
+
+typedef void (*tc_callback)(void *arg, int status, const char *result);
+
+/* Pool settings; 0 takes the default */
+struct tc_options
+{
+	int connections;
+	int batchmax;								//documents per batch, 1: never batch
+	int linger_us;								//a lone request waits this long for others
+	int retries;								//resends of a request whose connection failed
+	int queuemax;								//requests queued or in flight before tc_transform() refuses
+};
+
+/* What the pool did so far */
+struct tc_stats
+{
+	uint64_t requests;							//answered
+	uint64_t exchanges;							//round trips to the master
+	uint64_t batched;							//requests that went in a batch
+	uint64_t connects;							//connections opened, reconnects included
+	uint64_t retried;
+	uint64_t failed;							//answered TC_ERROR
+};
+
+struct tc_request
+{
+	struct tc_request *next;
+	char sentence[TC_FRAME], chain[TC_FRAME];
+	int priority;
+	uint64_t deadline;							//absolute, CLOCK_MONOTONIC ns; 0: none
+	uint64_t queued;
+	int tries;
+	int alone;									//its batch failed: send it on its own
+	tc_callback cb;
+	void *arg;
+};
+
+/* Connection states */
+#define TC_DOWN 0								/* closed, reopened at retry_at */
+#define TC_CONNECTING 1
+#define TC_IDLE 2
+#define TC_BUSYCONN 3							/* an exchange is in flight */
+
+struct tc_conn
+{
+	int fd;
+	int state;
+	uint64_t retry_at;
+	int backoff_ms;
+	char sentence[TC_FRAME];					//the session's current sentence; "" unknown
+	struct tc_request *inflight;				//requests of the exchange in flight
+	int ninflight;
+	int isbatch;
+	char *out;									//frames not yet written
+	size_t outlen, outoff;
+	char *in;									//answer bytes so far
+	size_t inlen, incap;
+};
+
+struct tc_pool
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct tc_options opt;
+	int epfd, wakefd;
+	pthread_t thread;
+	int stop;
+
+	pthread_mutex_t lock;						//guards submitted, outstanding, stats
+	pthread_cond_t idle;						//outstanding dropped to 0
+	struct tc_request *submitted, *submittedtail;	//handed over by tc_transform()
+	int outstanding;
+	struct tc_stats stats;
+
+	/* I/O thread only */
+	struct tc_request *pending, *pendingtail;
+	struct tc_conn conn[TC_MAX_CONNECTIONS];
+};
+
+/* A request whose caller waits for the answer */
+struct tc_future
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int status;
+	char result[TC_FRAME];
+};
+
+static inline uint64_t tc_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* I/O thread: answer r and forget it */
+static void tc_complete(struct tc_pool *p, struct tc_request *r, int status, const char *result)
+{
+	r->cb(r->arg, status, status == TC_OK ? result : "");
+	free(r);
+	pthread_mutex_lock(&p->lock);
+	p->stats.requests++;
+	p->stats.failed += status == TC_ERROR;
+	if (--p->outstanding == 0)
+		pthread_cond_broadcast(&p->idle);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* I/O thread: put a list of requests back at the head of the queue, oldest first */
+static void tc_requeue(struct tc_pool *p, struct tc_request *list)
+{
+	struct tc_request *r, *next, *keep = NULL, *keeptail = NULL;
+
+	for (r = list; r != NULL; r = next)
+	{
+		next = r->next;
+		r->next = NULL;
+		if (++r->tries > p->opt.retries)
+		{
+			tc_complete(p, r, TC_ERROR, NULL);
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		p->stats.retried++;
+		pthread_mutex_unlock(&p->lock);
+		if (keeptail == NULL)
+			keep = r;
+		else
+			keeptail->next = r;
+		keeptail = r;
+	}
+	if (keeptail != NULL)
+	{
+		keeptail->next = p->pending;
+		p->pending = keep;
+		if (p->pendingtail == NULL)
+			p->pendingtail = keeptail;
+	}
+}
+
+/* I/O thread: drop connection c; it is reopened after its backoff */
+static void tc_conn_fail(struct tc_pool *p, struct tc_conn *c)
+{
+	if (c->fd != -1)
+	{
+		epoll_ctl(p->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->state = TC_DOWN;
+	c->sentence[0] = '\0';
+	c->outlen = c->outoff = c->inlen = 0;
+	c->retry_at = tc_now() + c->backoff_ms * 1000000ULL;
+	c->backoff_ms = c->backoff_ms * 2 > TC_BACKOFF_MAX_MS ? TC_BACKOFF_MAX_MS : c->backoff_ms * 2;
+	tc_requeue(p, c->inflight);
+	c->inflight = NULL;
+	c->ninflight = 0;
+}
+
+/* I/O thread: start a non-blocking connect for c */
+static void tc_conn_open(struct tc_pool *p, struct tc_conn *c)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	c->fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd == -1)
+	{
+		tc_conn_fail(p, c);
+		return;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr *)&p->addr, p->addrlen) == -1 && errno != EINPROGRESS)
+	{
+		tc_conn_fail(p, c);
+		return;
+	}
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(p->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	c->state = TC_CONNECTING;
+	pthread_mutex_lock(&p->lock);
+	p->stats.connects++;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* I/O thread: room for n more bytes of frames on c */
+static char *tc_out(struct tc_conn *c, size_t n)
+{
+	char *grown = realloc(c->out, c->outlen + n);
+
+	if (grown == NULL)
+		return NULL;
+	c->out = grown;
+	c->outlen += n;
+	return c->out + c->outlen - n;
+}
+
+/* I/O thread: append one zero-padded frame */
+static int tc_frame(struct tc_conn *c, const char *text)
+{
+	char *f = tc_out(c, TC_FRAME);
+
+	if (f == NULL)
+		return -1;
+	memset(f, 0, TC_FRAME);
+	memcpy(f, text, strnlen(text, TC_MAX_TEXT));
+	return 0;
+}
+
+/* I/O thread: write what c has queued; -1 when the connection failed */
+static int tc_flush_out(struct tc_pool *p, struct tc_conn *c)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (c->outoff < c->outlen)
+	{
+		n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return -1;
+		c->outoff += n;
+	}
+	if (c->outoff == c->outlen)
+		c->outlen = c->outoff = 0;
+	ev.events = EPOLLIN | (c->outlen > 0 ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(p->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	return 0;
+}
+
+/* Deadline left for r in ms for the option 3/4 frame; 0: none, -1: already passed */
+static int tc_deadline_ms(const struct tc_request *r, uint64_t now)
+{
+	if (r->deadline == 0)
+		return 0;
+	if (now >= r->deadline)
+		return -1;
+	return (r->deadline - now + 999999) / 1000000;
+}
+
+/* I/O thread: queue on idle connection c the frames of the oldest queued request, with
+every queued request for the same chain and priority as one batch. 0; 1 when that request
+had expired and was answered instead; -1 when c cannot take the frames */
+static int tc_dispatch(struct tc_pool *p, struct tc_conn *c, uint64_t now)
+{
+	struct tc_request *first, *r, *prev, *next, *tail;
+	struct batch b;
+	char sel[TC_FRAME], *payload;
+	int n = 0, ms, minms = 0;
+	uint32_t bytes = 0;
+
+	/* take the head, then its companions; expired ones are answered right here */
+	first = p->pending;
+	p->pending = first->next;
+	if (p->pending == NULL)
+		p->pendingtail = NULL;
+	first->next = NULL;
+	if (tc_deadline_ms(first, now) == -1)
+	{
+		tc_complete(p, first, TC_EXPIRED, NULL);
+		return 1;
+	}
+	tail = first;
+	n = 1;
+	bytes = strlen(first->sentence);
+	for (prev = NULL, r = p->pending; r != NULL && !first->alone && n < p->opt.batchmax; r = next)
+	{
+		next = r->next;
+		if (r->alone || r->priority != first->priority || strcmp(r->chain, first->chain) != 0 ||
+			tc_deadline_ms(r, now) == -1)
+		{
+			prev = r;
+			continue;
+		}
+		if (prev == NULL)
+			p->pending = next;
+		else
+			prev->next = next;
+		if (p->pendingtail == r)
+			p->pendingtail = prev;
+		r->next = NULL;
+		tail->next = r;
+		tail = r;
+		n++;
+		bytes += strlen(r->sentence);
+	}
+	c->inflight = first;
+	c->ninflight = n;
+	c->isbatch = n > 1;
+	c->inlen = 0;
+
+	for (r = first; r != NULL; r = r->next)
+		if ((ms = tc_deadline_ms(r, now)) > 0 && (minms == 0 || ms < minms))
+			minms = ms;
+	if (n == 1)
+	{
+		/* one request: option 1 when the session holds another sentence, then option 2 or 3 */
+		if (strcmp(c->sentence, first->sentence) != 0 || c->sentence[0] == '\0')
+		{
+			if (tc_frame(c, "1") == -1 || tc_frame(c, first->sentence) == -1)
+				return -1;
+			strcpy(c->sentence, first->sentence);
+		}
+		if (first->priority == PRIO_NORMAL && minms == 0)
+			strcpy(sel, "2");
+		else
+			snprintf(sel, sizeof(sel), "3 %d %d", first->priority, minms);
+		if (tc_frame(c, sel) == -1 || tc_frame(c, first->chain) == -1)
+			return -1;
+	}
+	else
+	{
+		/* a batch: the documents packed with their offsets (batch.h) */
+		if (batch_alloc(&b, n, bytes) == -1)
+			return -1;
+		for (r = first, n = 0; r != NULL; r = r->next, n++)
+		{
+			b.off[n + 1] = b.off[n] + strlen(r->sentence);
+			memcpy(b.data + b.off[n], r->sentence, b.off[n + 1] - b.off[n]);
+		}
+		if (first->priority == PRIO_NORMAL && minms == 0)
+			snprintf(sel, sizeof(sel), "4 %d %u", n, bytes);
+		else
+			snprintf(sel, sizeof(sel), "4 %d %u %d %d", n, bytes, first->priority, minms);
+		if (tc_frame(c, sel) == -1 || tc_frame(c, first->chain) == -1 || (payload = tc_out(c, batch_wire_size(&b))) == NULL)
+		{
+			batch_free(&b);
+			return -1;
+		}
+		batch_pack(&b, payload);
+		batch_free(&b);
+		pthread_mutex_lock(&p->lock);
+		p->stats.batched += n;
+		pthread_mutex_unlock(&p->lock);
+	}
+	c->state = TC_BUSYCONN;
+	pthread_mutex_lock(&p->lock);
+	p->stats.exchanges++;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/* Status of an answer line that is not a result */
+static int tc_status(const char *line)
+{
+	if (strcmp(line, "BUSY") == 0)
+		return TC_BUSY;
+	if (strcmp(line, "EXPIRED") == 0)
+		return TC_EXPIRED;
+	return TC_ERROR;
+}
+
+/* I/O thread: is the answer to c's exchange complete in c->in? Then hand it out.
+Returns 1 when done, 0 when more bytes are needed, -1 when the stream makes no sense */
+static int tc_answer(struct tc_pool *p, struct tc_conn *c)
+{
+	struct tc_request *r, *next, *list = c->inflight;
+	char *nl, line[TC_FRAME], result[TC_FRAME];
+	unsigned n, bytes, len;
+	size_t head, need;
+	struct batch b;
+	int status, i;
+
+	if ((nl = memchr(c->in, '\n', c->inlen)) == NULL)
+		return c->inlen > TC_FRAME + 64 ? -1 : 0;
+	head = nl + 1 - c->in;
+	len = head - 1 < TC_MAX_TEXT ? head - 1 : TC_MAX_TEXT;
+	memcpy(line, c->in, len);
+	line[len] = '\0';
+
+	if (c->isbatch && sscanf(line, "BATCH %u %u", &n, &bytes) == 2)
+	{
+		if (n != (unsigned)c->ninflight)
+			return -1;
+		need = head + (n + 1) * sizeof(uint32_t) + bytes;
+		if (c->inlen < need)
+			return 0;
+		if (batch_alloc(&b, n, bytes) == -1)
+			return -1;
+		if (batch_unpack_offsets(&b, c->in + head) == -1)
+		{
+			batch_free(&b);
+			return -1;
+		}
+		c->inflight = NULL;
+		for (r = list, i = 0; r != NULL; r = next, i++)
+		{
+			next = r->next;
+			len = b.off[i + 1] - b.off[i];
+			memcpy(result, c->in + head + (n + 1) * sizeof(uint32_t) + b.off[i], len);
+			result[len] = '\0';
+			tc_complete(p, r, TC_OK, result);
+		}
+		batch_free(&b);
+	}
+	else
+	{
+		status = c->isbatch || strcmp(line, "BUSY") == 0 || strcmp(line, "EXPIRED") == 0 ? tc_status(line) : TC_OK;
+		c->inflight = NULL;
+		if (c->isbatch && status == TC_ERROR)
+		{
+			/* the batch as a whole was refused (a step changed a length): one by one instead */
+			for (r = list; r != NULL; r = r->next)
+				r->alone = 1;
+			for (r = list; r != NULL; r = r->next)
+				r->tries--;		//not the connection's fault
+			tc_requeue(p, list);
+		}
+		else
+			for (r = list; r != NULL; r = next)
+			{
+				next = r->next;
+				tc_complete(p, r, status, line);
+			}
+	}
+	c->ninflight = 0;
+	c->inlen = 0;
+	c->state = TC_IDLE;
+	c->backoff_ms = TC_BACKOFF_MIN_MS;
+	return 1;
+}
+
+/* I/O thread: connection c is readable or writable */
+static void tc_conn_event(struct tc_pool *p, struct tc_conn *c, uint32_t events)
+{
+	int err = 0, rc;
+	socklen_t errlen = sizeof(err);
+	char *grown;
+	ssize_t n;
+
+	if (c->state == TC_CONNECTING)
+	{
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0)
+		{
+			tc_conn_fail(p, c);
+			return;
+		}
+		c->state = TC_IDLE;
+		if (tc_flush_out(p, c) == -1)
+			tc_conn_fail(p, c);
+		return;
+	}
+	if ((events & EPOLLOUT) && tc_flush_out(p, c) == -1)
+	{
+		tc_conn_fail(p, c);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return;
+	for (;;)
+	{
+		if (c->incap - c->inlen < 4096)
+		{
+			if ((grown = realloc(c->in, c->incap * 2 + 4096)) == NULL)
+			{
+				tc_conn_fail(p, c);
+				return;
+			}
+			c->in = grown;
+			c->incap = c->incap * 2 + 4096;
+		}
+		n = recv(c->fd, c->in + c->inlen, c->incap - c->inlen, 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0 || c->state != TC_BUSYCONN)
+		{
+			/* closed, or bytes nobody asked for */
+			tc_conn_fail(p, c);
+			return;
+		}
+		c->inlen += n;
+		if ((rc = tc_answer(p, c)) == -1)
+		{
+			tc_conn_fail(p, c);
+			return;
+		}
+		if (rc == 1)
+			break;
+	}
+}
+
+/* The pool's I/O thread */
+static void *tc_loop(void *arg)
+{
+	struct tc_pool *p = arg;
+	struct epoll_event ev[64];
+	struct tc_conn *c, *best;
+	struct tc_request *got, *r;
+	uint64_t now, wake, value;
+	int i, n, rc, timeout, stop;
+
+	for (;;)
+	{
+		/* take over what was submitted */
+		pthread_mutex_lock(&p->lock);
+		got = p->submitted;
+		p->submitted = p->submittedtail = NULL;
+		stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (got != NULL)
+		{
+			if (p->pendingtail == NULL)
+				p->pending = got;
+			else
+				p->pendingtail->next = got;
+			for (r = got; r->next != NULL; r = r->next)
+				;
+			p->pendingtail = r;
+		}
+		if (stop)
+			break;
+
+		/* reopen connections whose backoff is over, and send on idle ones */
+		now = tc_now();
+		wake = 0;
+		for (i = 0; i < p->opt.connections; i++)
+			if (p->conn[i].state == TC_DOWN && now >= p->conn[i].retry_at)
+				tc_conn_open(p, &p->conn[i]);
+		for (i = 0; i < p->opt.connections; i++)
+			if (p->conn[i].state == TC_DOWN && (wake == 0 || p->conn[i].retry_at < wake))
+				wake = p->conn[i].retry_at;
+		while (p->pending != NULL)
+		{
+			/* a lone request lingers for company; a full batch does not wait */
+			if (p->opt.linger_us > 0 && p->pending->next == NULL && now - p->pending->queued < p->opt.linger_us * 1000ULL)
+			{
+				if (wake == 0 || p->pending->queued + p->opt.linger_us * 1000ULL < wake)
+					wake = p->pending->queued + p->opt.linger_us * 1000ULL;
+				break;
+			}
+			best = NULL;
+			for (i = 0; i < p->opt.connections; i++)
+				if (p->conn[i].state == TC_IDLE && p->conn[i].outlen == 0)
+				{
+					best = &p->conn[i];
+					break;
+				}
+			if (best == NULL)
+				break;
+			if ((rc = tc_dispatch(p, best, now)) == -1 || (rc == 0 && tc_flush_out(p, best) == -1))
+				tc_conn_fail(p, best);
+		}
+
+		timeout = -1;
+		if (wake != 0)
+			timeout = wake > now ? (wake - now + 999999) / 1000000 : 0;
+		n = epoll_wait(p->epfd, ev, 64, timeout);
+		for (i = 0; i < n; i++)
+		{
+			if (ev[i].data.ptr == NULL)
+			{
+				if (read(p->wakefd, &value, sizeof(value)) == -1)
+					;
+				continue;
+			}
+			tc_conn_event(p, ev[i].data.ptr, ev[i].events);
+		}
+	}
+
+	/* closing: whatever is still unanswered fails */
+	for (i = 0; i < p->opt.connections; i++)
+	{
+		c = &p->conn[i];
+		p->opt.retries = 0;
+		tc_conn_fail(p, c);
+	}
+	while ((r = p->pending) != NULL)
+	{
+		p->pending = r->next;
+		tc_complete(p, r, TC_ERROR, NULL);
+	}
+	bufpool_drain();			//the batch buffers this thread kept
+	return NULL;
+}
+
+/* Pool of connections to the master at host:port, with its I/O thread; NULL on failure */
+static inline struct tc_pool *tc_open(const char *host, int port, const struct tc_options *opt)
+{
+	struct addrinfo hints, *res;
+	struct epoll_event ev;
+	struct tc_pool *p;
+	char service[16];
+	int i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0)
+		return NULL;
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+	{
+		freeaddrinfo(res);
+		return NULL;
+	}
+	memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+	p->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	if (opt != NULL)
+		p->opt = *opt;
+	if (p->opt.connections <= 0 || p->opt.connections > TC_MAX_CONNECTIONS)
+		p->opt.connections = p->opt.connections <= 0 ? TC_DEFAULT_CONNECTIONS : TC_MAX_CONNECTIONS;
+	if (p->opt.batchmax <= 0 || p->opt.batchmax > BATCH_MAX_DOCS)
+		p->opt.batchmax = p->opt.batchmax <= 0 ? TC_DEFAULT_BATCHMAX : BATCH_MAX_DOCS;
+	if (p->opt.retries <= 0)
+		p->opt.retries = TC_DEFAULT_RETRIES;
+	if (p->opt.queuemax <= 0)
+		p->opt.queuemax = TC_DEFAULT_QUEUEMAX;
+	for (i = 0; i < p->opt.connections; i++)
+	{
+		p->conn[i].fd = -1;
+		p->conn[i].backoff_ms = TC_BACKOFF_MIN_MS;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (p->epfd == -1 || p->wakefd == -1 || epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->wakefd, &ev) == -1 ||
+		pthread_create(&p->thread, NULL, tc_loop, p) != 0)
+	{
+		if (p->epfd != -1)
+			close(p->epfd);
+		if (p->wakefd != -1)
+			close(p->wakefd);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Wake the I/O thread */
+static inline void tc_wake(struct tc_pool *p)
+{
+	uint64_t one = 1;
+
+	if (write(p->wakefd, &one, sizeof(one)) == -1)
+		;
+}
+
+/* Queue "sentence through chain" and return; cb(arg, status, result) runs with the answer.
+priority as option 3 (PRIO_*), deadline_ms from now (0: none). 0, or -1 with errno
+EINVAL (too long, or a chain with codes other than 1-6) or EAGAIN (queuemax reached) */
+static inline int tc_transform(struct tc_pool *p, const char *sentence, const char *chain, int priority, int deadline_ms,
+							   tc_callback cb, void *arg)
+{
+	struct tc_request *r;
+	size_t i;
+
+	if (strlen(sentence) > TC_MAX_TEXT || strchr(sentence, '\n') != NULL || strlen(chain) > TC_MAX_TEXT ||
+		chain[0] == '\0' || priority < PRIO_INTERACTIVE || priority > PRIO_BULK || cb == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; chain[i] != '\0'; i++)
+		if (chain[i] < '1' || chain[i] > '6')
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return -1;
+	strcpy(r->sentence, sentence);
+	strcpy(r->chain, chain);
+	r->priority = priority;
+	r->queued = tc_now();
+	r->deadline = deadline_ms > 0 ? r->queued + deadline_ms * 1000000ULL : 0;
+	r->cb = cb;
+	r->arg = arg;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->outstanding >= p->opt.queuemax || p->stop)
+	{
+		pthread_mutex_unlock(&p->lock);
+		free(r);
+		errno = EAGAIN;
+		return -1;
+	}
+	p->outstanding++;
+	if (p->submittedtail == NULL)
+		p->submitted = r;
+	else
+		p->submittedtail->next = r;
+	p->submittedtail = r;
+	pthread_mutex_unlock(&p->lock);
+	tc_wake(p);
+	return 0;
+}
+
+static void tc_future_done(void *arg, int status, const char *result)
+{
+	struct tc_future *f = arg;
+
+	pthread_mutex_lock(&f->lock);
+	f->status = status;
+	strcpy(f->result, result);
+	f->done = 1;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* tc_transform() whose answer lands in f; wait for it with tc_future_wait() */
+static inline int tc_transform_future(struct tc_pool *p, const char *sentence, const char *chain, int priority,
+									  int deadline_ms, struct tc_future *f)
+{
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->done = 0;
+	f->result[0] = '\0';
+	return tc_transform(p, sentence, chain, priority, deadline_ms, tc_future_done, f);
+}
+
+/* Has f been answered? (does not block) */
+static inline int tc_future_ready(struct tc_future *f)
+{
+	int done;
+
+	pthread_mutex_lock(&f->lock);
+	done = f->done;
+	pthread_mutex_unlock(&f->lock);
+	return done;
+}
+
+/* Wait for f's answer; returns its status, the result is in f->result */
+static inline int tc_future_wait(struct tc_future *f)
+{
+	pthread_mutex_lock(&f->lock);
+	while (!f->done)
+		pthread_cond_wait(&f->cond, &f->lock);
+	pthread_mutex_unlock(&f->lock);
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	return f->status;
+}
+
+/* Wait until every request submitted so far has been answered */
+static inline void tc_flush(struct tc_pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	while (p->outstanding > 0)
+		pthread_cond_wait(&p->idle, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static inline void tc_get_stats(struct tc_pool *p, struct tc_stats *st)
+{
+	pthread_mutex_lock(&p->lock);
+	*st = p->stats;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Stop the I/O thread and close the connections; unanswered requests get TC_ERROR */
+static inline void tc_close(struct tc_pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_mutex_unlock(&p->lock);
+	tc_wake(p);
+	pthread_join(p->thread, NULL);
+	close(p->epfd);
+	close(p->wakefd);
+	for (i = 0; i < p->opt.connections; i++)
+	{
+		free(p->conn[i].out);
+		free(p->conn[i].in);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->idle);
+	free(p);
+}
+
+#endif /* TRANSFORMCLIENT_H */
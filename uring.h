@@ -0,0 +1,243 @@
+/*
+Minimal io_uring wrapper for the master server (no liburing needed).
+
+The master normally makes one blocking syscall per accept, recv, send,
+sendmsg and recvmsg. With io_uring the requests are written into a
+submission ring shared with the kernel, and one io_uring_enter() both
+submits everything queued so far and waits for completions:
+
+	- the parent arms one multishot accept; each new client is a
+	  completion, and closing the parent's copy of the client socket is
+	  queued and goes in with the next wait
+	- each session child arms one multishot recv on its client socket;
+	  every completion is one recv() worth of bytes in a buffer picked by
+	  the kernel from a registered provided-buffer ring, so there is no
+	  syscall per frame
+	- a chain step is a sendmsg linked to a recvmsg on the session's one
+	  UDP socket: one io_uring_enter() per step instead of four syscalls
+	- the client socket and the UDP socket are registered (fixed) files
+
+Rings cannot be shared by the forked session processes, so every process
+has its own small ring; what is batched is the work of one process.
+Frames are at most 100 bytes, so fixed buffers (IORING_REGISTER_BUFFERS)
+would buy nothing over the provided-buffer ring; they only pay off for
+large READ_FIXED/WRITE_FIXED or zero-copy transfers.
+
+Every function returns -1 when io_uring is not usable (old kernel,
+disabled by sysctl or seccomp); the caller then uses plain syscalls.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* One ring: the mmap'd submission and completion queues of one process */
+struct uring
+{
+	int fd;							//-1: not set up
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned sq_local;				//our tail, published on submit
+	unsigned to_submit;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t rings_size, sqes_size;
+};
+
+/* Provided-buffer ring: fixed-size buffers the kernel picks for recv */
+struct uring_bufs
+{
+	struct io_uring_buf_ring *br;
+	char *data;
+	size_t mapsize;
+	unsigned nbufs, size;			//nbufs is a power of two
+	uint16_t tail;
+};
+
+/* Set up a ring with room for entries submissions; 0 or -1 */
+static inline int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq;
+	size_t sqsize, cqsize;
+
+	r->fd = -1;
+	memset(&p, 0, sizeof(p));
+	/* one process submits and waits on it; completions only run when it waits */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (r->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_CQE_SKIP))
+	{
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->rings_size = sqsize > cqsize ? sqsize : cqsize;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		if (sq != MAP_FAILED)
+			munmap(sq, r->rings_size);
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	r->rings = sq;
+	r->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)sq + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)sq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)sq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)sq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	r->to_submit = 0;
+	return 0;
+}
+
+/* Drop the ring, e.g. the parent's ring inherited by a forked child */
+static inline void uring_exit(struct uring *r)
+{
+	if (r->fd == -1)
+		return;
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->rings, r->rings_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/* Next free submission entry, zeroed; NULL when the queue is full */
+static inline struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx = r->sq_local & *r->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (r->sq_local - head >= r->sq_entries)
+		return NULL;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	r->to_submit++;
+	return sqe;
+}
+
+/* Fill the fields most operations use */
+static inline void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, uint64_t data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->user_data = data;
+}
+
+/* Submit what is queued and wait for at least wait completions (0: don't wait);
+-1 with errno EINTR when a signal came first */
+static inline int uring_submit(struct uring *r, unsigned wait)
+{
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret > 0)
+		r->to_submit -= ret;
+	return ret < 0 ? -1 : ret;
+}
+
+/* Oldest unread completion, or NULL */
+static inline struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+/* Hand the completion returned by uring_cqe() back to the kernel */
+static inline void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Register fds as fixed files 0..n-1 (use with IOSQE_FIXED_FILE) */
+static inline int uring_register_files(struct uring *r, const int *fds, unsigned n)
+{
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, n) < 0 ? -1 : 0;
+}
+
+/* Give buffer bid (back) to the kernel */
+static inline void uring_buf_put(struct uring_bufs *b, unsigned bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nbufs - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(b->data + (size_t)bid * b->size);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+/* Bytes of buffer bid */
+static inline char *uring_buf(struct uring_bufs *b, unsigned bid)
+{
+	return b->data + (size_t)bid * b->size;
+}
+
+/* Register nbufs (power of two) buffers of size bytes as buffer group bgid; 0 or -1 */
+static inline int uring_bufs_init(struct uring *r, struct uring_bufs *b, int bgid, unsigned nbufs, unsigned size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ringsize = nbufs * sizeof(struct io_uring_buf);
+	unsigned i;
+
+	/* the ring must be page aligned; the buffers follow it in the same mapping */
+	b->mapsize = ringsize + (size_t)nbufs * size;
+	b->br = mmap(NULL, b->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED)
+		return -1;
+	b->data = (char *)b->br + ringsize;
+	b->nbufs = nbufs;
+	b->size = size;
+	b->tail = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		munmap(b->br, b->mapsize);
+		return -1;
+	}
+	for (i = 0; i < nbufs; i++)
+		uring_buf_put(b, i);
+	return 0;
+}
+
+#endif /* URING_H */
@@ -0,0 +1,298 @@
+/*
+UTF-8 aware text kernels shared by upper, lower, caesar and reverse.
+
+Sentences are UTF-8. The kernels map whole characters, never the bytes of
+one: case mapping covers ASCII, the Latin-1 Supplement (à..þ, ÿ),
+Greek (α..ω, final ς has no capital of its own and becomes Σ) and Cyrillic
+(а..я, ѐ..џ); caesar rotates each alphabet by half its length (ASCII
+ROT13, the 24 Greek letters by 12, the 32 basic Cyrillic letters by 16),
+so applying it twice gives the text back; reverse reverses the order of
+the characters, keeping the bytes of each one in order. Every mapped
+character is two bytes in and two bytes out, so a result is exactly as
+long as its input and the master can keep treating upper, lower and
+caesar as position-preserving (batches, incremental splicing).
+
+Bytes that are not part of a valid two-byte sequence (three- and
+four-byte characters, stray or truncated bytes) are copied as they are.
+Reverse takes a character to be a lead byte and all the continuation
+bytes it calls for, as the input reads front to back; any other byte
+(stray, or of a truncated character) moves as a character of its own.
+
+Most text is ASCII, so the kernels look at UTF8_BLOCK (32) bytes at a
+time: a block without a byte >= 0x80 is mapped with vector operations
+(GCC vector extensions: one AVX2 register with -mavx2, two SSE2 ones on
+plain x86-64), and only a block holding a multi-byte character drops to
+the decoder, which carries on character by character until it reaches
+the next block boundary after that character.
+
+Usage:
+	len = utf8_upper(in, len, out, cap);		//also utf8_lower, utf8_caesar, utf8_reverse
+*/
+
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+/* Manifest constants */
+#define UTF8_BLOCK 32
+
+typedef unsigned char utf8_vec __attribute__((vector_size(UTF8_BLOCK)));
+
+/* Does the block at p hold only ASCII? */
+static inline int utf8_block_ascii(const char *p)
+{
+	uint64_t w[UTF8_BLOCK / 8];
+
+	memcpy(w, p, UTF8_BLOCK);
+	return ((w[0] | w[1] | w[2] | w[3]) & 0x8080808080808080ULL) == 0;
+}
+
+/* Lanes of v in [lo, hi]: 0xff, else 0. Vectors go by pointer: without -mavx2 a
+32-byte vector argument has no register to travel in */
+#define UTF8_RANGE(v, lo, hi) ((utf8_vec)((v) >= (lo)) & (utf8_vec)((v) <= (hi)))
+
+static inline void utf8_vec_upper(utf8_vec *v)
+{
+	*v -= UTF8_RANGE(*v, 'a', 'z') & 0x20;
+}
+
+static inline void utf8_vec_lower(utf8_vec *v)
+{
+	*v += UTF8_RANGE(*v, 'A', 'Z') & 0x20;
+}
+
+static inline void utf8_vec_caesar(utf8_vec *v)
+{
+	utf8_vec lo = UTF8_RANGE(*v, 'a', 'z'), up = UTF8_RANGE(*v, 'A', 'Z');
+	utf8_vec t = *v + ((lo | up) & 13);
+
+	/* past z (or Z): back by 26 */
+	*v = t - (((lo & (utf8_vec)(t > 'z')) | (up & (utf8_vec)(t > 'Z'))) & 26);
+}
+
+/* Code point mappings */
+static inline uint32_t utf8_cp_upper(uint32_t c)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7))
+		return c - 0x20;
+	if (c == 0xFF)
+		return 0x178;						//ÿ -> Ÿ
+	if (c == 0x3C2)
+		return 0x3A3;						//final ς -> Σ
+	if (c >= 0x3B1 && c <= 0x3C9)
+		return c - 0x20;
+	if (c >= 0x430 && c <= 0x44F)
+		return c - 0x20;
+	if (c >= 0x450 && c <= 0x45F)
+		return c - 0x50;
+	return c;
+}
+
+static inline uint32_t utf8_cp_lower(uint32_t c)
+{
+	if ((c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7))
+		return c + 0x20;
+	if (c == 0x178)
+		return 0xFF;
+	if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2)
+		return c + 0x20;
+	if (c >= 0x410 && c <= 0x42F)
+		return c + 0x20;
+	if (c >= 0x400 && c <= 0x40F)
+		return c + 0x50;
+	return c;
+}
+
+/* Rotate c by half of its alphabet, which starts at first and has n letters
+(skipping the unassigned Greek capital U+03A2 and the final sigma) */
+static inline uint32_t utf8_rotate(uint32_t c, uint32_t first, uint32_t n)
+{
+	uint32_t i = c - first;
+
+	if (first == 0x391 || first == 0x3B1)
+	{
+		/* Greek: index 17 (U+03A2 / U+03C2) is not one of the 24 letters */
+		if (i == 17)
+			return c;
+		i -= i > 17;
+		i = (i + n / 2) % n;
+		return first + i + (i >= 17);
+	}
+	return first + (i + n / 2) % n;
+}
+
+static inline uint32_t utf8_cp_caesar(uint32_t c)
+{
+	if (c >= 'a' && c <= 'z')
+		return utf8_rotate(c, 'a', 26);
+	if (c >= 'A' && c <= 'Z')
+		return utf8_rotate(c, 'A', 26);
+	if (c >= 0x391 && c <= 0x3A9)
+		return utf8_rotate(c, 0x391, 24);
+	if (c >= 0x3B1 && c <= 0x3C9)
+		return utf8_rotate(c, 0x3B1, 24);
+	if (c >= 0x410 && c <= 0x42F)
+		return utf8_rotate(c, 0x410, 32);
+	if (c >= 0x430 && c <= 0x44F)
+		return utf8_rotate(c, 0x430, 32);
+	return c;
+}
+
+static inline int utf8_continuation(unsigned char b)
+{
+	return (b & 0xC0) == 0x80;
+}
+
+/* One character at in[i] (at most n bytes left) mapped into out; returns its length */
+static inline size_t utf8_map_char(const unsigned char *in, size_t n, unsigned char *out, uint32_t (*map)(uint32_t))
+{
+	uint32_t c, m;
+
+	if (in[0] < 0x80)
+	{
+		out[0] = map(in[0]);
+		return 1;
+	}
+	if (in[0] >= 0xC2 && in[0] <= 0xDF && n >= 2 && utf8_continuation(in[1]))
+	{
+		c = (in[0] & 0x1F) << 6 | (in[1] & 0x3F);
+		m = map(c);
+		if (m < 0x80 || m > 0x7FF)
+			m = c;							//only same-length mappings, the result keeps its size
+		out[0] = 0xC0 | m >> 6;
+		out[1] = 0x80 | (m & 0x3F);
+		return 2;
+	}
+	out[0] = in[0];
+	return 1;
+}
+
+/* Map every character of in into out: ASCII blocks with vmap, the rest with map */
+static inline size_t utf8_map(const char *in, size_t len, char *out, size_t cap,
+							  void (*vmap)(utf8_vec *), uint32_t (*map)(uint32_t))
+{
+	const unsigned char *s = (const unsigned char *)in;
+	unsigned char *d = (unsigned char *)out;
+	size_t i = 0, end;
+	utf8_vec v;
+
+	if (len > cap)
+		len = cap;
+	while (i < len)
+	{
+		if (len - i >= UTF8_BLOCK && utf8_block_ascii(in + i))
+		{
+			memcpy(&v, s + i, UTF8_BLOCK);
+			vmap(&v);
+			memcpy(d + i, &v, UTF8_BLOCK);
+			i += UTF8_BLOCK;
+			continue;
+		}
+		/* a block with multi-byte characters, or the tail: decode up to the next block boundary */
+		for (end = i + UTF8_BLOCK < len ? i + UTF8_BLOCK : len; i < end;)
+			i += utf8_map_char(s + i, len - i, d + i, map);
+	}
+	return len;
+}
+
+static inline size_t utf8_upper(const char *in, size_t len, char *out, size_t cap)
+{
+	return utf8_map(in, len, out, cap, utf8_vec_upper, utf8_cp_upper);
+}
+
+static inline size_t utf8_lower(const char *in, size_t len, char *out, size_t cap)
+{
+	return utf8_map(in, len, out, cap, utf8_vec_lower, utf8_cp_lower);
+}
+
+static inline size_t utf8_caesar(const char *in, size_t len, char *out, size_t cap)
+{
+	return utf8_map(in, len, out, cap, utf8_vec_caesar, utf8_cp_caesar);
+}
+
+/* The block at p, back to front, into *v */
+static inline void utf8_vec_reverse(const unsigned char *p, utf8_vec *v)
+{
+	const utf8_vec rev = {31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16,
+						  15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+
+	memcpy(v, p, UTF8_BLOCK);
+	*v = __builtin_shuffle(*v, rev);
+}
+
+/* Bytes in the character that starts with b; 0: not a lead byte */
+static inline size_t utf8_lead_length(unsigned char b)
+{
+	if (b < 0x80)
+		return 1;
+	if ((b & 0xE0) == 0xC0)
+		return 2;
+	if ((b & 0xF0) == 0xE0)
+		return 3;
+	if ((b & 0xF8) == 0xF0)
+		return 4;
+	return 0;
+}
+
+/* Reverse the characters of in into out (which may be in) */
+static inline size_t utf8_reverse(const char *in, size_t len, char *out, size_t cap)
+{
+	unsigned char *d = (unsigned char *)out, z;
+	size_t i, j, k, m, n, x;
+	utf8_vec a, b;
+
+	if (len > cap)
+		len = cap;
+	if (out != in)
+		memcpy(out, in, len);
+
+	/* reverse the bytes, a block from each end at a time while they do not meet */
+	for (i = 0; 2 * (i + UTF8_BLOCK) <= len; i += UTF8_BLOCK)
+	{
+		utf8_vec_reverse(d + i, &a);
+		utf8_vec_reverse(d + len - i - UTF8_BLOCK, &b);
+		memcpy(d + i, &b, UTF8_BLOCK);
+		memcpy(d + len - i - UTF8_BLOCK, &a, UTF8_BLOCK);
+	}
+	for (j = len - i; i + 1 < j; i++, j--)
+	{
+		z = d[i];
+		d[i] = d[j - 1];
+		d[j - 1] = z;
+	}
+
+	/* each multi-byte character now reads back to front: turn it around again. Characters
+	are what they were in the input, read front to back (input byte x is now d[len - 1 - x]):
+	a lead byte with all the continuation bytes it calls for; any other byte is one on its
+	own. ASCII blocks have none and are skipped whole */
+	for (x = 0; x < len;)
+	{
+		i = len - x;						//the input from byte x on is d[0 .. i), back to front
+		if (i >= UTF8_BLOCK && utf8_block_ascii(out + i - UTF8_BLOCK))
+		{
+			x += UTF8_BLOCK;
+			continue;
+		}
+		n = utf8_lead_length(d[i - 1]);
+		for (k = 1; k < n && k < i && utf8_continuation(d[i - 1 - k]); k++)
+			;
+		if (n < 2 || k < n)
+		{
+			x++;							//ASCII, a stray byte, or a truncated character
+			continue;
+		}
+		for (k = i - n, m = i - 1; k < m; k++, m--)
+		{
+			z = d[k];
+			d[k] = d[m];
+			d[m] = z;
+		}
+		x += n;
+	}
+	return len;
+}
+
+#endif /* UTF8_H */
@@ -1,4 +1,4 @@
-/* 
+/*
 //Author Sajid Choudhry, with the use of  Dr. Carey Williamsons Code.
 
 
@@ -8,117 +8,237 @@ Microserver:
 
     AceRage GEny! becomes AZeZaZe ZEZyZ
 
+    Built with -DTRANSFORM_PLUGIN this is plugins/yours.so instead.
+
+    The original loop (i = 1, 3, ...; a space steps back one) means:
+    character j is replaced when it is not a space and character j-1
+    was not replaced; character 0 never is. Inside a run of non-space
+    characters the replaced ones alternate, starting with the run's
+    first character, or with its second for the run holding character 0.
+    So the kernel works on 64-character blocks as bit masks: the
+    non-space mask N comes from SIMD compares, and adding the run starts
+    that sit at even positions to N clears exactly the runs that start
+    at an even position (the carry ripples through each run, and on into
+    the next block); those runs get Z at even positions, the others at
+    odd ones. Between blocks only two bits travel: whether the last
+    character was a non-space, and the carry. Both can be found for any
+    position by looking back to the previous space, so a large input is
+    cut into chunks that threads process side by side.
 
  */
 
 /* Include files */
-#include <stdio.h>
-#include <unistd.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <ctype.h>  //islower() isupper()
-
+#include <stdint.h>
+#include <ctype.h>  //isspace()
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>  //SSE2 / AVX2 compares and movemask
+#endif
+#include "microserver.h"  //shared UDP microserver loop
 
 /* Manifest constants */
-#define MAX_BUFFER_SIZE 100  /*max sentence size*/
-#define PORT 8081           /*client sends to this port and receives from this port*/
-                            /*client has its own dynamic port number*/
-#define DEBUG 1             /* Verbose debugging */
-
-void transform(char array[])
+#define YOURS_BLOCK 64                     /* characters per mask */
+#define YOURS_EVEN 0x5555555555555555ULL    /* bits at even positions */
+#define YOURS_ODD 0xAAAAAAAAAAAAAAAAULL
+#define YOURS_PARALLEL_MIN (1 << 20)        /* inputs at least this long are split over threads */
+#define YOURS_MAX_THREADS 8
+
+/* What one block hands the next */
+struct yours_state
 {
-        int len = strlen(array);
-        char z;
-        int d;
-
-        for(int i=1; i < len; i=i+2)
-        {
+    uint64_t prev;      //1: the character before the block is not a space
+    uint64_t carry;     //1: and its run started at an even position
+};
 
-                if( isspace(array[i]) )
-                {
-                    i--;
-                    continue;
-                }
-                array[i] = 'Z';
+/* Bit k set when character k of the 64 at p is a space, as isspace() in the C locale */
+static inline uint64_t yours_spaces(const unsigned char *p)
+{
+#if defined(__AVX2__)
+    const __m256i blank = _mm256_set1_epi8(' '), lo = _mm256_set1_epi8('\t' - 1), hi = _mm256_set1_epi8('\r' + 1);
+    uint64_t m = 0;
+    int k;
 
-            
-        }
+    for (k = 0; k < 2; k++)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+        __m256i s = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank),
+                                    _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v)));
+        m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (32 * k);
+    }
+    return m;
+#elif defined(__SSE2__)
+    const __m128i blank = _mm_set1_epi8(' '), lo = _mm_set1_epi8('\t' - 1), hi = _mm_set1_epi8('\r' + 1);
+    uint64_t m = 0;
+    int k;
+
+    /* bytes >= 0x80 are negative to the signed compares, so never in \t..\r */
+    for (k = 0; k < 4; k++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        __m128i s = _mm_or_si128(_mm_cmpeq_epi8(v, blank), _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << (16 * k);
+    }
+    return m;
+#else
+    uint64_t m = 0;
+    int k;
+
+    for (k = 0; k < YOURS_BLOCK; k++)
+        m |= (uint64_t)(p[k] == ' ' || (p[k] >= '\t' && p[k] <= '\r')) << k;
+    return m;
+#endif
+}
 
+/* Mask of the characters of a block that become Z; n valid characters, st carried over */
+static inline uint64_t yours_mask(uint64_t spaces, int n, struct yours_state *st)
+{
+    uint64_t N = ~spaces, starts, sum, evenruns;
+    unsigned long long s1, s2;
+    int c1, c2;
+
+    if (n < YOURS_BLOCK)
+        N &= (1ULL << n) - 1;
+    starts = N & ~((N << 1) | st->prev);
+    /* N + even starts (+ the carry of a run still going): every run that started at an
+    even position overflows out of N and is cleared */
+    c1 = __builtin_uaddll_overflow(N, starts & YOURS_EVEN, &s1);
+    c2 = __builtin_uaddll_overflow(s1, st->carry, &s2);
+    sum = s2;
+    evenruns = N & ~sum;
+    st->prev = N >> 63;
+    st->carry = c1 | c2;
+    return (evenruns & YOURS_EVEN) | (N & ~evenruns & YOURS_ODD);
 }
 
+/* Put 'Z' where the low 8 bits of m say, in the 8 characters at p */
+static inline void yours_blend8(unsigned char *p, unsigned m)
+{
+    uint64_t w, sel;
+
+    /* spread bit k of m to the whole of byte k */
+    sel = ((uint64_t)m * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+    sel = (((sel + 0x7F7F7F7F7F7F7F7FULL) & 0x8080808080808080ULL) >> 7) * 0xFF;
+    memcpy(&w, p, 8);
+    w = (w & ~sel) | (0x5A5A5A5A5A5A5A5AULL & sel);     //'Z'
+    memcpy(p, &w, 8);
+}
 
-int main()
+/* State on entry to position from: look back to the run the previous character is in */
+static struct yours_state yours_state_at(const unsigned char *in, size_t from)
 {
-    struct sockaddr_in si_server, si_client;      //struct objects of type sockaddr_in called si_server, and si_client
-                                                    //server will store client IP and port in struct si_client when it receives a message
-    struct sockaddr *server, *client;             //pointers for ease of use in methods
-    int s;                                        //listening socket id
-    int len=sizeof(si_server);              
-    char messagein[MAX_BUFFER_SIZE];              //store messages received by client
-    char messageout[MAX_BUFFER_SIZE];             //store messages that will be sent to client
-    int readBytes;
-
-    //1a- set up listening socket
-    //AF_INET: IPv4 protocol, SOCK_DGRAM: socket type UDP, IPPROTO_UDP: use UDP protocol
-    if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
+    struct yours_state st = {1, 0};     //before character 0: as if a run started at -1
+    size_t start = from;
+
+    if (from == 0)
+        return st;
+    if (isspace(in[from - 1]))
     {
-        printf("Could not setup a socket for UDP!\n");
-        return 1;
+        st.prev = 0;
+        return st;
     }
-   //1b- Initialize attributes of si_server struct
-    memset((char *) &si_server, 0, sizeof(si_server));    //fill in the memory area the si_server struct holds, with 0's
-    si_server.sin_family = AF_INET;                 //server attribute set as IPV4
-    si_server.sin_port = htons(PORT);               //PORT 
-    si_server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server = (struct sockaddr *) &si_server;        //set pointers to point to struct si_server, and si_client
-    client = (struct sockaddr *) &si_client;          //client storing client IP and port in this struct when connection is made
-
-
-    //2 bind listening socket (s) port # and IP # (from struct server)
-    if (bind(s, server, sizeof(si_server))==-1)
-      {
-            printf("Could not bind to port %d!\n", PORT);
-            return 1;
-      }
-
-    fprintf(stderr, "My microserver is online!\n");
-    printf("Microserver now listening on UDP port %d...\n", PORT);
-
-
+    while (start > 0 && !isspace(in[start - 1]))
+        start--;
+    st.carry = start > 0 && start % 2 == 0;     //the run holding character 0 counts as odd
+    return st;
+}
 
-                /* clear out message buffers to be safe */
-                bzero(messagein, MAX_BUFFER_SIZE);
-                bzero(messageout, MAX_BUFFER_SIZE);
+/* Characters [from, to) of out, read from in (the same bytes), from state st */
+static void yours_range(const unsigned char *in, unsigned char *out, size_t from, size_t to, struct yours_state st)
+{
+    unsigned char tail[YOURS_BLOCK];
+    uint64_t z;
+    size_t i;
+    int n, k;
 
-                /* see what comes in from a client, if anything */
-                if ((readBytes=recvfrom(s, messagein, MAX_BUFFER_SIZE, 0, client, &len)) < 0)
-                  {
-                    printf("Read error!\n");
-                    return -1;
-                  }
-              #ifdef DEBUG
-                else printf("Microserver received %d bytes from master server.\n", readBytes);
-              #endif
+    for (i = from; i < to; i += YOURS_BLOCK)
+    {
+        n = to - i < YOURS_BLOCK ? to - i : YOURS_BLOCK;
+        if (n == YOURS_BLOCK)
+        {
+            z = yours_mask(yours_spaces(in + i), n, &st);
+            for (k = 0; k < YOURS_BLOCK; k += 8)
+                if ((z >> k) & 0xFF)
+                    yours_blend8(out + i + k, (z >> k) & 0xFF);
+        }
+        else
+        {
+            /* the last, short block: through a padded copy */
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, in + i, n);
+            z = yours_mask(yours_spaces(tail), n, &st);
+            for (k = 0; k < n; k++)
+                if ((z >> k) & 1)
+                    out[i + k] = 'Z';
+        }
+    }
+}
 
-                printf("  server received \"%s\" from IP %s port %d.\n",
-                      messagein, inet_ntoa(si_client.sin_addr), ntohs(si_client.sin_port));    ////get client IP and port from client struct
+struct yours_chunk
+{
+    const unsigned char *in;
+    unsigned char *out;
+    size_t from, to;
+    struct yours_state st;
+};
 
-                /*manipulate the message*/
-                transform(messagein);
+static void *yours_thread(void *arg)
+{
+    struct yours_chunk *c = arg;
 
-                /* create the outgoing message (as an ASCII string) */
-                sprintf(messageout, "%s", messagein);
+    yours_range(c->in, c->out, c->from, c->to, c->st);
+    return NULL;
+}
 
-              #ifdef DEBUG
-                printf("Microserver sending back the message to master: \"%s\"\n\n", messageout);
-              #endif
+size_t yours_kernel(const char *in, size_t len, char *out, size_t cap)
+{
+        struct yours_chunk chunk[YOURS_MAX_THREADS];
+        pthread_t tid[YOURS_MAX_THREADS];
+        long nthreads, t, started;
+        size_t per;
+
+        if (len > cap)
+            len = cap;
+        if (out != in)
+            memcpy(out, in, len);
+
+        nthreads = 1;
+        if (len >= YOURS_PARALLEL_MIN && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) > YOURS_MAX_THREADS)
+            nthreads = YOURS_MAX_THREADS;
+        if (nthreads <= 1)
+        {
+            yours_range((unsigned char *)out, (unsigned char *)out, 0, len, yours_state_at((unsigned char *)out, 0));
+            return len;
+        }
 
-                /* send the result message back to the client */
-                sendto(s, messageout, strlen(messageout), 0, client, len);		
+        /* every chunk's entry state first, before any thread writes a Z (a Z never
+        replaces a space, but the others would read bytes being written) */
+        per = ((len + nthreads - 1) / nthreads + YOURS_BLOCK - 1) / YOURS_BLOCK * YOURS_BLOCK;
+        for (t = 0; t < nthreads; t++)
+        {
+            chunk[t].in = chunk[t].out = (unsigned char *)out;
+            chunk[t].from = t * per < len ? t * per : len;
+            chunk[t].to = (t + 1) * per < len && t + 1 < nthreads ? (t + 1) * per : len;
+            chunk[t].st = yours_state_at((unsigned char *)out, chunk[t].from);
+        }
+        for (started = 1; started < nthreads; started++)
+            if (pthread_create(&tid[started], NULL, yours_thread, &chunk[started]) != 0)
+                break;
+        yours_thread(&chunk[0]);
+        for (t = 1; t < started; t++)
+            pthread_join(tid[t], NULL);
+        for (t = started; t < nthreads; t++)
+            yours_thread(&chunk[t]);        //threads that could not be started
+        return len;
+}
 
 
-    close(s);
-    return 0;
-  }
\ No newline at end of file
+#ifdef TRANSFORM_PLUGIN
+TRANSFORM_PLUGIN_EXPORT(6, "yours", yours_kernel)
+#else
+int main(int argc, char *argv[])
+{
+    return microserver_main(argc, argv, "My", yours_kernel);
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+Zero-copy sends of large answers to the client.
+
+A batch answer (option 4) is the wire image its documents arrived in,
+transformed in place, and goes out behind its BATCH line in one
+scatter-gather sendmsg() (session_sendv_all() in mainserver.c). From
+mainserver -Z bytes on, that send is also zero-copy: the kernel sends
+from the pages of the buffer instead of copying them into the socket,
+so the buffer must stay untouched until the kernel reports the send
+complete, which is long after sendmsg() returned. The session therefore
+does not put such a buffer back into its pool (bufpool.h) but hands it
+to zc_hold(), and it is put back when the completion comes in:
+
+	- plain sockets: MSG_ZEROCOPY; the socket's error queue reports
+	  ranges of send ids as done (zc_reap())
+	- io_uring: IORING_OP_SENDMSG_ZC; a second completion with
+	  IORING_CQE_F_NOTIF follows the result (zc_completed())
+
+Zero copy only pays for large sends: pinning the pages and the
+completion cost more than copying a few kilobytes, and over loopback
+the kernel copies anyway (counted in zc_stats.copied).
+
+A result that lives in a file goes from the page cache to the socket
+with splice() through a pipe and never passes through user memory
+(zc_send_file()).
+
+Usage:
+	zc_init(sockfd, threshold);				//0, or -1: no zero copy on this socket
+	if (zc_wanted(len)) ...MSG_ZEROCOPY...; id = zc_sent(len);	//for every zero-copy send
+	while (zc_hold(buf) == -1) zc_reap(sockfd, 1);		//buf goes back to the pool when done
+	zc_reap(sockfd, 0);						//plain sockets: completions so far
+	zc_completed(id, id, copied);			//io_uring: the notification of send id
+	zc_send_file(sockfd, filefd, offset, len);
+*/
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "bufpool.h"
+
+/* Manifest constants */
+#define ZC_MAX_HELD 16						/* buffers waiting for their completion */
+#define ZC_WAIT_MS 100						/* zc_reap() polls the error queue this long at a time */
+#define ZC_PIPE_SIZE 65536					/* bytes one splice() moves at most */
+#define ZC_SPLICE_MOVE 1					/* SPLICE_F_MOVE, without _GNU_SOURCE */
+#define ZC_SPLICE_MORE 4					/* SPLICE_F_MORE */
+
+struct zc_counters
+{
+	uint64_t sends;							//zero-copy sends
+	uint64_t bytes;							//bytes they carried
+	uint64_t copied;						//completions the kernel had to copy after all
+};
+
+struct zc_held
+{
+	void *buf;
+	uint32_t id;							//last send that uses buf
+};
+
+static size_t zc_threshold;					//0: zero copy off
+static uint32_t zc_next;					//id of the next zero-copy send, as the kernel counts
+static uint32_t zc_done;					//sends before this id are complete
+static struct zc_held zc_hold_list[ZC_MAX_HELD];
+static int zc_nheld;
+static struct zc_counters zc_stats;
+static int zc_pipe[2] = {-1, -1};
+
+/* Turn zero copy on for sends of at least threshold bytes on sockfd; 0, or -1 */
+static inline int zc_init(int sockfd, size_t threshold)
+{
+	int one = 1;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+		return -1;
+	zc_threshold = threshold;
+	return 0;
+}
+
+static inline int zc_wanted(size_t len)
+{
+	return zc_threshold > 0 && len >= zc_threshold;
+}
+
+/* A zero-copy send went out; returns its id */
+static inline uint32_t zc_sent(size_t len)
+{
+	zc_stats.sends++;
+	zc_stats.bytes += len;
+	return zc_next++;
+}
+
+/* Sends lo..hi are complete: their buffers go back to the pool */
+static inline void zc_completed(uint32_t lo, uint32_t hi, int copied)
+{
+	int i, j;
+
+	zc_stats.copied += copied ? hi - lo + 1 : 0;
+	if ((int32_t)(hi + 1 - zc_done) > 0)
+		zc_done = hi + 1;
+	for (i = 0, j = 0; i < zc_nheld; i++)
+		if ((int32_t)(zc_hold_list[i].id - zc_done) < 0)
+			bufpool_put(zc_hold_list[i].buf);
+		else
+			zc_hold_list[j++] = zc_hold_list[i];
+	zc_nheld = j;
+}
+
+/* Keep buf until the last zero-copy send so far is complete; 0, or -1 when the list is full */
+static inline int zc_hold(void *buf)
+{
+	if ((int32_t)(zc_next - zc_done) <= 0)
+	{
+		bufpool_put(buf);					//nothing in flight
+		return 0;
+	}
+	if (zc_nheld == ZC_MAX_HELD)
+		return -1;
+	zc_hold_list[zc_nheld].buf = buf;
+	zc_hold_list[zc_nheld++].id = zc_next - 1;
+	return 0;
+}
+
+/* Take the completions of MSG_ZEROCOPY sends off the error queue of sockfd; with wait,
+return only once a held buffer was given back (or none is held) */
+static inline void zc_reap(int sockfd, int wait)
+{
+	struct pollfd pfd = {.fd = sockfd, .events = 0};	//the error queue shows as POLLERR
+	struct sock_extended_err *ee;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	char control[128];
+	int held = zc_nheld;
+
+	for (;;)
+	{
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if (recvmsg(sockfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+		{
+			if (errno == EINTR || (errno == EAGAIN && wait && zc_nheld == held && held > 0 &&
+								   poll(&pfd, 1, ZC_WAIT_MS) != -1))
+				continue;
+			return;
+		}
+		for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm))
+		{
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0)
+				zc_completed(ee->ee_info, ee->ee_data, ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+}
+
+/* Send len bytes of file fd from offset to sockfd without copying them through user
+memory; len, or -1 (part of it may have been sent) */
+static inline ssize_t zc_send_file(int sockfd, int fd, off_t offset, size_t len)
+{
+	int64_t off = offset;				//loff_t
+	size_t sent = 0;
+	ssize_t in, out;
+
+	if (zc_pipe[0] == -1 && pipe(zc_pipe) == -1)
+		return -1;
+	while (sent < len)
+	{
+		in = syscall(SYS_splice, fd, &off, zc_pipe[1], NULL, len - sent < ZC_PIPE_SIZE ? len - sent : ZC_PIPE_SIZE,
+					 ZC_SPLICE_MOVE | ZC_SPLICE_MORE);
+		if (in <= 0)
+			return -1;
+		for (; in > 0; in -= out, sent += out)
+			if ((out = syscall(SYS_splice, zc_pipe[0], NULL, sockfd, NULL, in,
+							   ZC_SPLICE_MOVE | (sent + in < len ? ZC_SPLICE_MORE : 0))) <= 0)
+			{
+				/* what is left in the pipe would go out with the next file */
+				close(zc_pipe[0]);
+				close(zc_pipe[1]);
+				zc_pipe[0] = zc_pipe[1] = -1;
+				return -1;
+			}
+	}
+	return len;
+}
+
+#endif /* ZEROCOPY_H */
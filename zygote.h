@@ -0,0 +1,166 @@
+/*
+Zygote of a microserver: started once, forks ready replicas when asked
+(the elastic pools of mainserver -A, see autoscale.h).
+
+The controller starts the microserver executable with -Z fd, fd being the
+microserver's end of a SOCK_SEQPACKET socketpair. The microserver reads
+its options and maps the log as always, then waits for messages instead
+of serving:
+
+	ZYGOTE_SPAWN		bind a UDP socket to a free port and fork; the
+				child serves on that socket (as with -l) until it
+				is killed, the zygote answers ZYGOTE_SPAWNED with
+				the child's pid and port (pid -1: it failed)
+	ZYGOTE_RETIRE pid	SIGTERM to that replica
+
+and reports every replica that ended with ZYGOTE_EXITED. The socket is
+bound before the fork, so the port takes datagrams from the moment it is
+reported: a new replica costs one fork of an initialized process, no exec
+and no wait. The zygote ends when the controller's end of the socketpair
+closes, and its replicas with it (PR_SET_PDEATHSIG).
+
+Usage:
+	fd = zygote_start(path, logfile, &pid);		//controller: fork + exec the microserver with -Z
+	zygote_send(fd, ZYGOTE_SPAWN, 0, 0);		//answers and exits come back as struct zygote_msg
+	s = zygote_main(fd, address);				//microserver: returns only in a replica, its socket
+*/
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* Manifest constants */
+#define ZYGOTE_REAP_MS 1000			/* zygote looks for ended replicas at least this often */
+
+/* Messages, both ways */
+#define ZYGOTE_SPAWN 1
+#define ZYGOTE_SPAWNED 2
+#define ZYGOTE_RETIRE 3
+#define ZYGOTE_EXITED 4
+
+struct zygote_msg
+{
+	int op;
+	pid_t pid;
+	int port;
+};
+
+static inline int zygote_send(int fd, int op, pid_t pid, int port)
+{
+	struct zygote_msg m = {op, pid, port};
+
+	return send(fd, &m, sizeof(m), MSG_NOSIGNAL) == sizeof(m) ? 0 : -1;
+}
+
+/* Controller: start the microserver at path as a zygote; returns the controller's end
+of the socketpair and sets *pid, or -1 */
+static inline int zygote_start(const char *path, const char *logfile, pid_t *pid)
+{
+	char fdarg[16];
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+		return -1;
+	if ((*pid = fork()) == -1)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (*pid == 0)
+	{
+		close(sv[0]);
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+		char *args[] = {(char *)path, "-Z", fdarg, "-g", (char *)logfile, NULL};
+		execvp(args[0], args);
+		fprintf(stderr, "zygote: cannot run %s: %s\n", path, strerror(errno));
+		_exit(127);
+	}
+	close(sv[1]);
+	return sv[0];
+}
+
+static void zygote_sigchld(int sig)
+{
+}
+
+/* Microserver: serve the controller on fd. Returns only in a new replica, with the
+UDP socket it is to serve on; the zygote itself exits when the controller is gone */
+static inline int zygote_main(int fd, struct in_addr address)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	struct sigaction sc;
+	struct sockaddr_in sa;
+	struct zygote_msg m;
+	socklen_t salen;
+	pid_t pid;
+	ssize_t n;
+	int s;
+
+	/* ended replicas interrupt poll() (no SA_RESTART) to be reaped and reported */
+	memset(&sc, 0, sizeof(sc));
+	sc.sa_handler = zygote_sigchld;
+	sigemptyset(&sc.sa_mask);
+	sigaction(SIGCHLD, &sc, NULL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	for (;;)
+	{
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+			zygote_send(fd, ZYGOTE_EXITED, pid, 0);
+		if (poll(&pfd, 1, ZYGOTE_REAP_MS) <= 0)
+			continue;
+		if ((n = recv(fd, &m, sizeof(m), 0)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			_exit(0);						//the controller is gone
+		if (n != sizeof(m))
+			continue;
+		if (m.op == ZYGOTE_RETIRE && m.pid > 0)
+		{
+			kill(m.pid, SIGTERM);
+			continue;
+		}
+		if (m.op != ZYGOTE_SPAWN)
+			continue;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = 0;					//any free port
+		sa.sin_addr = address;
+		salen = sizeof(sa);
+		if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1 || bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+			getsockname(s, (struct sockaddr *)&sa, &salen) == -1)
+		{
+			if (s != -1)
+				close(s);
+			zygote_send(fd, ZYGOTE_SPAWNED, -1, 0);
+			continue;
+		}
+		if ((pid = fork()) == 0)
+		{
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid() == 1)
+				_exit(0);					//the zygote ended before the line above
+			signal(SIGCHLD, SIG_DFL);
+			close(fd);
+			return s;
+		}
+		close(s);
+		zygote_send(fd, ZYGOTE_SPAWNED, pid, pid == -1 ? 0 : ntohs(sa.sin_port));
+	}
+}
+
+#endif /* ZYGOTE_H */